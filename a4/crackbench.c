@@ -0,0 +1,672 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <crypt.h>
+#include <time.h>
+#include <netdb.h>
+#include "dictionary.h"
+#include "protocol.h"
+
+// Max and min values
+#define MAX_ARGS 17
+#define MAX_CONNECTIONS 1000
+#define MAX_CRACK_THREADS 50
+#define BUFFER_SIZE 256
+
+// Defaults for options that aren't given
+#define DEFAULT_DICTIONARY "words.txt"
+#define DEFAULT_CONNECTIONS 4
+#define DEFAULT_REQUESTS 100
+#define DEFAULT_HIT_RATIO 0.5
+#define DEFAULT_CRYPT_RATIO 0.5
+#define DEFAULT_CRACK_THREADS 1
+
+// Seed for the generator, so that runs send the same requests
+#define BENCH_SEED 2310
+#define MICROS_PER_SECOND 1000000
+#define SALT_CHARS "./0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZ"\
+    "abcdefghijklmnopqrstuvwxyz"
+#define MISS_CHARS "!$%&*+-=?@^_~"
+
+// Server responses
+#define SERVER_INVALID ":invalid"
+#define SERVER_FAILED ":failed"
+
+// Error messages
+#define USAGE_MESSAGE "Usage: crackbench [--connections count] [--requests "\
+    "count] [--rate persecond] [--hit-ratio fraction] [--crypt-ratio "\
+    "fraction] [--threads count] [--dictionary filename] [--jobfile "\
+    "filename] portnum\n"
+#define DICTIONARY_MESSAGE "crackbench: unable to open dictionary file "\
+    "\"%s\"\n"
+#define EMPTY_MESSAGE "crackbench: no plain text words in dictionary file "\
+    "\"%s\"\n"
+#define JOB_FILE_MESSAGE "crackbench: unable to open job file \"%s\"\n"
+#define CONNECTION_ERROR_MESSAGE "crackbench: unable to connect to port %s\n"
+#define TERMINATE_MESSAGE "crackbench: server connection terminated\n"
+
+// Enum to hold exit statuses
+typedef enum {
+    USAGE_ERROR = 1,
+    DICT_FILE_ERROR = 2,
+    JOB_FILE_ERROR = 3,
+    CONNECTION_ERROR = 4,
+    CONNECTION_TERMINATED = 5,
+    NO_WORDS_ERROR = 6,
+    OK = 0
+} ExitStatus;
+
+// Struct that holds the information for the benchmark, specified on the
+// command line. rate is 0 for a closed-loop run.
+typedef struct {
+    const char* portNum;
+    char* dictFileName;
+    char* jobFileName;
+    int numConnections;
+    int numRequests;
+    double rate;
+    double hitRatio;
+    double cryptRatio;
+    int crackThreads;
+} BenchDetails;
+
+// A request to send to the server, and what happened to it. sendMicros is
+// when it was sent (or, in an open loop, when it was due to be sent).
+typedef struct {
+    char* line;
+    bool crack;
+    int responsesLeft;
+    uint64_t sendMicros;
+    uint64_t latency;
+    int numFailed;
+    int numInvalid;
+} BenchRequest;
+
+// Struct shared by every connection's thread. Request i is sent on connection
+// i % numConnections, tagged with its index as the request ID.
+typedef struct {
+    BenchDetails* details;
+    BenchRequest* requests;
+    int* fds;
+    uint64_t startMicros;
+} Bench;
+
+// Struct that is passed to each connection's thread(s)
+typedef struct {
+    Bench* bench;
+    int connection;
+} BenchConnection;
+
+// Function prototypes
+BenchDetails parse_command_line(int argc, char** argv);
+int parse_count(const char* arg, int max);
+double parse_fraction(const char* arg);
+BenchRequest* generate_requests(BenchDetails* details);
+BenchRequest* read_job_file(BenchDetails* details);
+int setup_connection(const char* port);
+void* closed_loop_thread(void* v);
+void* open_loop_thread(void* v);
+void* receive_thread(void* v);
+bool receive_response(Bench* bench, FILE* in);
+void send_request(Bench* bench, int index, FILE* out);
+void report(Bench* bench, uint64_t elapsed);
+void report_latencies(Bench* bench, bool crack);
+int compare_latencies(const void* a, const void* b);
+uint64_t now_micros(void);
+void usage_error(void);
+void terminated_error(void);
+
+int main(int argc, char** argv) {
+    BenchDetails details = parse_command_line(argc, argv);
+    Bench bench = {.details = &details};
+
+    if (details.jobFileName) {
+        bench.requests = read_job_file(&details);
+    } else {
+        bench.requests = generate_requests(&details);
+    }
+
+    bench.fds = malloc(sizeof(int) * details.numConnections);
+    for (int i = 0; i < details.numConnections; i++) {
+        bench.fds[i] = setup_connection(details.portNum);
+        if (bench.fds[i] < 0) {
+            fprintf(stderr, CONNECTION_ERROR_MESSAGE, details.portNum);
+            exit(CONNECTION_ERROR);
+        }
+    }
+
+    pthread_t tids[details.numConnections];
+    BenchConnection connections[details.numConnections];
+    bench.startMicros = now_micros();
+    for (int i = 0; i < details.numConnections; i++) {
+        connections[i].bench = &bench;
+        connections[i].connection = i;
+        pthread_create(&tids[i], 0, details.rate ? open_loop_thread
+                : closed_loop_thread, &connections[i]);
+    }
+    for (int i = 0; i < details.numConnections; i++) {
+        pthread_join(tids[i], NULL);
+    }
+    report(&bench, now_micros() - bench.startMicros);
+    return OK;
+}
+
+/* parse_command_line()
+ * --------------------
+ * Checks the command line arguments and puts them into a BenchDetails
+ * struct. The port number must be given last. If incorrect arguments were
+ * given, it prints the usage message and exits.
+ *
+ * argc: number of arguments passed to the program
+ * argv: arguments passed to the program
+ *
+ * Returns: BenchDetails struct containing the options for the benchmark
+ */
+BenchDetails parse_command_line(int argc, char** argv) {
+    BenchDetails details = {.portNum = NULL, .dictFileName = NULL,
+            .jobFileName = NULL, .numConnections = 0, .numRequests = 0,
+            .rate = -1, .hitRatio = -1, .cryptRatio = -1, .crackThreads = 0};
+    // Skip program name
+    argc--;
+    argv++;
+
+    // Options come in pairs, followed by the port number
+    if (argc > MAX_ARGS || argc % 2 == 0) {
+        usage_error();
+    }
+
+    while (argc > 1) {
+        if (strcmp(argv[0], "--connections") == 0 && !details.numConnections) {
+            details.numConnections = parse_count(argv[1], MAX_CONNECTIONS);
+        } else if (strcmp(argv[0], "--requests") == 0
+                && !details.numRequests) {
+            details.numRequests = parse_count(argv[1], INT32_MAX);
+        } else if (strcmp(argv[0], "--rate") == 0 && details.rate < 0) {
+            char* end;
+            details.rate = strtod(argv[1], &end);
+            if (*end != '\0' || !(details.rate > 0)) {
+                usage_error();
+            }
+        } else if (strcmp(argv[0], "--hit-ratio") == 0
+                && details.hitRatio < 0) {
+            details.hitRatio = parse_fraction(argv[1]);
+        } else if (strcmp(argv[0], "--crypt-ratio") == 0
+                && details.cryptRatio < 0) {
+            details.cryptRatio = parse_fraction(argv[1]);
+        } else if (strcmp(argv[0], "--threads") == 0 && !details.crackThreads) {
+            details.crackThreads = parse_count(argv[1], MAX_CRACK_THREADS);
+        } else if (strcmp(argv[0], "--dictionary") == 0
+                && !details.dictFileName) {
+            details.dictFileName = argv[1];
+        } else if (strcmp(argv[0], "--jobfile") == 0 && !details.jobFileName) {
+            details.jobFileName = argv[1];
+        } else {
+            usage_error(); // If additional or duplicates args are provided
+        }
+        argc -= 2;
+        argv += 2;
+    }
+    if (argv[0][0] == '\0' || strncmp(argv[0], "--", 2) == 0) {
+        usage_error();
+    }
+    details.portNum = argv[0];
+
+    if (!details.numConnections) {
+        details.numConnections = DEFAULT_CONNECTIONS;
+    }
+    if (!details.numRequests) {
+        details.numRequests = DEFAULT_REQUESTS;
+    }
+    if (details.rate < 0) {
+        details.rate = 0; // Closed loop
+    }
+    if (details.hitRatio < 0) {
+        details.hitRatio = DEFAULT_HIT_RATIO;
+    }
+    if (details.cryptRatio < 0) {
+        details.cryptRatio = DEFAULT_CRYPT_RATIO;
+    }
+    if (!details.crackThreads) {
+        details.crackThreads = DEFAULT_CRACK_THREADS;
+    }
+    if (!details.dictFileName) {
+        details.dictFileName = DEFAULT_DICTIONARY;
+    }
+    return details;
+}
+
+/* parse_count()
+ * -------------
+ * Converts a command line argument to a whole number from 1 to max. If it
+ * isn't one, the usage error is printed and the program exits.
+ *
+ * arg: the argument
+ * max: largest number allowed
+ *
+ * Returns: the number
+ */
+int parse_count(const char* arg, int max) {
+    char* end;
+    long count = strtol(arg, &end, 10);
+
+    if (*arg == '\0' || *end != '\0' || count < 1 || count > max) {
+        usage_error();
+    }
+    return count;
+}
+
+/* parse_fraction()
+ * ----------------
+ * Converts a command line argument to a fraction from 0 to 1. If it isn't
+ * one, the usage error is printed and the program exits.
+ *
+ * arg: the argument
+ *
+ * Returns: the fraction
+ */
+double parse_fraction(const char* arg) {
+    char* end;
+    double fraction = strtod(arg, &end);
+
+    if (*arg == '\0' || *end != '\0' || !(fraction >= 0 && fraction <= 1)) {
+        usage_error();
+    }
+    return fraction;
+}
+
+/* generate_requests()
+ * -------------------
+ * Generates a mix of crack and crypt requests from the words in the
+ * dictionary. cryptRatio of the requests are crypts of a random word, and the
+ * rest are cracks. hitRatio of the cracks are of a random dictionary word
+ * (so the server will find it), and the rest are of a random string made of
+ * characters that dictionary words don't have (so it has to hash the whole
+ * dictionary). The same requests are generated every run.
+ *
+ * details: options for the benchmark
+ *
+ * Returns: array of numRequests requests
+ */
+BenchRequest* generate_requests(BenchDetails* details) {
+    BenchRequest* requests = calloc(details->numRequests,
+            sizeof(BenchRequest));
+    struct crypt_data* data = calloc(1, sizeof(struct crypt_data));
+    unsigned int seed = BENCH_SEED;
+    Dictionary dict;
+
+    DictionaryStatus status = read_dictionary(details->dictFileName, 0,
+            &dict);
+    if (status == DICTIONARY_UNREADABLE) {
+        fprintf(stderr, DICTIONARY_MESSAGE, details->dictFileName);
+        exit(DICT_FILE_ERROR);
+    } else if (status == DICTIONARY_EMPTY) {
+        fprintf(stderr, EMPTY_MESSAGE, details->dictFileName);
+        exit(NO_WORDS_ERROR);
+    }
+
+    for (int i = 0; i < details->numRequests; i++) {
+        BenchRequest* request = &requests[i];
+        char salt[3] = {SALT_CHARS[rand_r(&seed) % 64],
+                SALT_CHARS[rand_r(&seed) % 64], '\0'};
+        char miss[MAX_WORD_LENGTH + 1];
+        const char* word = dict.words[rand_r(&seed) % dict.numWords];
+        char line[BUFFER_SIZE];
+
+        request->crack = rand_r(&seed) >= details->cryptRatio * RAND_MAX;
+        if (request->crack && rand_r(&seed) >= details->hitRatio * RAND_MAX) {
+            for (int j = 0; j < MAX_WORD_LENGTH; j++) {
+                miss[j] = MISS_CHARS[rand_r(&seed) % strlen(MISS_CHARS)];
+            }
+            miss[MAX_WORD_LENGTH] = '\0';
+            word = miss;
+        }
+        if (request->crack) {
+            sprintf(line, "crack %s %d", crypt_r(word, salt, data),
+                    details->crackThreads);
+        } else {
+            sprintf(line, "crypt %s %s", word, salt);
+        }
+        request->line = strdup(line);
+        request->responsesLeft = 1;
+    }
+    free(data);
+    free_dictionary(dict);
+    return requests;
+}
+
+/* read_job_file()
+ * ---------------
+ * Reads the commands in a job file (skipping blank lines and comments, like
+ * crackclient), repeating them in order until there are numRequests of them.
+ *
+ * details: options for the benchmark
+ *
+ * Returns: array of numRequests requests
+ */
+BenchRequest* read_job_file(BenchDetails* details) {
+    BenchRequest* requests = calloc(details->numRequests,
+            sizeof(BenchRequest));
+    FILE* jobFile = fopen(details->jobFileName, "r");
+    char** lines = NULL;
+    int numLines = 0;
+    char* line = NULL;
+    size_t size = 0;
+    ssize_t length;
+
+    if (!jobFile) {
+        fprintf(stderr, JOB_FILE_MESSAGE, details->jobFileName);
+        exit(JOB_FILE_ERROR);
+    }
+    while ((length = getline(&line, &size, jobFile)) >= 0) {
+        if (length && line[length - 1] == '\n') {
+            line[--length] = '\0';
+        }
+        if (line[0] == '#' || line[0] == '\0') {
+            continue;
+        }
+        lines = realloc(lines, sizeof(char*) * (numLines + 1));
+        lines[numLines++] = strdup(line);
+    }
+    free(line);
+    fclose(jobFile);
+    if (!numLines) {
+        fprintf(stderr, JOB_FILE_MESSAGE, details->jobFileName);
+        exit(JOB_FILE_ERROR);
+    }
+
+    for (int i = 0; i < details->numRequests; i++) {
+        requests[i].line = lines[i % numLines];
+        requests[i].crack = strncmp(lines[i % numLines], "crack", 5) == 0;
+        requests[i].responsesLeft = expected_responses(requests[i].line);
+    }
+    free(lines);
+    return requests;
+}
+
+/* setup_connection()
+ * ------------------
+ * Sets up a connection with a server listening on a given port.
+ *
+ * port: port that the server is listening on.
+ *
+ * Returns: file descriptor for communicating with the server, or -1 if it
+ * couldn't connect
+ */
+int setup_connection(const char* port) {
+    struct addrinfo* ai = 0;
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(struct addrinfo));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+
+    if (getaddrinfo("localhost", port, &hints, &ai)) {
+        freeaddrinfo(ai);
+        return -1;
+    }
+
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (connect(fd, ai->ai_addr, sizeof(struct sockaddr))) {
+        freeaddrinfo(ai);
+        return -1;
+    }
+    freeaddrinfo(ai);
+    return fd;
+}
+
+/* closed_loop_thread()
+ * --------------------
+ * Function that is ran by each connection's thread in a closed-loop run. It
+ * sends the connection's requests one at a time, waiting for each one to be
+ * answered before sending the next, so the server sets the pace.
+ *
+ * v: void pointer to the connection's BenchConnection struct
+ */
+void* closed_loop_thread(void* v) {
+    BenchConnection* conn = (BenchConnection*)v;
+    Bench* bench = conn->bench;
+    int fd = bench->fds[conn->connection];
+    FILE* out = fdopen(fd, "w");
+    FILE* in = fdopen(dup(fd), "r");
+
+    for (int i = conn->connection; i < bench->details->numRequests;
+            i += bench->details->numConnections) {
+        bench->requests[i].sendMicros = now_micros();
+        send_request(bench, i, out);
+        while (!receive_response(bench, in)) {
+        }
+    }
+    fclose(in);
+    fclose(out);
+    return NULL;
+}
+
+/* open_loop_thread()
+ * ------------------
+ * Function that is ran by each connection's sending thread in an open-loop
+ * run. Requests are due at a fixed rate across all connections, and each one
+ * is sent when it is due whether or not earlier ones have been answered. A
+ * second thread reads the responses. Latency is measured from when a request
+ * was due, so a server that falls behind (and holds up the sending) shows up
+ * in the latencies.
+ *
+ * v: void pointer to the connection's BenchConnection struct
+ */
+void* open_loop_thread(void* v) {
+    BenchConnection* conn = (BenchConnection*)v;
+    Bench* bench = conn->bench;
+    int fd = bench->fds[conn->connection];
+    FILE* out = fdopen(fd, "w");
+    pthread_t receiver;
+
+    pthread_create(&receiver, 0, receive_thread, conn);
+    for (int i = conn->connection; i < bench->details->numRequests;
+            i += bench->details->numConnections) {
+        uint64_t due = bench->startMicros
+                + (uint64_t)((uint64_t)i * MICROS_PER_SECOND
+                / bench->details->rate);
+        uint64_t now = now_micros();
+        if (due > now) {
+            usleep(due - now);
+        }
+        bench->requests[i].sendMicros = due;
+        send_request(bench, i, out);
+    }
+    pthread_join(receiver, NULL);
+    fclose(out);
+    return NULL;
+}
+
+/* receive_thread()
+ * ----------------
+ * Function that is ran by each connection's receiving thread in an open-loop
+ * run. It reads responses until every one of the connection's requests has
+ * been answered.
+ *
+ * v: void pointer to the connection's BenchConnection struct
+ */
+void* receive_thread(void* v) {
+    BenchConnection* conn = (BenchConnection*)v;
+    Bench* bench = conn->bench;
+    FILE* in = fdopen(dup(bench->fds[conn->connection]), "r");
+
+    for (int i = conn->connection; i < bench->details->numRequests;
+            i += bench->details->numConnections) {
+        while (!receive_response(bench, in)) {
+        }
+    }
+    fclose(in);
+    return NULL;
+}
+
+/* receive_response()
+ * ------------------
+ * Reads one response line and adds it to the request it answers (found from
+ * the request ID it is tagged with). Once a request has all of its responses
+ * its latency is recorded. If the server hangs up, the program exits.
+ *
+ * bench: the benchmark
+ * in: file to read responses from
+ *
+ * Returns: whether the response finished its request
+ */
+bool receive_response(Bench* bench, FILE* in) {
+    char buffer[BUFFER_SIZE];
+    char* result;
+
+    if (!fgets(buffer, sizeof(buffer), in)) {
+        terminated_error();
+    }
+    buffer[strcspn(buffer, "\n")] = '\0';
+    int index = strtol(buffer + 1, &result, 10);
+    if (buffer[0] != '#' || index < 0 || index >= bench->details->numRequests
+            || *result != ' ') {
+        terminated_error(); // Not a response to one of our requests
+    }
+    result++;
+
+    BenchRequest* request = &bench->requests[index];
+    if (strcmp(result, SERVER_FAILED) == 0) {
+        request->numFailed++;
+    } else if (strcmp(result, SERVER_INVALID) == 0) {
+        request->numInvalid++;
+    }
+    if (--request->responsesLeft) {
+        return false;
+    }
+    request->latency = now_micros() - request->sendMicros;
+    return true;
+}
+
+/* send_request()
+ * --------------
+ * Sends a request to the server, tagged with its index as the request ID.
+ *
+ * bench: the benchmark
+ * index: index of the request
+ * out: file to send the request to
+ */
+void send_request(Bench* bench, int index, FILE* out) {
+    fprintf(out, "#%d %s\n", index, bench->requests[index].line);
+    fflush(out);
+}
+
+/* report()
+ * --------
+ * Prints the results of the benchmark - the number of requests and how they
+ * were answered, the throughput, and the latency percentiles of cracks and
+ * crypts.
+ *
+ * bench: the benchmark
+ * elapsed: how long the benchmark took in microseconds
+ */
+void report(Bench* bench, uint64_t elapsed) {
+    BenchDetails* details = bench->details;
+    int numCracks = 0, numFailed = 0, numInvalid = 0;
+
+    for (int i = 0; i < details->numRequests; i++) {
+        numCracks += bench->requests[i].crack;
+        numFailed += bench->requests[i].numFailed;
+        numInvalid += bench->requests[i].numInvalid;
+    }
+    if (details->rate) {
+        printf("Mode: open loop at %.1f requests/s, %d connections\n",
+                details->rate, details->numConnections);
+    } else {
+        printf("Mode: closed loop, %d connections\n", details->numConnections);
+    }
+    printf("Requests: %d (%d crack, %d other)\n", details->numRequests,
+            numCracks, details->numRequests - numCracks);
+    printf("Failed responses: %d\nInvalid responses: %d\n", numFailed,
+            numInvalid);
+    printf("Elapsed: %.3f s\nThroughput: %.1f requests/s\n",
+            (double)elapsed / MICROS_PER_SECOND,
+            elapsed ? (double)details->numRequests * MICROS_PER_SECOND
+            / elapsed : 0.0);
+    report_latencies(bench, true);
+    report_latencies(bench, false);
+}
+
+/* report_latencies()
+ * ------------------
+ * Prints the 50th, 90th and 99th percentile and maximum latencies of either
+ * the crack requests or the other requests.
+ *
+ * bench: the benchmark
+ * crack: whether to report the crack requests
+ */
+void report_latencies(Bench* bench, bool crack) {
+    uint64_t* latencies = malloc(sizeof(uint64_t)
+            * bench->details->numRequests);
+    int count = 0;
+
+    for (int i = 0; i < bench->details->numRequests; i++) {
+        if (bench->requests[i].crack == crack) {
+            latencies[count++] = bench->requests[i].latency;
+        }
+    }
+    if (count) {
+        qsort(latencies, count, sizeof(uint64_t), compare_latencies);
+        // Nearest rank: the smallest latency that count * p requests are
+        // at or below
+        printf("%s latency: p50 %luus, p90 %luus, p99 %luus, max %luus\n",
+                crack ? "Crack" : "Other",
+                (unsigned long)latencies[(count - 1) / 2],
+                (unsigned long)latencies[(count * 9 + 9) / 10 - 1],
+                (unsigned long)latencies[(count * 99 + 99) / 100 - 1],
+                (unsigned long)latencies[count - 1]);
+    }
+    free(latencies);
+}
+
+/* compare_latencies()
+ * -------------------
+ * Comparison function for qsort() that orders latencies from smallest to
+ * largest.
+ *
+ * a: pointer to the first latency
+ * b: pointer to the second latency
+ *
+ * Returns: negative, zero or positive if a is less than, equal to or greater
+ * than b
+ */
+int compare_latencies(const void* a, const void* b) {
+    uint64_t latencyA = *(const uint64_t*)a;
+    uint64_t latencyB = *(const uint64_t*)b;
+    return (latencyA > latencyB) - (latencyA < latencyB);
+}
+
+/* now_micros()
+ * ------------
+ * Reads the monotonic clock, which is used to time requests.
+ *
+ * Returns: the time in microseconds
+ */
+uint64_t now_micros(void) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * MICROS_PER_SECOND + now.tv_nsec / 1000;
+}
+
+/* usage_error()
+ * -------------
+ * Prints the usage error to stderr and exits with the appropriate status.
+ */
+void usage_error(void) {
+    fprintf(stderr, USAGE_MESSAGE);
+    exit(USAGE_ERROR);
+}
+
+/* terminated_error()
+ * ------------------
+ * Prints the connection terminated error to stderr and exits with the
+ * appropriate status.
+ */
+void terminated_error(void) {
+    fprintf(stderr, TERMINATE_MESSAGE);
+    exit(CONNECTION_TERMINATED);
+}
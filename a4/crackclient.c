@@ -6,6 +6,7 @@
 #include <netdb.h>
 #include <csse2310a4.h>
 #include <csse2310a3.h>
+#include "protocol.h"
 
 #define MAX_ARGS 2
 #define MIN_ARGS 1
@@ -102,16 +103,22 @@ void communicate_with_server(int connFD, char* jobFile) {
             continue;
         }
         // Send line to server
+        int numResponses = expected_responses(line);
         send_command(line, out);
 
-        // Check if connection was terminated
-        if (!fgets(buffer, sizeof(buffer) - 1, in)) {
-            terminated = true;
+        for (int i = 0; i < numResponses && !terminated; i++) {
+            // Check if connection was terminated
+            if (!fgets(buffer, sizeof(buffer) - 1, in)) {
+                terminated = true;
+                break;
+            }
+
+            // Interpret server reponse
+            handle_response(buffer);
+        }
+        if (terminated) {
             break;
         }
-
-        // Interpret server reponse
-        handle_response(buffer);
     }
     fclose(inputSource);
     fclose(in);
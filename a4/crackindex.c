@@ -0,0 +1,321 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include "descrypt.h"
+#include "dictionary.h"
+#include "indexfile.h"
+
+// Max and min values
+#define MAX_ARGS 7
+#define MIN_THREADS 1
+#define MAX_THREADS 256
+
+// Default dictionary used if none is specified (same as crackserver)
+#define DEFAULT_DICTIONARY "/usr/share/dict/words"
+
+// Error messages
+#define USAGE_MESSAGE "Usage: crackindex [--dictionary filename] "\
+    "[--threads count] [--long-words skip|truncate] indexfile\n"
+#define DICTIONARY_MESSAGE "crackindex: unable to open dictionary file "\
+    "\"%s\"\n"
+#define EMPTY_MESSAGE "crackindex: no plain text words to test\n"
+#define WRITE_MESSAGE "crackindex: unable to write index file \"%s\"\n"
+
+// Enum to hold exit statuses
+typedef enum {
+    USAGE_ERROR = 1,
+    DICT_FILE_ERROR = 2,
+    NO_WORDS_ERROR = 3,
+    WRITE_ERROR = 4,
+    OK = 0
+} ExitStatus;
+
+// Struct that holds the information for the tool, specified on the command
+// line
+typedef struct {
+    char* dictFileName;
+    char* indexFileName;
+    int numThreads;
+    const char* longWords;
+} IndexDetails;
+
+// Struct shared by the threads building the index. Each thread takes the next
+// salt that hasn't been started until every salt has been written.
+typedef struct {
+    Dictionary* dict;
+    int fd;
+    int nextSalt;
+    bool failed;
+    pthread_mutex_t lock;
+} IndexBuild;
+
+// Function prototypes
+IndexDetails parse_command_line(int argc, char** argv);
+void* index_thread(void* v);
+bool write_salt_table(IndexBuild* build, int salt, IndexFileEntry* entries);
+bool write_all(int fd, const void* data, size_t length, off_t offset);
+int compare_file_entries(const void* a, const void* b);
+int default_threads(void);
+void usage_error(void);
+
+int main(int argc, char** argv) {
+    IndexDetails details = parse_command_line(argc, argv);
+    Dictionary dict;
+    IndexBuild build;
+
+    // Read the same way as crackserver, so that the checksums match
+    int flags = DICTIONARY_DEDUP;
+    if (strcmp(details.longWords, "truncate") == 0) {
+        flags |= DICTIONARY_TRUNCATE;
+    }
+    DictionaryStatus status = read_dictionary(details.dictFileName, flags,
+            &dict);
+    if (status == DICTIONARY_UNREADABLE) {
+        fprintf(stderr, DICTIONARY_MESSAGE, details.dictFileName);
+        exit(DICT_FILE_ERROR);
+    } else if (status == DICTIONARY_EMPTY) {
+        fprintf(stderr, EMPTY_MESSAGE);
+        exit(NO_WORDS_ERROR);
+    }
+
+    build.dict = &dict;
+    build.nextSalt = 0;
+    build.failed = false;
+    pthread_mutex_init(&build.lock, NULL);
+    build.fd = open(details.indexFileName, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+    // Write the header, then let the threads fill in the tables
+    IndexFileHeader header;
+    memcpy(header.magic, INDEX_FILE_MAGIC, INDEX_FILE_MAGIC_LENGTH);
+    header.version = INDEX_FILE_VERSION;
+    header.numWords = dict.numWords;
+    header.checksum = dictionary_checksum(&dict);
+    if (build.fd < 0 || !write_all(build.fd, &header, sizeof(header), 0)) {
+        fprintf(stderr, WRITE_MESSAGE, details.indexFileName);
+        exit(WRITE_ERROR);
+    }
+
+    pthread_t tids[details.numThreads];
+    for (int i = 0; i < details.numThreads; i++) {
+        pthread_create(&tids[i], 0, index_thread, &build);
+    }
+    for (int i = 0; i < details.numThreads; i++) {
+        pthread_join(tids[i], NULL);
+    }
+
+    if (close(build.fd) < 0 || build.failed) {
+        unlink(details.indexFileName); // Don't leave a partial index behind
+        fprintf(stderr, WRITE_MESSAGE, details.indexFileName);
+        exit(WRITE_ERROR);
+    }
+    printf("Indexed %d words with %d salts (%zu bytes)\n", dict.numWords,
+            DES_NUM_SALTS,
+            index_file_table_offset(dict.numWords, DES_NUM_SALTS));
+    free_dictionary(dict);
+    return OK;
+}
+
+/* parse_command_line()
+ * --------------------
+ * Checks the command line arguments and puts them into an IndexDetails
+ * struct. The index file name must be given last. If incorrect arguments were
+ * given, it prints the usage message and exits.
+ *
+ * argc: number of arguments passed to the program
+ * argv: arguments passed to the program
+ *
+ * Returns: IndexDetails struct containing the dictionary, index file name,
+ * number of threads to use and what to do with long words
+ */
+IndexDetails parse_command_line(int argc, char** argv) {
+    IndexDetails details = {.dictFileName = NULL, .indexFileName = NULL,
+            .numThreads = 0, .longWords = NULL};
+    // Skip program name
+    argc--;
+    argv++;
+
+    // Options come in pairs, followed by the index file
+    if (argc > MAX_ARGS || argc % 2 == 0) {
+        usage_error();
+    }
+
+    while (argc > 1) {
+        if (strcmp(argv[0], "--dictionary") == 0 && !details.dictFileName) {
+            details.dictFileName = argv[1];
+        } else if (strcmp(argv[0], "--threads") == 0 && !details.numThreads) {
+            char* end;
+            long numThreads = strtol(argv[1], &end, 10);
+            if (*end != '\0' || numThreads < MIN_THREADS
+                    || numThreads > MAX_THREADS) {
+                usage_error();
+            }
+            details.numThreads = numThreads;
+        } else if (strcmp(argv[0], "--long-words") == 0 && !details.longWords
+                && (strcmp(argv[1], "skip") == 0
+                || strcmp(argv[1], "truncate") == 0)) {
+            details.longWords = argv[1];
+        } else {
+            usage_error(); // If additional or duplicates args are provided
+        }
+        argc -= 2;
+        argv += 2;
+    }
+    if (argv[0][0] == '\0' || strncmp(argv[0], "--", 2) == 0) {
+        usage_error();
+    }
+    details.indexFileName = argv[0];
+
+    if (!details.dictFileName) {
+        details.dictFileName = DEFAULT_DICTIONARY;
+    }
+    if (!details.numThreads) {
+        details.numThreads = default_threads();
+    }
+    if (!details.longWords) {
+        details.longWords = "skip";
+    }
+    return details;
+}
+
+/* index_thread()
+ * --------------
+ * Function that is ran by each thread building the index. It repeatedly
+ * takes the next salt, hashes every dictionary word with it, sorts the hashes
+ * and writes the salt's table to the index file.
+ *
+ * v: void pointer to the IndexBuild struct shared by all threads
+ */
+void* index_thread(void* v) {
+    IndexBuild* build = (IndexBuild*)v;
+    Dictionary* dict = build->dict;
+    IndexFileEntry* entries = malloc(sizeof(IndexFileEntry) * dict->numWords);
+    uint64_t blocks[DES_MAX_BATCH];
+    int batchSize = des_batch_size();
+
+    while (1) {
+        pthread_mutex_lock(&build->lock);
+        int salt = build->failed ? DES_NUM_SALTS : build->nextSalt++;
+        pthread_mutex_unlock(&build->lock);
+        if (salt >= DES_NUM_SALTS) {
+            break;
+        }
+
+        // Salt number back to its 2 characters
+        char saltText[DES_SALT_LENGTH + 1];
+        DesSalt desSalt;
+        saltText[0] = DES_ALPHABET[salt & 0x3f];
+        saltText[1] = DES_ALPHABET[salt >> 6];
+        saltText[2] = '\0';
+        des_salt_init(&desSalt, saltText);
+
+        for (int i = 0; i < dict->numWords; i += batchSize) {
+            int numWords = dict->numWords - i < batchSize ? dict->numWords - i
+                    : batchSize;
+            des_hash_batch(&desSalt, dict->words + i, numWords, blocks);
+            for (int j = 0; j < numWords; j++) {
+                entries[i + j].hashHigh = blocks[j] >> 32;
+                entries[i + j].hashLow = (uint32_t)blocks[j];
+                entries[i + j].word = i + j;
+            }
+        }
+        if (!write_salt_table(build, salt, entries)) {
+            pthread_mutex_lock(&build->lock);
+            build->failed = true;
+            pthread_mutex_unlock(&build->lock);
+        }
+    }
+    free(entries);
+    return NULL;
+}
+
+/* write_salt_table()
+ * ------------------
+ * Sorts the entries for a salt by hash and writes them to their place in the
+ * index file.
+ *
+ * build: IndexBuild struct containing the index file
+ * salt: number of the salt
+ * entries: one entry per dictionary word
+ *
+ * Returns: whether the table was written
+ */
+bool write_salt_table(IndexBuild* build, int salt, IndexFileEntry* entries) {
+    uint32_t numWords = build->dict->numWords;
+
+    qsort(entries, numWords, sizeof(IndexFileEntry), compare_file_entries);
+    return write_all(build->fd, entries, sizeof(IndexFileEntry) * numWords,
+            index_file_table_offset(numWords, salt));
+}
+
+/* write_all()
+ * -----------
+ * Writes all of a buffer to a file at the given offset, retrying after short
+ * writes.
+ *
+ * fd: file to write to
+ * data: data to write
+ * length: number of bytes to write
+ * offset: offset in the file to write at
+ *
+ * Returns: whether everything was written
+ */
+bool write_all(int fd, const void* data, size_t length, off_t offset) {
+    const char* bytes = data;
+
+    while (length) {
+        ssize_t written = pwrite(fd, bytes, length, offset);
+        if (written <= 0) {
+            return false;
+        }
+        bytes += written;
+        length -= written;
+        offset += written;
+    }
+    return true;
+}
+
+/* compare_file_entries()
+ * ----------------------
+ * Comparison function for qsort() that orders index file entries by hash.
+ *
+ * a: pointer to the first IndexFileEntry
+ * b: pointer to the second IndexFileEntry
+ *
+ * Returns: negative, zero or positive if a's hash is less than, equal to or
+ * greater than b's hash
+ */
+int compare_file_entries(const void* a, const void* b) {
+    const IndexFileEntry* entryA = a;
+    const IndexFileEntry* entryB = b;
+    uint64_t hashA = (uint64_t)entryA->hashHigh << 32 | entryA->hashLow;
+    uint64_t hashB = (uint64_t)entryB->hashHigh << 32 | entryB->hashLow;
+    return (hashA > hashB) - (hashA < hashB);
+}
+
+/* default_threads()
+ * -----------------
+ * Works out how many threads to build the index with, which is the number of
+ * processors that are online on this machine.
+ *
+ * Returns: number of threads to use (at least 1)
+ */
+int default_threads(void) {
+    long numProcessors = sysconf(_SC_NPROCESSORS_ONLN);
+    if (numProcessors < MIN_THREADS) {
+        return MIN_THREADS;
+    }
+    return numProcessors > MAX_THREADS ? MAX_THREADS : (int)numProcessors;
+}
+
+/* usage_error()
+ * -------------
+ * Prints the usage error to stderr and exits with the appropriate status.
+ */
+void usage_error(void) {
+    fprintf(stderr, USAGE_MESSAGE);
+    exit(USAGE_ERROR);
+}
@@ -0,0 +1,445 @@
+// Microbenchmarks for crackserver's hot paths. They call crackserver's own
+// functions, so crackserver.c is built in with its main() renamed.
+#define main crackserver_main
+#include "crackserver.c"
+#undef main
+
+// Max number of results, the longest result name and the longest command
+#define MAX_RESULTS 32
+#define MAX_NAME_LENGTH 63
+#define MAX_COMMAND_LENGTH 80
+
+// Iterations of the per-call benchmarks
+#define CRYPT_ITERATIONS 20000
+#define HASH_ITERATIONS 200000
+#define COMMAND_ITERATIONS 100000
+
+// Each crack is run this many times and the fastest is kept, to cut noise
+#define CRACK_REPEATS 3
+
+// Default tolerance when comparing against a baseline (10% worse)
+#define DEFAULT_TOLERANCE 0.1
+
+// Error messages
+#define MICRO_USAGE_MESSAGE "Usage: crackmicro [--dictionary filename] "\
+    "[--baseline filename] [--tolerance fraction]\n"
+#define MICRO_DICTIONARY_MESSAGE "crackmicro: unable to open dictionary file "\
+    "\"%s\"\n"
+#define BASELINE_MESSAGE "crackmicro: unable to read baseline file \"%s\"\n"
+#define REGRESSION_MESSAGE "crackmicro: %s regressed by %.1f%% (%g -> %g %s)\n"
+
+// Enum to hold exit statuses
+typedef enum {
+    MICRO_USAGE_ERROR = 1,
+    MICRO_DICT_ERROR = 2,
+    BASELINE_ERROR = 3,
+    REGRESSION = 4,
+    MICRO_OK = 0
+} MicroStatus;
+
+// Struct that holds the options for the benchmarks, specified on the command
+// line
+typedef struct {
+    char* dictFileName;
+    char* baselineFileName;
+    double tolerance;
+} MicroDetails;
+
+// Result of one benchmark. higherIsBetter says which way a regression goes.
+typedef struct {
+    char name[MAX_NAME_LENGTH + 1];
+    double value;
+    const char* unit;
+    bool higherIsBetter;
+} MicroResult;
+
+// Results of every benchmark that has been run
+typedef struct {
+    MicroResult results[MAX_RESULTS];
+    int numResults;
+} MicroResults;
+
+// Function prototypes
+MicroDetails micro_parse_command_line(int argc, char** argv);
+void micro_usage_error(void);
+void add_result(MicroResults* results, const char* name, double value,
+        const char* unit, bool higherIsBetter);
+void bench_crypt(MicroResults* results, Dictionary* dict);
+void bench_crack_scaling(MicroResults* results, ServerContext* server);
+void bench_dictionary_load(MicroResults* results);
+void bench_process_command(MicroResults* results, ServerContext* server);
+Connection* bench_connection(ServerContext* server);
+void bench_run_command(Connection* conn, const char* command);
+void print_results(MicroResults* results, FILE* out);
+bool compare_baseline(MicroResults* results, const char* baselineName,
+        double tolerance);
+
+int main(int argc, char** argv) {
+    MicroDetails details = micro_parse_command_line(argc, argv);
+    MicroResults* results = calloc(1, sizeof(MicroResults));
+    Dictionary dict;
+
+    des_init();
+    if (read_dictionary(details.dictFileName, DICTIONARY_DEDUP, &dict)
+            != DICTIONARY_OK) {
+        fprintf(stderr, MICRO_DICTIONARY_MESSAGE, details.dictFileName);
+        exit(MICRO_DICT_ERROR);
+    }
+    ServerContext server = {
+            .version = create_dictionary_version(dict, NULL, 0),
+            .stats = configure_stats(false),
+            .pool = create_crack_pool(default_crack_workers()),
+            .index = NULL, .indexFile = NULL, .worker = -1};
+
+    bench_crypt(results, &dict);
+    bench_crack_scaling(results, &server);
+    bench_dictionary_load(results);
+    bench_process_command(results, &server);
+
+    print_results(results, stdout);
+    fflush(stdout);
+    if (details.baselineFileName && !compare_baseline(results,
+            details.baselineFileName, details.tolerance)) {
+        exit(REGRESSION);
+    }
+    return MICRO_OK;
+}
+
+/* micro_parse_command_line()
+ * --------------------------
+ * Checks the command line arguments and puts them into a MicroDetails struct.
+ * If incorrect arguments were given, it prints the usage message and exits.
+ *
+ * argc: number of arguments passed to the program
+ * argv: arguments passed to the program
+ *
+ * Returns: MicroDetails struct containing the dictionary, baseline file and
+ * tolerance
+ */
+MicroDetails micro_parse_command_line(int argc, char** argv) {
+    MicroDetails details = {.dictFileName = NULL, .baselineFileName = NULL,
+            .tolerance = -1};
+    // Skip program name
+    argc--;
+    argv++;
+
+    if (argc % 2) {
+        micro_usage_error();
+    }
+    while (argc) {
+        if (strcmp(argv[0], "--dictionary") == 0 && !details.dictFileName) {
+            details.dictFileName = argv[1];
+        } else if (strcmp(argv[0], "--baseline") == 0
+                && !details.baselineFileName) {
+            details.baselineFileName = argv[1];
+        } else if (strcmp(argv[0], "--tolerance") == 0
+                && details.tolerance < 0) {
+            char* end;
+            details.tolerance = strtod(argv[1], &end);
+            if (*end != '\0' || !(details.tolerance >= 0)) {
+                micro_usage_error();
+            }
+        } else {
+            micro_usage_error(); // If additional or duplicates args are given
+        }
+        argc -= 2;
+        argv += 2;
+    }
+
+    if (!details.dictFileName) {
+        details.dictFileName = DEFAULT_DICTIONARY;
+    }
+    if (details.tolerance < 0) {
+        details.tolerance = DEFAULT_TOLERANCE;
+    }
+    return details;
+}
+
+/* micro_usage_error()
+ * -------------------
+ * Prints the usage error to stderr and exits with the appropriate status.
+ */
+void micro_usage_error(void) {
+    fprintf(stderr, MICRO_USAGE_MESSAGE);
+    exit(MICRO_USAGE_ERROR);
+}
+
+/* add_result()
+ * ------------
+ * Records the result of a benchmark.
+ *
+ * results: results so far
+ * name: name of the benchmark
+ * value: what it measured
+ * unit: unit of the value
+ * higherIsBetter: whether a higher value is an improvement
+ */
+void add_result(MicroResults* results, const char* name, double value,
+        const char* unit, bool higherIsBetter) {
+    MicroResult* result = &results->results[results->numResults++];
+
+    snprintf(result->name, sizeof(result->name), "%s", name);
+    result->value = value;
+    result->unit = unit;
+    result->higherIsBetter = higherIsBetter;
+}
+
+/* bench_crypt()
+ * -------------
+ * Measures the cost of hashing one word - with crypt_r() (as crypt requests
+ * do) and with the DES engine's batches (as the crack workers do).
+ *
+ * results: results to add to
+ * dict: dictionary to take the words from
+ */
+void bench_crypt(MicroResults* results, Dictionary* dict) {
+    struct crypt_data* data = calloc(1, sizeof(struct crypt_data));
+    uint64_t blocks[DES_MAX_BATCH];
+    int batchSize = des_batch_size();
+    DesSalt salt;
+
+    uint64_t start = now_micros();
+    for (int i = 0; i < CRYPT_ITERATIONS; i++) {
+        crypt_call(dict->words[i % dict->numWords], "ab", data);
+    }
+    add_result(results, "crypt_r", (now_micros() - start) * 1000.0
+            / CRYPT_ITERATIONS, "ns/call", false);
+
+    des_salt_init(&salt, "ab");
+    start = now_micros();
+    for (int i = 0; i < HASH_ITERATIONS; i += batchSize) {
+        int first = i % dict->numWords;
+        int numWords = dict->numWords - first < batchSize
+                ? dict->numWords - first : batchSize;
+        des_hash_batch(&salt, dict->words + first, numWords, blocks);
+    }
+    add_result(results, "des_hash_batch", (now_micros() - start) * 1000.0
+            / HASH_ITERATIONS, "ns/word", false);
+    free(data);
+}
+
+/* bench_crack_scaling()
+ * ---------------------
+ * Measures how fast a crack that has to hash the whole dictionary runs with
+ * 1 to MAX_THREADS requested threads, going through process_command() and
+ * the crack worker pool just as a client's crack would. The fastest of
+ * CRACK_REPEATS runs is kept.
+ *
+ * results: results to add to
+ * server: server context with the dictionary and crack worker pool
+ */
+void bench_crack_scaling(MicroResults* results, ServerContext* server) {
+    int threadCounts[] = {1, 2, 4, 8, 16, 32, MAX_THREADS};
+    struct crypt_data* data = calloc(1, sizeof(struct crypt_data));
+    Connection* conn = bench_connection(server);
+    char command[MAX_COMMAND_LENGTH];
+    char name[MAX_NAME_LENGTH + 1];
+
+    // No dictionary word has these characters, so every word is hashed
+    char* cipherText = crypt_call("!!!!!!!!", "ab", data);
+    for (int i = 0; i < (int)(sizeof(threadCounts) / sizeof(int)); i++) {
+        sprintf(command, "crack %s %d", cipherText, threadCounts[i]);
+        uint64_t elapsed = UINT64_MAX;
+        for (int j = 0; j < CRACK_REPEATS; j++) {
+            uint64_t start = now_micros();
+            bench_run_command(conn, command);
+            if (now_micros() - start < elapsed) {
+                elapsed = now_micros() - start;
+            }
+        }
+        sprintf(name, "crack_threads_%d", threadCounts[i]);
+        add_result(results, name, elapsed ? server->version->dict.numWords
+                * (double)MICROS_PER_SECOND / elapsed : 0.0, "words/s", true);
+    }
+    free(data);
+}
+
+/* bench_dictionary_load()
+ * -----------------------
+ * Measures how long fill_dictionary() takes to load dictionaries of
+ * different sizes, which are written to temporary files first.
+ *
+ * results: results to add to
+ */
+void bench_dictionary_load(MicroResults* results) {
+    int sizes[] = {10000, 100000, 1000000};
+    char name[MAX_NAME_LENGTH + 1];
+
+    for (int i = 0; i < (int)(sizeof(sizes) / sizeof(int)); i++) {
+        char fileName[] = "/tmp/crackmicroXXXXXX";
+        int fd = mkstemp(fileName);
+        FILE* file = fdopen(fd, "w");
+        for (int j = 0; j < sizes[i]; j++) {
+            fprintf(file, "w%07d\n", j);
+        }
+        fclose(file);
+
+        uint64_t start = now_micros();
+        Dictionary dict = fill_dictionary(fileName, false);
+        uint64_t elapsed = now_micros() - start;
+        free_dictionary(dict);
+        unlink(fileName);
+        sprintf(name, "dictionary_load_%d", sizes[i]);
+        add_result(results, name, elapsed / 1000.0, "ms", false);
+    }
+}
+
+/* bench_process_command()
+ * -----------------------
+ * Measures the overhead of process_command() for a command that is parsed
+ * and rejected (an invalid salt), and for a crypt command, which adds one
+ * crypt_r() call.
+ *
+ * results: results to add to
+ * server: server context the commands are processed against
+ */
+void bench_process_command(MicroResults* results, ServerContext* server) {
+    Connection* conn = bench_connection(server);
+
+    uint64_t start = now_micros();
+    for (int i = 0; i < COMMAND_ITERATIONS; i++) {
+        bench_run_command(conn, "crypt foo !!");
+    }
+    add_result(results, "process_command_invalid", (now_micros() - start)
+            * 1000.0 / COMMAND_ITERATIONS, "ns/command", false);
+
+    start = now_micros();
+    for (int i = 0; i < COMMAND_ITERATIONS / 10; i++) {
+        bench_run_command(conn, "crypt foo ab");
+    }
+    add_result(results, "process_command_crypt", (now_micros() - start)
+            * 1000.0 / (COMMAND_ITERATIONS / 10), "ns/command", false);
+}
+
+/* bench_connection()
+ * ------------------
+ * Creates a connection that commands can be processed on without a socket.
+ * Its I/O thread is never started - bench_run_command() does its work.
+ *
+ * server: server context the commands are processed against
+ *
+ * Returns: the connection
+ */
+Connection* bench_connection(ServerContext* server) {
+    IoThread* io = calloc(1, sizeof(IoThread));
+
+    io->epollFd = -1;
+    io->eventFd = eventfd(0, 0);
+    io->server = server;
+    io->cryptData = calloc(1, sizeof(struct crypt_data));
+    pthread_mutex_init(&io->lock, NULL);
+    return create_connection(-1, io, NULL);
+}
+
+/* bench_run_command()
+ * -------------------
+ * Processes a command on a benchmark connection and waits for its response,
+ * doing what the I/O thread would when a crack finishes. The response is
+ * then thrown away.
+ *
+ * conn: connection from bench_connection()
+ * command: the command
+ */
+void bench_run_command(Connection* conn, const char* command) {
+    IoThread* io = conn->io;
+    char line[MAX_COMMAND_LENGTH];
+    uint64_t value;
+
+    snprintf(line, sizeof(line), "%s", command);
+    conn->tag[0] = '\0';
+    process_command(line, conn);
+    while (conn->inFlight) {
+        read(io->eventFd, &value, sizeof(value));
+        pthread_mutex_lock(&io->lock);
+        CrackJob* done = io->doneHead;
+        io->doneHead = NULL;
+        pthread_mutex_unlock(&io->lock);
+        while (done) {
+            CrackJob* job = done;
+            done = job->nextDone;
+            conn->inFlight--;
+            conn->plainInFlight = false;
+            crack_job_respond(conn, job);
+        }
+    }
+    conn->outSent = 0;
+    conn->outLength = 0;
+}
+
+/* print_results()
+ * ---------------
+ * Prints the results as JSON, one benchmark per line.
+ *
+ * results: the results
+ * out: where to print them
+ */
+void print_results(MicroResults* results, FILE* out) {
+    fprintf(out, "{\n  \"engine\": \"%s\",\n  \"workers\": %d,\n"
+            "  \"benchmarks\": [\n", des_engine_name(),
+            default_crack_workers());
+    for (int i = 0; i < results->numResults; i++) {
+        MicroResult* result = &results->results[i];
+        fprintf(out, "    {\"name\": \"%s\", \"value\": %.3f, \"unit\": "
+                "\"%s\", \"better\": \"%s\"}%s\n", result->name,
+                result->value, result->unit,
+                result->higherIsBetter ? "higher" : "lower",
+                i + 1 < results->numResults ? "," : "");
+    }
+    fprintf(out, "  ]\n}\n");
+}
+
+/* compare_baseline()
+ * ------------------
+ * Compares the results against a baseline saved from an earlier run's JSON
+ * output. Each benchmark that is worse than the baseline by more than the
+ * tolerance is reported to stderr. Benchmarks that aren't in the baseline
+ * are ignored.
+ *
+ * results: the results
+ * baselineName: name of the baseline file
+ * tolerance: fraction that a benchmark can be worse by
+ *
+ * Returns: whether no benchmark regressed
+ */
+bool compare_baseline(MicroResults* results, const char* baselineName,
+        double tolerance) {
+    FILE* baseline = fopen(baselineName, "r");
+    char* line = NULL;
+    size_t size = 0;
+    bool ok = true;
+    int numRead = 0;
+
+    if (!baseline) {
+        fprintf(stderr, BASELINE_MESSAGE, baselineName);
+        exit(BASELINE_ERROR);
+    }
+    while (getline(&line, &size, baseline) >= 0) {
+        char name[MAX_NAME_LENGTH + 1];
+        double value;
+        if (sscanf(line, " {\"name\": \"%63[^\"]\", \"value\": %lf", name,
+                &value) != 2) {
+            continue;
+        }
+        numRead++;
+        for (int i = 0; i < results->numResults; i++) {
+            MicroResult* result = &results->results[i];
+            if (strcmp(result->name, name) != 0 || value <= 0) {
+                continue;
+            }
+            double change = (result->higherIsBetter ? value - result->value
+                    : result->value - value) / value;
+            if (change > tolerance) {
+                fprintf(stderr, REGRESSION_MESSAGE, name, change * 100, value,
+                        result->value, result->unit);
+                ok = false;
+            }
+        }
+    }
+    free(line);
+    fclose(baseline);
+    if (!numRead) {
+        fprintf(stderr, BASELINE_MESSAGE, baselineName);
+        exit(BASELINE_ERROR);
+    }
+    return ok;
+}
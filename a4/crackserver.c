@@ -11,15 +11,31 @@
 #include <semaphore.h>
 #include <signal.h>
 #include <limits.h>
+#include <time.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <sys/prctl.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <dirent.h>
 #include <netdb.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
+#include "descrypt.h"
+#include "dictionary.h"
+#include "indexfile.h"
+#include "potfile.h"
+#include "rules.h"
+#include "mask.h"
+#include "wordweights.h"
 
 // Max and  min values
-#define MAX_ARGS 6
-#define MAX_WORD_LENGTH 8
+#define MAX_ARGS 30
 #define MIN_PORT 1024
 #define MAX_PORT 65535
 #define MAX_FIELDS 3
@@ -27,6 +43,83 @@
 #define SALT_LENGTH 2
 #define MIN_THREADS 1
 #define MAX_THREADS 50
+#define MAX_WORKERS 64
+#define MEGABYTE (1024 * 1024)
+
+// Number of engine batches in each chunk of the dictionary that a crack worker
+// claims at a time
+#define CHUNK_BATCHES 4
+
+// Number of threads that handle client I/O, the most epoll events each one
+// takes at once and the most bytes read from a client at once
+#define NUM_IO_THREADS 2
+#define MAX_EVENTS 64
+#define READ_SIZE 4096
+
+// Stats are spread over this many shards, each on its own cache line
+#define NUM_STAT_SHARDS 64
+#define CACHE_LINE_SIZE 64
+
+// Latencies are recorded in microseconds, in buckets that are 1/16th of a
+// power of 2 wide (so within about 6%). Latencies of 2^32 microseconds (over
+// an hour) or more all go in the last bucket.
+#define LATENCY_SUB_BITS 4
+#define LATENCY_SUB_BUCKETS (1 << LATENCY_SUB_BITS)
+#define LATENCY_LIMIT (1ULL << 32)
+#define NUM_LATENCY_BUCKETS ((32 - LATENCY_SUB_BITS + 1) * LATENCY_SUB_BUCKETS)
+
+// crypt() call rates are sampled once a second, keeping enough samples to
+// cover the longest rate that is printed
+#define MICROS_PER_SECOND 1000000
+#define RATE_HISTORY 64
+
+// Largest HTTP request read from a metrics client, and how long the metrics
+// thread waits for it
+#define MAX_HTTP_REQUEST 4096
+#define HTTP_TIMEOUT_SECONDS 1
+
+// The response cache is split into this many segments, each with its own
+// lock, and holds this many responses by default. Keys are a kind character
+// followed by a cipher text, or by a salt and the 8 characters of a word that
+// crypt() uses.
+#define CACHE_SEGMENTS 16
+#define DEFAULT_CACHE_ENTRIES 65536
+#define CACHE_KEY_LENGTH (1 + CIPHER_LENGTH)
+#define CRYPT_WORD_LENGTH 8
+#define CACHE_CRYPT 'y'
+#define CACHE_CRACK 'k'
+
+// FNV-1a 32-bit offset basis and prime, for hashing response cache keys
+#define FNV_OFFSET 2166136261U
+#define FNV_PRIME 16777619U
+
+// How often the dictionary is re-sorted, if successful cracks have changed
+// the word weights since it was last sorted
+#define RESORT_SECONDS 10
+
+// Submitted jobs that are kept (running or finished) by default, and the
+// longest job ID that a status or result command can give
+#define DEFAULT_RETAINED_JOBS 1024
+#define MAX_JOB_ID_LENGTH 10
+#define JOB_RESPONSE_LENGTH 64
+
+// How often running submitted jobs are checkpointed to the state directory,
+// and the names of their checkpoint files (the job ID then the suffix)
+#define CHECKPOINT_SECONDS 5
+#define CHECKPOINT_SUFFIX ".job"
+#define CHECKPOINT_TEMP_SUFFIX ".tmp"
+
+// Frequency orders that checkpointed jobs were cracking in are saved to the
+// state directory as the order's checksum (in hex) then this suffix
+#define ORDER_SUFFIX ".order"
+
+// Chunk of a crack task that isn't working on a chunk
+#define NO_CHUNK UINT64_MAX
+
+// Longest request ID (enough for any unsigned int), and the most tagged
+// requests that a connection can have in progress at once
+#define MAX_TAG_LENGTH 10
+#define MAX_IN_FLIGHT 64
 
 // Ascii values for . and / and the numbers 0-9
 #define ASCII_MIN 46
@@ -35,12 +128,45 @@
 // Responses from server
 #define FAILED ":failed"
 #define INVALID ":invalid"
+#define PIPELINED ":pipelined"
+#define RELOADING ":reloading"
+#define BUSY ":busy"
+#define SUBMITTED ":job"
+#define RUNNING ":running"
+#define DONE ":done"
+#define UNKNOWN ":unknown"
 
 // Default dictionary used if none is specified
 #define DEFAULT_DICTIONARY "/usr/share/dict/words"
-#define STAT_MESSAGE "Connected clients: %u\nCompleted clients: %u\nCrack "\
-    "requests: %u\nFailed crack requests: %u\nSuccessful crack requests: %u\n"\
-    "Crypt requests: %u\ncrypt()/crypt_r() calls: %u\n"
+#define STAT_MESSAGE "Connected clients: %lu\nCompleted clients: %lu\nCrack "\
+    "requests: %lu\nFailed crack requests: %lu\nSuccessful crack requests: "\
+    "%lu\nCrypt requests: %lu\ncrypt()/crypt_r() calls: %lu\nSalt index hits: "\
+    "%lu\nSalt index misses: %lu\nPotfile hits: %lu\n"
+#define LATENCY_MESSAGE "%s latency: %lu requests, p50 %luus, p90 %luus, "\
+    "p99 %luus, max %luus\n"
+#define RATE_MESSAGE "crypt()/crypt_r() calls per second: %.0f (1s), %.0f "\
+    "(10s), %.0f (60s)\n"
+#define CACHE_MESSAGE "Response cache hits: %lu\nResponse cache misses: %lu\n"\
+    "Response cache hit ratio: %.1f%%\n"
+#define WORDS_MESSAGE "Average words per successful crack: %.1f\n"
+#define METRICS_PORT_MESSAGE "Metrics port: %d\n"
+#define HTTP_HEADER "HTTP/1.1 %s\r\nContent-Type: text/plain; "\
+    "version=0.0.4\r\nContent-Length: %zu\r\nConnection: close\r\n\r\n"
+#define LOAD_MESSAGE "Loaded %d words (%zu bytes) in %.3f seconds\n"
+#define RELOAD_MESSAGE "Reloaded %d words (%zu bytes) in %.3f seconds\n"
+#define RELOAD_FAILED_MESSAGE "crackserver: unable to reload dictionary "\
+    "file \"%s\"\n"
+#define INDEX_UNUSED_MESSAGE "Index file was not built from the reloaded "\
+    "dictionary, so it won't be used\n"
+#define RESUME_MESSAGE "Resumed job %u from candidate %lu\n"
+#define RESUME_RESTART_MESSAGE "Dictionary has changed since job %u was "\
+    "checkpointed, so it starts again\n"
+#define RESUMED_STATS_MESSAGE "Resumed jobs: %lu\nCandidates hashed before "\
+    "resuming: %lu\n"
+#define WORKER_EXIT_MESSAGE "Worker %d (process %d) exited, so it is being "\
+    "restarted\n"
+#define DEDUP_MESSAGE "Removed %d duplicate words (%.1f%% fewer crypt() calls "\
+    "per crack)\nTruncated %d long words\n"
 
 // Enum to hold exit statuses
 typedef enum {
@@ -48,130 +174,890 @@ typedef enum {
     DICT_FILE_ERROR = 2,
     NO_WORDS_ERROR = 3,
     UNABLE_OPEN_ERROR = 4,
+    INDEX_FILE_ERROR = 5,
+    POTFILE_ERROR = 6,
+    WEIGHTS_FILE_ERROR = 7,
+    STATE_DIR_ERROR = 8,
 } ExitStatus;
 
 // Struct that holds the information for the server - mostly specified on the
-// command line
+// command line. worker is the number of this prefork worker process, and
+// restarted is set if it is being started again after it exited.
 typedef struct {
     int maxConns;
     const char* portNum;
     char* dictFileName;
+    int indexMemory;
+    char* indexFileName;
+    int numCores;
+    const char* metricsPort;
+    char* potfileName;
+    int cacheEntries;
+    const char* longWords;
+    int retainedJobs;
+    const char* order;
+    char* weightsFileName;
+    char* stateDirName;
+    int numWorkers;
+    int worker;
+    bool restarted;
 } ServerDetails;
 
+// Counters kept for the server stats. The number of connected clients is
+// worked out from the connections and completed clients.
+typedef enum {
+    STAT_CONNECTIONS,
+    STAT_COMPLETED,
+    STAT_CRACKS,
+    STAT_FAILED_CRACKS,
+    STAT_SUCCESS_CRACKS,
+    STAT_CRYPTS,
+    STAT_CRYPT_CALLS,
+    STAT_INDEX_HITS,
+    STAT_INDEX_MISSES,
+    STAT_SOLVED_CRACKS,
+    STAT_SOLVED_CALLS,
+    STAT_POTFILE_HITS,
+    STAT_CACHE_HITS,
+    STAT_CACHE_MISSES,
+    STAT_RESUMED_JOBS,
+    STAT_RESUMED_CALLS,
+    NUM_STATS
+} StatCounter;
+
+// Latencies that are recorded - how long crack, crackbatch and crypt requests
+// took to answer, and how long cracks waited for a worker to start on them
+typedef enum {
+    LATENCY_CRACK,
+    LATENCY_CRACK_BATCH,
+    LATENCY_CRACK_QUEUE,
+    LATENCY_CRYPT,
+    NUM_LATENCIES
+} LatencyKind;
+
+// One shard of the stats counters and latency histograms. Each thread adds to
+// its own shard with relaxed atomics, and shards are aligned to cache lines
+// so that threads never write to the same line.
+typedef struct {
+    uint64_t counts[NUM_STATS];
+    uint64_t latencies[NUM_LATENCIES][NUM_LATENCY_BUCKETS];
+    uint64_t maxLatency[NUM_LATENCIES];
+    uint64_t latencySum[NUM_LATENCIES];
+} __attribute__((aligned(CACHE_LINE_SIZE))) StatShard;
+
+// Samples of the total crypt() calls, taken once a second by the stats
+// thread. next is where the next sample goes.
+typedef struct {
+    uint64_t micros[RATE_HISTORY];
+    uint64_t calls[RATE_HISTORY];
+    int numSamples;
+    int next;
+} RateHistory;
+
+// Gauges of a crack worker pool, which each prefork worker process publishes
+// in the shared stats so that the metrics page can show every worker's pool
+typedef enum {
+    GAUGE_CRACK_WORKERS,
+    GAUGE_CRACK_WORKERS_BUSY,
+    GAUGE_CRACK_QUEUE_DEPTH,
+    NUM_POOL_GAUGES
+} PoolGauge;
+
 // Struct that holds all the stats for the server - this information is printed
-// by the thread responsible for SIGHUP handling
+// by the thread responsible for SIGHUP handling (and served by the metrics
+// thread), which adds up the shards. Threads are given shards in turn using
+// nextShard. The crypt() call samples are shared by the stats and metrics
+// threads, so they have their own lock. workerConnections has the number of
+// connections open in each prefork worker process, which its parent counts
+// as completed if the worker exits. workerGauges has each worker's crack
+// worker pool gauges, as of when it last published them (all 0 if it exits).
 typedef struct {
-    uint32_t numConnected;
-    uint32_t numCompleted;
-    uint32_t cracks;
-    uint32_t failedCracks;
-    uint32_t successCracks;
-    uint32_t crypts;
-    uint32_t cryptCalls;
-    sem_t* lock;
+    StatShard shards[NUM_STAT_SHARDS];
+    unsigned int nextShard;
+    RateHistory rates;
+    pthread_mutex_t rateLock;
+    int64_t workerConnections[MAX_WORKERS];
+    int64_t workerGauges[MAX_WORKERS][NUM_POOL_GAUGES];
 } Statistics;
 
+// Totals of the stats counters at one point in time
+typedef struct {
+    unsigned long numConnected;
+    unsigned long numCompleted;
+    unsigned long cracks;
+    unsigned long failedCracks;
+    unsigned long successCracks;
+    unsigned long crypts;
+    unsigned long cryptCalls;
+    unsigned long indexHits;
+    unsigned long indexMisses;
+    unsigned long solvedCracks;
+    unsigned long solvedCalls;
+    unsigned long potfileHits;
+    unsigned long cacheHits;
+    unsigned long cacheMisses;
+    unsigned long resumedJobs;
+    unsigned long resumedCalls;
+    uint64_t latencies[NUM_LATENCIES][NUM_LATENCY_BUCKETS];
+    uint64_t maxLatency[NUM_LATENCIES];
+    uint64_t latencySum[NUM_LATENCIES];
+} StatsSnapshot;
+
 // Struct that is used to hold the information sent to the thread that handles
-// SIGHUPs
+// SIGHUPs (and SIGUSR1s, which reload the dictionary). sampleRates is false in
+// a worker process, whose parent samples the shared stats instead.
 typedef struct {
     Statistics* stats;
+    struct CrackPool* pool;
+    struct ServerContext* server;
     sigset_t* set;
+    bool sampleRates;
 } StatsThreadData;
 
-// Dictionary of words with the words and the number of words
+// The words of a dictionary that the server has loaded, in the order they
+// were read. weights holds a weight for each word (in the same order) if the
+// words are cracked in frequency order, otherwise it is null. changed is set
+// when a successful crack adds to a weight, and refs is the number of
+// dictionary versions sharing the words. They are freed once refs drops to 0.
+// generation is the generation of the version the words were read for. Salt
+// indexes (which hold positions in these words) and cached failures are tied
+// to it, so they still hold after a re-sort, which only changes the order.
+typedef struct {
+    Dictionary dict;
+    uint32_t* weights;
+    bool changed;
+    int refs;
+    unsigned int generation;
+} DictionaryWords;
+
+// A dictionary that the server has loaded, and the index file to use with it
+// (null if the index file wasn't built from it). dict has the words in the
+// order they are cracked in, which is either source's order or (for frequency
+// order) an array of its own. refs is the number of crack jobs and other
+// readers using it. Reloading or re-sorting replaces the version, and its
+// words are freed once refs drops to 0. Until then it is on the server's list
+// of retired versions, linked by nextRetired. The version struct itself is
+// never freed, so readers can always change refs safely.
+typedef struct DictionaryVersion {
+    Dictionary dict;
+    DictionaryWords* source;
+    IndexFile* indexFile;
+    unsigned int generation;
+    int refs;
+    struct DictionaryVersion* nextRetired;
+} DictionaryVersion;
+
+// Entry in a salt index - the top 32 bits of the hash of a dictionary word
+// with the index's salt, and the position of that word in the dictionary
+typedef struct {
+    uint32_t tag;
+    uint32_t word;
+} SaltIndexEntry;
+
+// Index of the hash of every dictionary word with a single salt, sorted by
+// tag. Indexes are kept in a list from most to least recently used.
+typedef struct SaltIndex {
+    int salt;
+    SaltIndexEntry* entries;
+    int numEntries;
+    struct SaltIndex* newer;
+    struct SaltIndex* older;
+} SaltIndex;
+
+// Cache of salt indexes that is limited to memoryLimit bytes, evicting the
+// least recently used salt when full. building marks the salts that have an
+// index being built by a crack request. generation is the generation of the
+// dictionary words that the indexes were built from.
 typedef struct {
+    SaltIndex* salts[DES_NUM_SALTS];
+    bool building[DES_NUM_SALTS];
+    SaltIndex* newest;
+    SaltIndex* oldest;
+    size_t memoryUsed;
+    size_t memoryLimit;
+    unsigned int generation;
+    pthread_mutex_t lock;
+} SaltIndexCache;
+
+// Results of looking a cipher text up in the salt index cache
+typedef enum {
+    INDEX_HIT,      // Salt was indexed, the result is known
+    INDEX_MISS,     // Salt is not indexed and is being indexed by another crack
+    INDEX_BUILD,    // Salt is not indexed and the caller should index it
+} IndexLookup;
+
+// A cached response. failed is set for a crack that found no word, which only
+// holds for the dictionary generation it was cracked with. Entries are linked
+// in their segment's hash chains and in its list from most to least recently
+// used.
+typedef struct CacheEntry {
+    char key[CACHE_KEY_LENGTH + 1];
+    char value[CIPHER_LENGTH + 1];
+    bool failed;
+    unsigned int generation;
+    struct CacheEntry* next;
+    struct CacheEntry* newer;
+    struct CacheEntry* older;
+} CacheEntry;
+
+// One segment of the response cache, holding at most maxEntries responses and
+// evicting the least recently used one when full. Each segment is on its own
+// cache lines.
+typedef struct {
+    CacheEntry** buckets;
+    unsigned int mask;
+    CacheEntry* newest;
+    CacheEntry* oldest;
+    int numEntries;
+    int maxEntries;
+    pthread_mutex_t lock;
+} __attribute__((aligned(CACHE_LINE_SIZE))) CacheSegment;
+
+// Cache of crypt and crack responses, split into segments by key hash so that
+// requests for different keys rarely wait for each other
+typedef struct {
+    CacheSegment segments[CACHE_SEGMENTS];
+} ResponseCache;
+
+struct CrackJob;
+struct CrackClient;
+struct SubmittedJob;
+struct ServerContext;
+struct Connection;
+
+// Struct that lets one crack worker at a time work on a job. A job queues one
+// task per thread it asked for, which is how many workers can work on it at
+// once. A task is run one chunk at a time, and goes back on its client's
+// queue between chunks. The words hashed and the word found (if any) are kept
+// in the task until it is done. Tasks are allocated along with their job. A
+// word built by a rule or a mask is kept in candidate, as it isn't in the
+// dictionary. While a submitted job's task is running a chunk, chunk is no
+// more than the number of that chunk (otherwise it is NO_CHUNK), so that
+// checkpoints know which chunks might not be finished.
+typedef struct CrackTask {
+    struct CrackJob* job;
+    struct CrackClient* client;
+    uint64_t chunk;
+    uint64_t numCalls;
+    char* word;
+    char candidate[MAX_WORD_LENGTH + 1];
+    struct CrackTask* next;
+} CrackTask;
+
+// A cipher text in a batch crack. valid is false if the cipher text was
+// invalid, and impossible is set if no word could ever match it. Targets with
+// the same hash are linked through nextSame (-1 ends the list).
+typedef struct {
+    char cipherText[CIPHER_LENGTH + 1];
+    uint64_t block;
+    bool valid;
+    bool impossible;
+    char* word;
+    int nextSame;
+} BatchTarget;
+
+// The targets in a batch that share a salt. slots is a hash set (with linear
+// probing) of the index of the first target with each hash, or -1 if empty.
+// remaining is the number of hashes in the set that haven't been found yet.
+typedef struct {
+    DesSalt salt;
+    int numTargets;
+    int* slots;
+    int numSlots;
+    int remaining;
+} BatchGroup;
+
+// The mask of a crackmask job, and the number of the next chunk of its
+// keyspace to be claimed
+typedef struct {
+    Mask mask;
+    uint64_t cursor;
+} CrackMask;
+
+// The cipher texts of a batch crack, and their groups
+typedef struct {
+    BatchTarget* targets;
+    int numTargets;
+    BatchGroup* groups;
+    int numGroups;
+} CrackBatch;
+
+// Struct that describes a single crack request that has been handed to the
+// crack worker pool. Workers claim chunks of chunkSize words at a time by
+// advancing cursor, until it passes numWords or the word is found. For a batch
+// crack, or a crack with rules, the cursor instead counts chunks across all of
+// the batch's groups (or the rules). The last task to finish hands the result
+// back to the connection that asked for it, through its I/O thread's done list.
+// tag is the request ID to tag the responses with (empty if none). startMicros
+// is when the request was received, and waiting is set until a worker first
+// takes one of the job's tasks. version is the dictionary that the job cracks
+// with, which it holds a reference to, and cached holds a word that came from
+// the response cache. A job submitted with "submit crack" has no connection,
+// and submitted is its entry in the job table instead. rules is the rule set
+// that every word is mangled with (null if the words are hashed as they are),
+// and a crackmask job hashes the candidates of its mask instead of words.
+// numTasks is the number of tasks the job was split into (0 until then).
+typedef struct CrackJob {
+    char cipherText[CIPHER_LENGTH + 1];
+    DesTarget target;
     char** words;
     int numWords;
-} Dictionary;
+    int chunkSize;
+    int cursor;
+    SaltIndexEntry* entries;
+    CrackBatch* batch;
+    const RuleSet* rules;
+    CrackMask* mask;
+    volatile int found;
+    char* word;
+    uint64_t numCalls;
+    int numTasks;
+    int tasksLeft;
+    pthread_mutex_t lock;
+    struct ServerContext* server;
+    struct Connection* conn;
+    char tag[MAX_TAG_LENGTH + 1];
+    uint64_t startMicros;
+    bool waiting;
+    DictionaryVersion* version;
+    char cached[CIPHER_LENGTH + 1];
+    struct SubmittedJob* submitted;
+    struct CrackJob* nextDone;
+    CrackTask tasks[];
+} CrackJob;
+
+// Scheduling state for a connected client - its queue of crack tasks, and the
+// number of words hashed for it (its share of the crack work). Clients with
+// tasks queued are linked into the pool's ready list, and every connected
+// client is in the pool's client list.
+typedef struct CrackClient {
+    unsigned int id;
+    CrackTask* head;
+    CrackTask* tail;
+    unsigned int numQueued;
+    uint64_t numCalls;
+    struct CrackClient* nextReady;
+    struct CrackClient* next;
+    struct CrackClient* prev;
+} CrackClient;
 
-// Client handler thread struct - contains connection fd, dictionary struct
-// semaphore pointer to limit connections and stats struct
+// Server-wide crack scheduler. It owns a fixed number of long-lived crack
+// worker threads (the core count cap), which take tasks from the clients on
+// the ready list in round-robin order. numBusy is the number of workers that
+// are running a chunk.
+typedef struct CrackPool {
+    CrackClient* readyHead;
+    CrackClient* readyTail;
+    CrackClient* clients;
+    unsigned int nextClientID;
+    unsigned int queueDepth;
+    int numWorkers;
+    int numBusy;
+    pthread_mutex_t lock;
+    pthread_cond_t available;
+} CrackPool;
+
+// What a status or result command is answered with for a submitted job.
+// running is set until the job has finished, and found if it found word.
+// numHashed counts the words hashed so far out of numCandidates (every word
+// once for each rule, if it has rules, or the mask's keyspace), including the
+// resumed candidates that were hashed before the server restarted.
 typedef struct {
-    int fd;
-    Dictionary* dict;
-    sem_t* maxConns;
+    unsigned int id;
+    bool running;
+    bool found;
+    char word[MAX_WORD_LENGTH + 1];
+    uint64_t numHashed;
+    uint64_t numCandidates;
+} JobStatus;
+
+// The statuses of the kept submitted jobs, in a shared mapping if there are
+// prefork worker processes, so that any of them can answer for a job. Each
+// worker has size slots of its own (worker w's start at w * size), which only
+// it changes. numRunning counts the running jobs of every worker. lock
+// (shared between the processes) protects all of them, except that numHashed
+// is only ever added to atomically.
+typedef struct {
+    pthread_mutex_t lock;
+    int size;
+    int numRunning;
+    JobStatus slots[];
+} JobStatuses;
+
+// A crack submitted with "submit crack", which no connection waits for. job
+// is its crack job while it is running (null once it has finished), and
+// status is what the job's status and result commands are answered with.
+// resumed is the candidates hashed before the server restarted. command is
+// the submitted command (eg "crack <cipher> 4") and checksum is the checksum
+// of the words in the order the job cracks them (0 for a mask), which are
+// written to its checkpoint file.
+typedef struct SubmittedJob {
+    unsigned int id;
+    CrackJob* job;
+    JobStatus* status;
+    uint64_t resumed;
+    char* command;
+    uint64_t checksum;
+} SubmittedJob;
+
+// A submitted job's checkpoint - its ID, the position in its candidates that
+// every candidate before has been hashed, and the checksum of the dictionary
+// it was cracking. A checkpoint taken to be written also has a copy of the
+// submitted command and, if the job cracks in frequency order, a reference to
+// the dictionary version whose order is saved with it (null otherwise).
+typedef struct {
+    unsigned int id;
+    uint64_t position;
+    uint64_t checksum;
+    char* command;
+    DictionaryVersion* version;
+} JobCheckpoint;
+
+// Results of submitting a job
+typedef enum {
+    SUBMIT_STARTED,
+    SUBMIT_INVALID,
+    SUBMIT_BUSY,
+} SubmitStatus;
+
+// The most recently submitted jobs. IDs are given out idStep apart, starting
+// from idStep + firstID, so that the tables of prefork workers (worker w of n
+// gives out n + w, 2n + w, ...) never give out the same ID. Job n is kept in
+// slot (n / idStep) % size, so a new job replaces the one submitted size jobs
+// before it - unless that job is still running, in which case the new one is
+// turned away. No ID is 0, so slots that have never been used match no ID.
+// statuses has every worker's job statuses (job n's worker is n % idStep).
+// Every submitted job is scheduled as the one client, so they share the
+// workers fairly with the connected clients. Everything is protected by lock.
+// checkpointLock is held while checkpoint files are written or removed, so
+// that a finished job's checkpoint file isn't written again once removed.
+typedef struct {
+    SubmittedJob* slots;
+    int size;
+    JobStatuses* statuses;
+    unsigned int firstID;
+    unsigned int idStep;
+    unsigned int nextID;
+    CrackClient* client;
+    pthread_mutex_t lock;
+    pthread_mutex_t checkpointLock;
+} JobTable;
+
+// What the parent of prefork worker processes needs to start a worker (and
+// start it again if it exits) - the listening sockets, the dictionary (in a
+// shared mapping), the stats and job statuses (in shared memory) and
+// everything else from main(). pids has the process ID of each worker (0 if
+// it couldn't be started), started marks the workers that have been started
+// before, and stateDirs has the state directory of each worker (null if
+// jobs aren't checkpointed).
+typedef struct {
+    int serv;
+    int metricsServ;
+    Dictionary dict;
+    ServerDetails details;
+    IndexFile* indexFile;
+    Potfile* potfile;
+    uint32_t* weights;
+    Statistics* stats;
+    JobStatuses* statuses;
+    pid_t* pids;
+    bool* started;
+    char** stateDirs;
+} WorkerProcesses;
+
+// Struct that holds everything shared by the threads servicing client
+// requests - the dictionary, stats struct, crack worker pool, the salt index
+// cache, the precomputed index file, the potfile and the response cache (all
+// null if not used), and the table of submitted jobs. version is the
+// dictionary in use, which readers get with
+// dictionary_acquire(). dictFileName and truncate are how the dictionary is
+// read again when it is reloaded, and reloading is set while that happens.
+// publishLock is held while a reload or re-sort replaces the version, and
+// protects retired, the versions that have been replaced but may still be in
+// use. stateDir is where submitted jobs are checkpointed (null if they aren't).
+// worker is the number of this prefork worker process (-1 if it isn't one),
+// and restarted is set if its resumed jobs were already counted by the
+// worker process before it.
+typedef struct ServerContext {
+    DictionaryVersion* version;
     Statistics* stats;
-} ClientThreadData;
+    CrackPool* pool;
+    SaltIndexCache* index;
+    IndexFile* indexFile;
+    Potfile* potfile;
+    ResponseCache* cache;
+    JobTable* jobs;
+    char* dictFileName;
+    bool truncate;
+    bool reloading;
+    pthread_mutex_t publishLock;
+    DictionaryVersion* retired;
+    char* stateDir;
+    int worker;
+    bool restarted;
+} ServerContext;
 
-// Struct that contains all of the data sent to each cracking thread
+// Struct that is used to hold the information sent to the thread that serves
+// the metrics page
 typedef struct {
-    char* cipherText;
-    char* salt;
-    char** words;
-    int startPos;
-    int endPos;
-    volatile int* found;
-} CrackThreadData;
+    int fd;
+    ServerContext* server;
+} MetricsThreadData;
 
-// Struct that contains all the information returned by each cracking thread
+// An I/O thread, which services the connections in its own epoll instance.
+// Crack workers add crack jobs that have finished to the done list and wake
+// the thread up through the eventfd. crypt requests are answered on the
+// I/O thread using its cryptData. Connections closed while handling a batch
+// of epoll events are kept on the closed list until the batch is done, since
+// a later event in it can still point at them.
 typedef struct {
-    char* word;
-    int numCalls;
-} CrackThreadReturn;
+    int epollFd;
+    int eventFd;
+    ServerContext* server;
+    struct crypt_data* cryptData;
+    CrackJob* doneHead;
+    struct Connection* closedHead;
+    pthread_mutex_t lock;
+} IoThread;
+
+// A client connection, which only its I/O thread uses. Input is read into in
+// (inStart is the start of the first line not yet processed) and responses
+// are sent from out. Requests tagged with an ID (all requests once pipelined)
+// can be in progress at the same time, up to MAX_IN_FLIGHT of them. A plain
+// request waits for every request before it and holds up every request after
+// it. When stalled, the next line has to wait for requests in progress, so no
+// more lines are read or processed. tag is the ID of the request that is
+// being processed (empty if none), and nextID numbers untagged requests once
+// pipelined. closed is set once the connection has been closed, after which
+// it is only waiting on its I/O thread's closed list (linked by nextClosed)
+// to be freed.
+typedef struct Connection {
+    int fd;
+    IoThread* io;
+    CrackClient* client;
+    sem_t* maxConns;
+    char* in;
+    size_t inStart;
+    size_t inLength;
+    size_t inSize;
+    char* out;
+    size_t outSent;
+    size_t outLength;
+    size_t outSize;
+    bool registered;
+    uint32_t events;
+    bool stalled;
+    bool hungUp;
+    bool pipelined;
+    unsigned int nextID;
+    char tag[MAX_TAG_LENGTH + 1];
+    int inFlight;
+    bool plainInFlight;
+    bool closed;
+    struct Connection* nextClosed;
+} Connection;
 
 // Main functions
 ServerDetails parse_command_line(int argc, char** argv);
-void process_connections(int serv, Dictionary dict, int maxConns);
+void process_connections(int serv, int metricsServ, Dictionary dict,
+        ServerDetails details, IndexFile* indexFile, Potfile* potfile,
+        uint32_t* weights, Statistics* stats, JobStatuses* statuses);
+Statistics* configure_stats(bool shared);
 int open_listen(const char* port);
-void process_command(char* command, FILE* out, Dictionary* dict,
-        Statistics* stats);
+int listen_on(const char* port);
+int socket_port(int fd);
+void process_command(char* command, Connection* conn);
 
-// Client Handler
-void* client_wrapper(void* v);
-void client_handler_thread(int fd, Dictionary* dict, sem_t* maxConns,
-        Statistics* stats);
+// Client I/O
+IoThread* create_io_thread(ServerContext* server);
+void* io_thread(void* v);
+void io_thread_complete(CrackJob* job);
+Connection* create_connection(int fd, IoThread* io, sem_t* maxConns);
+void connection_service(Connection* conn, uint32_t events);
+bool connection_read(Connection* conn);
+void connection_process_lines(Connection* conn);
+bool connection_start_line(Connection* conn, char* line);
+int request_tag_length(const char* line);
+void connection_respond(Connection* conn, const char* tag,
+        const char* result);
+void connection_flush(Connection* conn);
+void connection_update_events(Connection* conn);
+void connection_close(Connection* conn);
+void connection_free(Connection* conn);
 
 // Crypt/Crack Calls
-char* crypt_call(char* cryptText, char* salt);
-char* crack_call(char* cipherText, int numThreads, Dictionary* dict,
-        Statistics* stats);
-void* crack_thread_wrapper(void* v);
-void* crack_thread(void* v);
+char* crypt_call(char* cryptText, char* salt, struct crypt_data* data);
+char* crypt_command(char* cryptText, char* salt, Connection* conn,
+        char* cached);
+void crack_call(char* cipherText, int numThreads, const RuleSet* rules,
+        Connection* conn);
+void crack_mask_call(char* cipherText, int numThreads, CrackMask* mask,
+        Connection* conn);
+bool crack_job_start(CrackJob* job, char* cipherText, int numThreads);
+void crack_batch_command(char* numThreads, char* cipherTexts,
+        Connection* conn);
+void crack_batch_call(char** cipherTexts, int numThreads, Connection* conn);
+CrackJob* create_crack_job(ServerContext* server, Connection* conn,
+        CrackMask* mask, int maxTasks);
+void crack_job_submit(CrackJob* job, int numTasks);
+void crack_job_finish(CrackJob* job);
+bool crack_cache_lookup(CrackJob* job);
+void crack_cache_insert(CrackJob* job, const char* cipherText,
+        const char* word);
+void crack_job_respond(Connection* conn, CrackJob* job);
+int claim_chunk(CrackJob* job, int* endPos);
+bool crack_chunk(CrackTask* task, int* numCalls);
+bool index_chunk(CrackTask* task, int* numCalls);
+bool batch_chunk(CrackTask* task, int* numCalls);
+bool rules_chunk(CrackTask* task, int* numCalls);
+bool mask_chunk(CrackTask* task, int* numCalls);
+uint64_t job_num_chunks(CrackJob* job);
+uint64_t job_num_candidates(CrackJob* job);
+
+// Batch cracks
+CrackBatch* create_crack_batch(char** cipherTexts, Potfile* potfile);
+void crack_batch_add(CrackBatch* batch, BatchGroup* group, int index);
+int crack_batch_find(CrackBatch* batch, BatchGroup* group, uint64_t block);
+int batch_slot(uint64_t block, int mask);
+void free_crack_batch(CrackBatch* batch);
+
+// Salt index cache
+SaltIndexCache* create_salt_index_cache(size_t memoryLimit);
+IndexLookup salt_index_lookup(SaltIndexCache* cache, CrackJob* job,
+        Dictionary* dict);
+void salt_index_insert(SaltIndexCache* cache, int salt,
+        SaltIndexEntry* entries, int numEntries, unsigned int generation);
+void salt_index_clear(SaltIndexCache* cache, unsigned int generation);
+void salt_index_unlink(SaltIndexCache* cache, SaltIndex* index);
+int compare_index_entries(const void* a, const void* b);
+
+// Dictionary versions and reloading
+DictionaryVersion* create_dictionary_version(Dictionary dict,
+        IndexFile* indexFile, unsigned int generation);
+DictionaryVersion* sort_dictionary_version(DictionaryVersion* version,
+        uint32_t* weights);
+DictionaryVersion* create_sorted_version(DictionaryWords* source,
+        unsigned int generation);
+DictionaryVersion* create_ordered_version(DictionaryWords* source,
+        char** words, unsigned int generation);
+DictionaryVersion* dictionary_acquire(ServerContext* server);
+void dictionary_release(DictionaryVersion* version);
+void dictionary_publish(ServerContext* server, DictionaryVersion* version);
+void dictionary_retire(ServerContext* server, DictionaryVersion* old);
+void dictionary_free_retired(ServerContext* server);
+void free_dictionary_version(DictionaryVersion* version);
+void dictionary_count_word(DictionaryVersion* version, const char* word);
+bool dictionary_reload(ServerContext* server);
+void* reload_thread(void* v);
+void* resort_thread(void* v);
+
+// Submitted jobs
+JobStatuses* create_job_statuses(int size, int numWorkers);
+void job_statuses_lock(JobStatuses* statuses);
+JobTable* create_job_table(CrackPool* pool, JobStatuses* statuses,
+        int worker, int numWorkers);
+void submit_command(char* kind, char* args, Connection* conn);
+SubmitStatus job_table_submit(ServerContext* server, char* kind, char* args,
+        JobCheckpoint* resume, unsigned int* id);
+void job_status_command(char* jobID, Connection* conn);
+void job_result_command(char* jobID, Connection* conn);
+JobStatus* job_table_find(JobTable* table, unsigned int id);
+void job_table_complete(CrackJob* job);
+bool parse_job_id(char* arg, unsigned int* id);
+
+// Prefork worker processes
+void run_workers(int serv, int metricsServ, Dictionary dict,
+        ServerDetails details, IndexFile* indexFile, Potfile* potfile,
+        uint32_t* weights);
+void start_worker(WorkerProcesses* workers, int worker);
+void supervise_workers(WorkerProcesses* workers, sigset_t* set);
+void reap_workers(WorkerProcesses* workers);
+
+// Checkpoints of submitted jobs
+void* checkpoint_thread(void* v);
+void job_checkpoint_take(SubmittedJob* submitted, JobCheckpoint* checkpoint);
+void job_checkpoint_write(const char* stateDir, JobCheckpoint* checkpoint);
+char* checkpoint_file_name(const char* stateDir, unsigned int id,
+        const char* suffix);
+void order_file_write(const char* stateDir, DictionaryVersion* version,
+        uint64_t checksum);
+char* order_file_name(const char* stateDir, uint64_t checksum,
+        const char* suffix);
+bool job_use_saved_order(ServerContext* server, CrackJob* job,
+        uint64_t checksum);
+void remove_unused_orders(ServerContext* server);
+void resume_jobs(ServerContext* server);
+void resume_job(ServerContext* server, const char* fileName);
+uint64_t job_claimed_chunks(CrackJob* job);
+uint64_t job_finished_chunks(CrackJob* job);
+uint64_t job_chunk_position(CrackJob* job, uint64_t chunks);
+void job_resume_at(CrackJob* job, uint64_t position);
+
+// Response cache
+ResponseCache* create_response_cache(int maxEntries);
+bool response_cache_lookup(ResponseCache* cache, const char* key,
+        unsigned int generation, char* value, bool* failed);
+void response_cache_insert(ResponseCache* cache, const char* key,
+        const char* value, unsigned int generation);
+void response_cache_unlink(CacheSegment* segment, CacheEntry* entry);
+void response_cache_push(CacheSegment* segment, CacheEntry* entry);
+unsigned int cache_hash(const char* key);
+void crypt_cache_key(char* key, const char* word, const char* salt);
+void crack_cache_key(char* key, const char* cipherText);
+
+// Crack worker pool and scheduler
+CrackPool* create_crack_pool(int numWorkers);
+CrackClient* crack_pool_add_client(CrackPool* pool);
+void crack_pool_remove_client(CrackPool* pool, CrackClient* client);
+void crack_pool_submit(CrackPool* pool, CrackTask* tasks, int numTasks);
+void crack_pool_enqueue(CrackPool* pool, CrackTask* task);
+CrackTask* crack_pool_take(CrackPool* pool);
+void crack_pool_finish_chunk(CrackPool* pool, CrackTask* task, int numCalls,
+        bool more);
+void crack_pool_print_stats(CrackPool* pool, FILE* out);
+void* crack_worker_thread(void* v);
 
 //Helper prototypes
 void validate_port_number(int portNum);
 int validate_max_connections(int maxConns);
-Dictionary fill_dictionary(char* dictFileName);
-void free_dictionary(Dictionary);
+int validate_index_memory(int indexMemory);
+int validate_cache_entries(int cacheEntries);
+int validate_retained_jobs(int retainedJobs);
+int validate_workers(int numWorkers);
+int validate_cores(int numCores);
+Dictionary fill_dictionary(char* dictFileName, bool truncate);
+IndexFile* map_index_file(char* indexName, Dictionary* dict);
 int string_to_number(char* arg);
 bool valid_thread_num(char* numThreads);
+bool parse_crack_options(char* args, int* numThreads, const RuleSet** rules);
+CrackMask* parse_mask_options(char* args, int* numThreads);
 bool valid_salt(char* salt);
+bool valid_cipher_text(char* cipherText);
 bool valid_salt_character(char salt);
-CrackThreadData* create_crack_thread_data(char* cipherText, char* salt,
-        char** words, int startPos, int endPos, volatile int* found);
+int default_crack_workers(void);
 
 // Stats commands
 void* stats_thread(void* v);
+void stats_report(Statistics* stats, CrackPool* pool, StatsSnapshot* snapshot);
+void stats_add(Statistics* stats, StatCounter counter, uint64_t num);
+uint64_t stats_total(Statistics* stats, StatCounter counter);
+void stats_snapshot(Statistics* stats, StatsSnapshot* snapshot);
+StatShard* stats_shard(Statistics* stats);
+void stats_record_latency(Statistics* stats, LatencyKind kind,
+        uint64_t startMicros);
+void stats_print_latencies(StatsSnapshot* snapshot, FILE* out);
+int latency_bucket(uint64_t micros);
+uint64_t latency_bucket_value(int bucket);
+uint64_t latency_percentile(const uint64_t* counts, uint64_t count,
+        uint64_t max, double fraction);
+void rate_history_add(RateHistory* history, uint64_t micros, uint64_t calls);
+double rate_history_rate(RateHistory* history, int seconds, uint64_t micros,
+        uint64_t calls);
+uint64_t now_micros(void);
+void stats_sample_rates(Statistics* stats, uint64_t micros);
+double stats_crypt_rate(Statistics* stats, int seconds, uint64_t micros,
+        uint64_t calls);
+void stats_publish_pool(Statistics* stats, int worker, struct CrackPool* pool);
+
+// Metrics page
+void* metrics_thread(void* v);
+void metrics_serve(int fd, ServerContext* server);
+char* metrics_page(ServerContext* server, size_t* length);
+void metrics_write(FILE* out, const char* name, const char* type,
+        const char* help, double value);
+void metrics_write_latencies(FILE* out, StatsSnapshot* snapshot);
+void metrics_write_pool(FILE* out, ServerContext* server);
+bool send_all(int fd, const char* data, size_t length);
 void stats_add_connection(Statistics* stats);
 void stats_complete_connection(Statistics* stats);
+void stats_worker_connection(Statistics* stats, int worker, int change);
 void stats_add_crack_request(Statistics* stats);
 void stats_add_crack_request_pass(Statistics* stats);
 void stats_add_crack_request_fail(Statistics* stats);
 void stats_add_crypt_request(Statistics* stats);
-void stats_add_crypt_call(Statistics* stats, int num);
+void stats_add_crypt_call(Statistics* stats, uint64_t num);
+void stats_add_index_hit(Statistics* stats);
+void stats_add_index_miss(Statistics* stats);
 
 // Prototypes for error functions
 void usage_error();
 void dictionary_error(char* dictName);
 void empty_dictionary_error();
 void unable_listen_error();
+void index_file_error(char* indexName);
+void potfile_error(char* potfileName);
+void weights_file_error(char* weightsName);
+void state_dir_error(char* stateName);
 
 int main(int argc, char** argv) {
     ServerDetails serverDetails;
     Dictionary dictionary;
+    IndexFile* indexFile = NULL;
+    Potfile* potfile = NULL;
+    uint32_t* weights = NULL;
+    struct timespec loadStart, loadEnd;
     int serv;
+    int metricsServ = -1;
 
     serverDetails = parse_command_line(argc, argv);
-    dictionary = fill_dictionary(serverDetails.dictFileName);
+    des_init(); // Pick the widest DES engine this machine supports
+    clock_gettime(CLOCK_MONOTONIC, &loadStart);
+    dictionary = fill_dictionary(serverDetails.dictFileName,
+            strcmp(serverDetails.longWords, "truncate") == 0);
+    clock_gettime(CLOCK_MONOTONIC, &loadEnd);
+    if (serverDetails.indexFileName) {
+        indexFile = map_index_file(serverDetails.indexFileName, &dictionary);
+    }
+    if (serverDetails.potfileName) {
+        if (!(potfile = open_potfile(serverDetails.potfileName))) {
+            potfile_error(serverDetails.potfileName);
+        }
+    }
+    if (serverDetails.stateDirName) {
+        mkdir(serverDetails.stateDirName, 0755); // If it doesn't exist yet
+        if (access(serverDetails.stateDirName, W_OK | X_OK) != 0) {
+            state_dir_error(serverDetails.stateDirName);
+        }
+    }
+    if (strcmp(serverDetails.order, "frequency") == 0) {
+        weights = calloc(dictionary.numWords, sizeof(uint32_t));
+        if (serverDetails.weightsFileName && !load_word_weights(
+                serverDetails.weightsFileName, &dictionary, weights)) {
+            weights_file_error(serverDetails.weightsFileName);
+        }
+    }
 
     // Listens on given port, returns socket for listening
     if ((serv = open_listen(serverDetails.portNum)) < 0) {
         free_dictionary(dictionary);
         unable_listen_error();
     }
+    if (serverDetails.metricsPort) {
+        if ((metricsServ = listen_on(serverDetails.metricsPort)) < 0) {
+            free_dictionary(dictionary);
+            unable_listen_error();
+        }
+        fprintf(stderr, METRICS_PORT_MESSAGE, socket_port(metricsServ));
+    }
+    // After the port, which is always the first line
+    fprintf(stderr, LOAD_MESSAGE, dictionary.numWords, dictionary.numBytes,
+            (loadEnd.tv_sec - loadStart.tv_sec)
+            + (loadEnd.tv_nsec - loadStart.tv_nsec) / 1e9);
+    fprintf(stderr, DEDUP_MESSAGE, dictionary.numDuplicates,
+            100.0 * dictionary.numDuplicates
+            / (dictionary.numDuplicates + dictionary.numWords),
+            dictionary.numTruncated);
 
-    // Processes all incoming client connections
-    process_connections(serv, dictionary, serverDetails.maxConns);
+    // Processes all incoming client connections, in worker processes if
+    // asked for
+    if (serverDetails.numWorkers) {
+        run_workers(serv, metricsServ, dictionary, serverDetails, indexFile,
+                potfile, weights);
+    } else {
+        process_connections(serv, metricsServ, dictionary, serverDetails,
+                indexFile, potfile, weights, configure_stats(false),
+                create_job_statuses(serverDetails.retainedJobs, 0));
+    }
 
     return 0;
 }
@@ -190,7 +1076,11 @@ int main(int argc, char** argv) {
  */
 ServerDetails parse_command_line(int argc, char** argv) {
     ServerDetails param = {.maxConns = -1, .portNum = NULL, 
-        .dictFileName = NULL};
+        .dictFileName = NULL, .indexMemory = -1, .indexFileName = NULL,
+        .numCores = -1, .metricsPort = NULL, .potfileName = NULL,
+        .cacheEntries = -1, .longWords = NULL, .retainedJobs = -1,
+        .order = NULL, .weightsFileName = NULL, .stateDirName = NULL,
+        .numWorkers = -1};
     // Skip program name
     argc--;
     argv++;
@@ -212,6 +1102,45 @@ ServerDetails parse_command_line(int argc, char** argv) {
         } else if (strcmp(argv[0], "--dictionary") == 0 
                 && !param.dictFileName) {
             param.dictFileName = argv[1];
+        } else if (strcmp(argv[0], "--index-memory") == 0
+                && param.indexMemory < 0) {
+            int indexMemory = string_to_number(argv[1]);
+            param.indexMemory = validate_index_memory(indexMemory);
+        } else if (strcmp(argv[0], "--index") == 0 && !param.indexFileName) {
+            param.indexFileName = argv[1];
+        } else if (strcmp(argv[0], "--cores") == 0 && param.numCores < 0) {
+            int numCores = string_to_number(argv[1]);
+            param.numCores = validate_cores(numCores);
+        } else if (strcmp(argv[0], "--metrics-port") == 0
+                && !param.metricsPort) {
+            int portNum = string_to_number(argv[1]);
+            validate_port_number(portNum);
+            param.metricsPort = argv[1];
+        } else if (strcmp(argv[0], "--potfile") == 0 && !param.potfileName) {
+            param.potfileName = argv[1];
+        } else if (strcmp(argv[0], "--cache") == 0 && param.cacheEntries < 0) {
+            int cacheEntries = string_to_number(argv[1]);
+            param.cacheEntries = validate_cache_entries(cacheEntries);
+        } else if (strcmp(argv[0], "--long-words") == 0 && !param.longWords
+                && (strcmp(argv[1], "skip") == 0
+                || strcmp(argv[1], "truncate") == 0)) {
+            param.longWords = argv[1];
+        } else if (strcmp(argv[0], "--jobs") == 0 && param.retainedJobs < 0) {
+            int retainedJobs = string_to_number(argv[1]);
+            param.retainedJobs = validate_retained_jobs(retainedJobs);
+        } else if (strcmp(argv[0], "--order") == 0 && !param.order
+                && (strcmp(argv[1], "file") == 0
+                || strcmp(argv[1], "frequency") == 0)) {
+            param.order = argv[1];
+        } else if (strcmp(argv[0], "--weights") == 0
+                && !param.weightsFileName) {
+            param.weightsFileName = argv[1];
+        } else if (strcmp(argv[0], "--state") == 0 && !param.stateDirName) {
+            param.stateDirName = argv[1];
+        } else if (strcmp(argv[0], "--workers") == 0
+                && param.numWorkers < 0) {
+            int numWorkers = string_to_number(argv[1]);
+            param.numWorkers = validate_workers(numWorkers);
         } else {
             usage_error(); // If additional or duplicates args are provided
         }
@@ -229,22 +1158,89 @@ ServerDetails parse_command_line(int argc, char** argv) {
         param.maxConns = 0;
     }
 
+    // If not specified, set index memory to 0 (no salt index)
+    if (param.indexMemory == -1) {
+        param.indexMemory = 0;
+    }
+
+    // If not specified, cache the default number of responses
+    if (param.cacheEntries == -1) {
+        param.cacheEntries = DEFAULT_CACHE_ENTRIES;
+    }
+
+    // If not specified, keep the default number of submitted jobs
+    if (param.retainedJobs == -1) {
+        param.retainedJobs = DEFAULT_RETAINED_JOBS;
+    }
+
+    // If not specified, skip words that are too long
+    if (!param.longWords) {
+        param.longWords = "skip";
+    }
+
+    // If not specified, serve every client from this process
+    if (param.numWorkers == -1) {
+        param.numWorkers = 0;
+    }
+
+    // If not specified, crack in file order (unless there are weights)
+    if (!param.order) {
+        param.order = param.weightsFileName ? "frequency" : "file";
+    }
+
+    // If not specified, crack on every processor
+    if (param.numCores == -1) {
+        param.numCores = default_crack_workers();
+    }
+
     // Uses default dictionary if not specified
     if (!param.dictFileName) {
         param.dictFileName = DEFAULT_DICTIONARY;
     }
+
+    // An index file fixes the word order, so it can't be re-sorted
+    if (param.indexFileName && (param.weightsFileName
+            || strcmp(param.order, "frequency") == 0)) {
+        usage_error();
+    }
     return param;
 }
 
-/* Listens on a given port and returns a listening socket. If it encounters
- * any errors, it will return with -1. If the port specified is 0, it will
- * use an ephemeral port.
+/* Listens on a given port and returns a listening socket, printing the port
+ * number to stderr. If it encounters any errors, it will return with -1. If
+ * the port specified is 0, it will use an ephemeral port.
  *
  * port: port which the socket will be bound to
  *
  * Returns: listening socket
  */
 int open_listen(const char* port) {
+    int listenfd = listen_on(port);
+    if (listenfd < 0) {
+        return -1;
+    }
+
+    int portNum = socket_port(listenfd);
+    if (portNum < 0) {
+        perror("sockname");
+        return -1;
+    }
+    fprintf(stderr, "%d\n", portNum);
+    fflush(stderr);
+
+    // Have listening socket - return it
+    return listenfd;
+}
+
+/* listen_on()
+ * -----------
+ * Creates a socket listening on a given port (an ephemeral port if it is 0).
+ *
+ * port: port which the socket will be bound to
+ *
+ * Returns: listening socket, or -1 if it couldn't be created
+ */
+int listen_on(const char* port) {
     struct addrinfo* ai = 0;
     struct addrinfo hints;
 
@@ -275,103 +1271,248 @@ int open_listen(const char* port) {
     if (listen(listenfd, 128) < 0) {
         return -1;
     }
+    return listenfd;
+}
 
-    // Find out which socket
+/* socket_port()
+ * -------------
+ * Finds out which port a listening socket is bound to.
+ *
+ * fd: the listening socket
+ *
+ * Returns: the port number, or -1 if it couldn't be found
+ */
+int socket_port(int fd) {
     struct sockaddr_in ad;
     memset(&ad, 0, sizeof(struct sockaddr_in));
     socklen_t len = sizeof(struct sockaddr_in);
-    if (getsockname(listenfd, (struct sockaddr*)&ad, &len)) {
-        perror("sockname");
+    if (getsockname(fd, (struct sockaddr*)&ad, &len)) {
         return -1;
     }
-    fprintf(stderr, "%d\n", ntohs(ad.sin_port));
-    fflush(stderr);
-
-    // Have listening socket - return it
-    return listenfd;
+    return ntohs(ad.sin_port);
 }
 
 /* Configures the statistics struct that is used by the SIGHUP handling thread
- * to print out the server stats. This function sets all of the stats to 0 and
- * initialises the sempahor for mutual exclusion.
+ * to print out the server stats. This function sets all of the stats to 0.
+ * Shared stats are put in a shared mapping (which is page aligned), so that
+ * prefork worker processes all add to the same counters.
+ *
+ * shared: whether processes forked afterwards share the stats
  *
  * Returns: statistics struct that is ready to be used by all client threads
  * and the SIGHUP handling thread
  */
-Statistics* configure_stats() {
-    Statistics* stats = malloc(sizeof(Statistics));
+Statistics* configure_stats(bool shared) {
+    void* memory = NULL;
+    pthread_mutexattr_t attr;
+
+    if (shared) {
+        memory = mmap(NULL, sizeof(Statistics), PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        if (memory == MAP_FAILED) {
+            return NULL;
+        }
+    } else if (posix_memalign(&memory, CACHE_LINE_SIZE, sizeof(Statistics))) {
+        // Aligned so that each shard is on its own cache lines
+        return NULL;
+    }
+    Statistics* stats = memory;
 
     //Zeroes out all the stats
-    stats->numConnected = 0;
-    stats->numCompleted = 0;
-    stats->cracks = 0;
-    stats->failedCracks = 0;
-    stats->successCracks = 0;
-    stats->crypts = 0;
-    stats->cryptCalls = 0;
-
-    //Creates the lock
-    stats->lock = malloc(sizeof(sem_t));
-    sem_init(stats->lock, 0, 1);
+    memset(stats, 0, sizeof(Statistics));
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, shared ? PTHREAD_PROCESS_SHARED
+            : PTHREAD_PROCESS_PRIVATE);
+    pthread_mutex_init(&stats->rateLock, &attr);
+    pthread_mutexattr_destroy(&attr);
     return stats;
 }
 
 /* stats_thread()
  * --------------
  * Function that is ran by the SIGHUP handling thread. This function waits
- * until it gets a SIGHUP, then it prints out the server stats. It keeps doing
+ * until it gets a SIGHUP, then it prints out the server stats, including the
+ * latencies, the recent crypt() call rates and the average words hashed per
+ * successful crack. While waiting, it samples the total crypt() calls once a
+ * second for the rates (or in a prefork worker process, publishes its crack
+ * worker pool's gauges), and frees replaced dictionaries that are no longer in
+ * use. A SIGUSR1 starts a dictionary reload. It keeps doing
  * this until the server stops.
  *
  * v: void pointer to a StatsThreadData struct that contains a Statistics
- * struct and a set of signals
+ * struct, the crack worker pool, the server context and a set of signals
  */
 void* stats_thread(void* v) {
     StatsThreadData* data = (StatsThreadData*)v;
-    Statistics* stats = data->stats;
-    int sig;
+    StatsSnapshot* snapshot = malloc(sizeof(StatsSnapshot));
+    uint64_t nextSample = now_micros();
 
     while (1) {
-        sigwait(data->set, &sig); //Wait until SIGHUP is received
-        fprintf(stderr, STAT_MESSAGE, stats->numConnected, stats->numCompleted,
-                stats->cracks, stats->failedCracks, stats->successCracks,
-                stats->crypts, stats->cryptCalls);
-        fflush(stderr);
+        uint64_t now = now_micros();
+        if (now >= nextSample) {
+            if (data->sampleRates) {
+                stats_sample_rates(data->stats, now);
+            } else {
+                stats_publish_pool(data->stats, data->server->worker,
+                        data->pool);
+            }
+            dictionary_free_retired(data->server);
+            nextSample = now + MICROS_PER_SECOND;
+        }
+        uint64_t wait = nextSample - now;
+        struct timespec timeout = {.tv_sec = wait / MICROS_PER_SECOND,
+                .tv_nsec = wait % MICROS_PER_SECOND * 1000};
+        int signal = sigtimedwait(data->set, NULL, &timeout);
+        if (signal == SIGUSR1) {
+            dictionary_reload(data->server);
+            continue;
+        } else if (signal != SIGHUP) {
+            continue; // Time for the next sample
+        }
+
+        stats_report(data->stats, data->pool, snapshot);
     }
     return NULL;
 }
 
+/* stats_report()
+ * --------------
+ * Prints the server stats to stderr for a SIGHUP - the counters, latencies,
+ * recent crypt() call rates, average words hashed per successful crack and
+ * resumed jobs, and then the crack worker pool's stats.
+ *
+ * stats: Statistics struct that contains all of the server statistics
+ * pool: the crack worker pool, or null if this process has none (the parent
+ * of prefork workers)
+ * snapshot: StatsSnapshot struct to add the stats up in
+ */
+void stats_report(Statistics* stats, CrackPool* pool, StatsSnapshot* snapshot) {
+    stats_snapshot(stats, snapshot);
+    uint64_t now = now_micros();
+    fprintf(stderr, STAT_MESSAGE, snapshot->numConnected,
+            snapshot->numCompleted, snapshot->cracks, snapshot->failedCracks,
+            snapshot->successCracks, snapshot->crypts, snapshot->cryptCalls,
+            snapshot->indexHits, snapshot->indexMisses, snapshot->potfileHits);
+    stats_print_latencies(snapshot, stderr);
+    uint64_t lookups = snapshot->cacheHits + snapshot->cacheMisses;
+    fprintf(stderr, CACHE_MESSAGE, snapshot->cacheHits, snapshot->cacheMisses,
+            lookups ? 100.0 * snapshot->cacheHits / lookups : 0.0);
+    fprintf(stderr, RATE_MESSAGE,
+            stats_crypt_rate(stats, 1, now, snapshot->cryptCalls),
+            stats_crypt_rate(stats, 10, now, snapshot->cryptCalls),
+            stats_crypt_rate(stats, 60, now, snapshot->cryptCalls));
+    fprintf(stderr, WORDS_MESSAGE, snapshot->solvedCracks ?
+            (double)snapshot->solvedCalls / snapshot->solvedCracks : 0.0);
+    fprintf(stderr, RESUMED_STATS_MESSAGE, snapshot->resumedJobs,
+            snapshot->resumedCalls);
+    if (pool) {
+        crack_pool_print_stats(pool, stderr);
+    }
+    fflush(stderr);
+}
+
 /* process_connections()
  * ---------------------
- * This programs first sets up the Statistics struct by calling
- * configure_stats(), and then sets up the signal mask. It creates a thread
- * for stats and then sets up the semaphor to limit the number of concurrent
- * clients if this argument was specified on the command line. It then sits
- * in a loop waiting for clients to connect to the server.
+ * This programs first sets up the signal mask (SIGHUP and SIGUSR1
+ * are only handled by the stats thread). It creates a thread
+ * for stats, the crack workers, the I/O threads and the metrics thread (if
+ * there is a metrics port), and then sets up the
+ * semaphor to limit the number of concurrent clients if this argument was
+ * specified on the command line. It then sits in a loop waiting for clients
+ * to connect to the server, handing each one to an I/O thread in turn.
  *
  * serv: listening socket
+ * metricsServ: listening socket for the metrics page, or -1 if not used
  * dict: Dictionary structure that contains word and the number of words in it
- * maxConns: the maximum number of concurrent clients allowed on the server
+ * details: server details from the command line, including the maximum number
+ * of concurrent clients allowed on the server and the number of cores to crack
+ * on
+ * indexFile: precomputed index file, or null if none was given
+ * potfile: potfile of cracked cipher texts, or null if none was given
+ * weights: weights of the dictionary's words if they are cracked in frequency
+ * order, otherwise null
+ * stats: Statistics struct from configure_stats(), shared with the other
+ * workers if this is a prefork worker process
+ * statuses: job statuses from create_job_statuses(), likewise shared
  */
-void process_connections(int serv, Dictionary dict, int maxConns) {
+void process_connections(int serv, int metricsServ, Dictionary dict,
+        ServerDetails details, IndexFile* indexFile, Potfile* potfile,
+        uint32_t* weights, Statistics* stats, JobStatuses* statuses) {
     int fd;
     struct sockaddr_in fromAddr;
     socklen_t fromAddrSize;
     pthread_t threadID;
 
-    Statistics* stats = configure_stats();
-
     sigset_t set;
     sigemptyset(&set); 
     sigaddset(&set, SIGHUP); //Add SIGHUP to signal set
-    pthread_sigmask(SIG_BLOCK, &set, NULL); // mask SIGHUP for other threads
+    sigaddset(&set, SIGUSR1); // and SIGUSR1 for reloading the dictionary
+    pthread_sigmask(SIG_BLOCK, &set, NULL); // mask them for other threads
+
+    // Workers are created after the signals are masked so they inherit the
+    // mask
+    ServerContext* server = malloc(sizeof(ServerContext));
+    server->version = create_dictionary_version(dict, indexFile, 0);
+    if (weights) {
+        server->version = sort_dictionary_version(server->version, weights);
+    }
+    server->stats = stats;
+    server->pool = create_crack_pool(details.numCores);
+    server->index = NULL;
+    server->indexFile = indexFile;
+    server->potfile = potfile;
+    server->cache = details.cacheEntries
+            ? create_response_cache(details.cacheEntries) : NULL;
+    server->jobs = create_job_table(server->pool, statuses, details.worker,
+            details.numWorkers);
+    server->dictFileName = details.dictFileName;
+    server->truncate = strcmp(details.longWords, "truncate") == 0;
+    server->reloading = false;
+    pthread_mutex_init(&server->publishLock, NULL);
+    server->retired = NULL;
+    server->stateDir = details.stateDirName;
+    server->worker = details.numWorkers ? details.worker : -1;
+    server->restarted = details.restarted;
+    if (details.indexMemory && !indexFile) {
+        server->index = create_salt_index_cache(
+                (size_t)details.indexMemory * MEGABYTE);
+    }
 
     StatsThreadData* statsThreadData = malloc(sizeof(StatsThreadData));
     statsThreadData->stats = stats;
+    statsThreadData->pool = server->pool;
+    statsThreadData->server = server;
     statsThreadData->set = &set;
+    statsThreadData->sampleRates = !details.numWorkers;
 
     pthread_create(&threadID, 0, stats_thread, statsThreadData);
     pthread_detach(threadID); // Don't need stats thread return value
+
+    if (weights) {
+        pthread_create(&threadID, 0, resort_thread, server);
+        pthread_detach(threadID);
+    }
+    if (server->stateDir) {
+        resume_jobs(server);
+        pthread_create(&threadID, 0, checkpoint_thread, server);
+        pthread_detach(threadID);
+    }
+
+    if (metricsServ >= 0) {
+        MetricsThreadData* metricsThreadData =
+                malloc(sizeof(MetricsThreadData));
+        metricsThreadData->fd = metricsServ;
+        metricsThreadData->server = server;
+        pthread_create(&threadID, 0, metrics_thread, metricsThreadData);
+        pthread_detach(threadID);
+    }
+
+    IoThread* ioThreads[NUM_IO_THREADS];
+    for (int i = 0; i < NUM_IO_THREADS; i++) {
+        ioThreads[i] = create_io_thread(server);
+    }
     
+    int maxConns = details.maxConns;
     sem_t maxConnsLock;
     if (maxConns == 0) {
         maxConns = SEM_VALUE_MAX;
@@ -379,7 +1520,7 @@ void process_connections(int serv, Dictionary dict, int maxConns) {
     sem_init(&maxConnsLock, 0, maxConns);
 
     // Repeatedly accept connections
-    while (1) {
+    for (int next = 0; 1; next = (next + 1) % NUM_IO_THREADS) {
         fromAddrSize = sizeof(struct sockaddr_in);
 
         sem_wait(&maxConnsLock); // Handles max connections
@@ -390,374 +1531,4321 @@ void process_connections(int serv, Dictionary dict, int maxConns) {
             exit(1);
         }
         stats_add_connection(stats); // Add 1 to connected stat
+        stats_worker_connection(stats, server->worker, 1);
 
-        ClientThreadData* data = malloc(sizeof(ClientThreadData));
-        data->fd = fd;
-        data->dict = &dict;
-        data->maxConns = &maxConnsLock;
-        data->stats = stats;
-
-        pthread_create(&threadID, 0, client_wrapper, data);
-        pthread_detach(threadID); // Don't need client thread return value
+        // The I/O thread starts servicing it as soon as it is in its epoll
+        Connection* conn = create_connection(fd, ioThreads[next],
+                &maxConnsLock);
+        connection_update_events(conn);
     }
 }
 
-/* client_wrapper()
- * ----------------
- * Wrapper function that takes in the void pointer for the client thread thread
- * and calls the client thread function with all of the arguments unwrapped.
+/* create_io_thread()
+ * ------------------
+ * Creates an I/O thread with its own epoll instance, and an eventfd that the
+ * crack workers use to wake it up when a crack has finished.
  *
- * v: void pointer to a ClientThreadData struct containing the fd for the
- * client, a pointer to the dictionary, the semaphore to handle the maximum
- * number of connections and the statistics struct
- */
-void* client_wrapper(void* v) {
-    ClientThreadData* data = (ClientThreadData*)v;
-    client_handler_thread(data->fd, data->dict, data->maxConns, data->stats);
-    
-    return NULL;
-}
-
-/* client_handler_thread()
- * -----------------------
- * Client handler thread function that reads each line from the server, updates
- * the total number of concurrent connections and the stats upon exit.
+ * server: ServerContext struct shared by all I/O threads
  *
- * fd: socket file descriptor
- * dict: Dictionary structure that contains word and the number of words in it
- * maxConns: the semaphor that handles the maximum number of concurrent clients
- * allowed to be on the server
+ * Returns: the I/O thread, which connections can now be added to
  */
-void client_handler_thread(int fd, Dictionary* dict, sem_t* maxConns,
-        Statistics* stats) {
-    char* line;
-    int fd2 = dup(fd);
-    FILE* in = fdopen(fd, "r");
-    FILE* out = fdopen(fd2, "w");
+IoThread* create_io_thread(ServerContext* server) {
+    IoThread* io = malloc(sizeof(IoThread));
+    pthread_t threadID;
+    struct epoll_event event;
 
-    while ((line = read_line(in))) {
-        process_command(line, out, dict, stats);
-    }
-    
-    // Once done, allow another client connection and remove 1 from 
-    // current connected clients stat
-    stats_complete_connection(stats);
+    io->epollFd = epoll_create1(0);
+    io->eventFd = eventfd(0, EFD_NONBLOCK);
+    io->server = server;
+    io->cryptData = calloc(1, sizeof(struct crypt_data));
+    io->doneHead = NULL;
+    io->closedHead = NULL;
+    pthread_mutex_init(&io->lock, NULL);
 
-    fclose(in);
-    fclose(out);
-    close(fd2);
-    close(fd);
-    sem_post(maxConns);
+    // The eventfd is told apart from connections by its null pointer
+    event.events = EPOLLIN;
+    event.data.ptr = NULL;
+    epoll_ctl(io->epollFd, EPOLL_CTL_ADD, io->eventFd, &event);
+
+    pthread_create(&threadID, 0, io_thread, io);
+    pthread_detach(threadID); // I/O threads never exit
+    return io;
 }
 
-/* process_command()
- * -----------------
- * Processes each command from the client, determining whether it is a crack,
- * crypt or invalid request. Whilst processing this command, it also updates
- * the Statistics struct. Once processed it sends a message back to the client.
+/* io_thread()
+ * -----------
+ * Function that is ran by every I/O thread. It waits on its epoll instance
+ * and services each connection that is ready to be read from or written to.
+ * When woken up by its eventfd, it adds the results of each finished crack
+ * job to its connection and carries on servicing that connection. Events for
+ * connections closed earlier in the same batch are skipped, and those
+ * connections are only freed once the whole batch has been handled.
  *
- * command: command sent by the client
- * out: file that is used for messages getting sent to the server
- * dict: Dictionary structure that contains word and the number of words in it
- * stats: Statistics struct that contains all of the server statistics
+ * v: void pointer to the IoThread
  */
-void process_command(char* command, FILE* out, Dictionary* dict,
-        Statistics* stats) {
-    char** parts = split_by_char(command, ' ', MAX_FIELDS);
-    char* result;
+void* io_thread(void* v) {
+    IoThread* io = (IoThread*)v;
+    struct epoll_event events[MAX_EVENTS];
 
-    if (parts[0] == NULL) {
-        result = INVALID;
-    } else if (strcmp(parts[0], "crack") == 0) {
-        stats_add_crack_request(stats);
-        // Check if ciphertext length valid, number of threads valid
-        if (parts[1] == NULL || parts[2] == NULL) {
-            result = INVALID;
-        } else if (strlen(parts[1]) != CIPHER_LENGTH || 
-                !valid_thread_num(parts[2])) {
-            result = INVALID;
-        // Checks if salt in substring is valid
-        } else if (!(valid_salt_character(parts[1][0]) && 
-                valid_salt_character(parts[1][1]))) {
-            result = INVALID;
-        } else {
-            result = crack_call(parts[1], atoi(parts[2]), dict, stats);
+    while (1) {
+        int numEvents = epoll_wait(io->epollFd, events, MAX_EVENTS, -1);
+        for (int i = 0; i < numEvents; i++) {
+            Connection* conn = events[i].data.ptr;
+            if (conn) {
+                if (!conn->closed) {
+                    connection_service(conn, events[i].events);
+                }
+                continue;
+            }
+
+            // Take every finished crack at once
+            uint64_t count;
+            if (read(io->eventFd, &count, sizeof(count)) < 0) {
+                continue;
+            }
+            pthread_mutex_lock(&io->lock);
+            CrackJob* done = io->doneHead;
+            io->doneHead = NULL;
+            pthread_mutex_unlock(&io->lock);
+            while (done) {
+                CrackJob* job = done;
+                done = job->nextDone;
+                conn = job->conn;
+                conn->inFlight--;
+                if (!job->tag[0]) {
+                    conn->plainInFlight = false;
+                }
+                crack_job_respond(conn, job);
+                connection_service(conn, 0);
+            }
         }
-    } else if (strcmp(parts[0], "crypt") == 0) {
-        stats_add_crypt_request(stats);
-        // Checking salt
-        if (parts[1] == NULL || parts[2] == NULL) {
-            result = INVALID;
-        } else if (!valid_salt(parts[2])) {
-            result = INVALID;
-        } else {
-            result = crypt_call(parts[1], parts[2]);
-            stats_add_crypt_call(stats, 1);
+        while (io->closedHead) {
+            Connection* conn = io->closedHead;
+            io->closedHead = conn->nextClosed;
+            connection_free(conn);
         }
-    } else {
-        result = INVALID;
     }
+    return NULL;
+}
+
+/* io_thread_complete()
+ * --------------------
+ * Hands a finished crack job back to the I/O thread of the connection that
+ * asked for it, and wakes the I/O thread up. Called by the crack workers.
+ *
+ * job: the finished crack job
+ */
+void io_thread_complete(CrackJob* job) {
+    IoThread* io = job->conn->io;
+    uint64_t one = 1;
 
-    fprintf(out, "%s\n", result);
-    fflush(out);
+    pthread_mutex_lock(&io->lock);
+    job->nextDone = io->doneHead;
+    io->doneHead = job;
+    pthread_mutex_unlock(&io->lock);
+    if (write(io->eventFd, &one, sizeof(one)) < 0) {
+        perror("Error waking I/O thread");
+    }
 }
 
-/* create_crack_thread_data()
- * --------------------------
- * Creates the struct CrackThreadData that is sent to each cracking thread, and
- * then returns it.
+/* create_connection()
+ * -------------------
+ * Sets up a newly accepted client connection for an I/O thread. The socket is
+ * made non-blocking and the client is registered with the crack scheduler.
  *
- * cipherText: cipher text that is being cracked
- * salt: salt part of the ciphertext (first 2 characters)
- * words: array of words from the dictionary
- * startPos: position of the dictionary that this thread will start cracking at
- * endPos: position of the dictionary that this thread will stop cracking at
- * found: flag telling each thread if they've found the word, so they can
- * stop useless cracking
+ * fd: socket file descriptor
+ * io: I/O thread that will service the connection
+ * maxConns: the semaphor that handles the maximum number of concurrent clients
+ * allowed to be on the server
  *
- * Returns: CrackThreadData struct
+ * Returns: the connection, which isn't in the I/O thread's epoll yet
  */
-CrackThreadData* create_crack_thread_data(char* cipherText, char* salt,
-        char** words, int startPos, int endPos, volatile int* found) {
-    CrackThreadData* data = malloc(sizeof(CrackThreadData));
-    // Packages up crack thread data struct
-    data->cipherText = cipherText;
-    data->salt = salt;
-    data->words = words;
-    data->startPos = startPos;
-    data->endPos = endPos;
-    data->found = found;
+Connection* create_connection(int fd, IoThread* io, sem_t* maxConns) {
+    Connection* conn = calloc(1, sizeof(Connection));
 
-    return data;
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    conn->fd = fd;
+    conn->io = io;
+    conn->client = crack_pool_add_client(io->server->pool);
+    conn->maxConns = maxConns;
+    conn->inSize = READ_SIZE;
+    conn->in = malloc(conn->inSize);
+    return conn;
 }
 
-/* crack_call()
- * ------------
- * Function that coordinates the cracking of ciphertext. If a multi-threaded
- * crack is requested, this function splits the dictionary up into parts for
- * each thread to use. It then creates each cracking thread and then waits on
- * a result from these threads. Additionally, it also updates the Statistics
- * struct.
- * 
- * cipherText: cipher text that is being cracked
- * numThreads: number of threads that is requested to being used to crack this
- * cipher text
- * dict: Dictionary struct that contains the words and the number of words
- * stats: Statistics struct that contains all of the server statistics
+/* connection_service()
+ * --------------------
+ * Does everything that can be done for a connection without blocking. Any
+ * complete lines that have already been read are processed, and then more is
+ * read and processed until the socket has nothing left, a line has to wait
+ * on requests in progress or the client isn't keeping up with the responses.
+ * Once the client has hung up, no requests are in progress and every response
+ * has been sent, the connection is closed. Otherwise it is left waiting for
+ * the right epoll events.
  *
- * Returns: the result of the cracking. Either the actual text or a failed
- * string
+ * conn: connection to service
+ * events: epoll events that the connection is ready for (0 if none)
  */
-char* crack_call(char* cipherText, int numThreads, Dictionary* dict,
-        Statistics* stats) {
-    CrackThreadReturn* crackReturned;
-    char* result = NULL;
-    // Extract salt from cipher text
-    char* salt = malloc(sizeof(char) * (SALT_LENGTH + 1));
-    strncpy(salt, cipherText, SALT_LENGTH);
-
-    // Dictionary start and end points
-    int startPos = 0;
-    int endPos;
-    int increment = 0;
-
-    //Calculate start and end points
-    if (dict->numWords < numThreads || numThreads == 1) {
-        endPos = dict->numWords;
-        numThreads = 1; //Only one thread used
-    } else {
-        increment = dict->numWords / numThreads;
-        endPos = increment;
-    }
-    volatile int* found = malloc(sizeof(int));
-    *found = 0;
-
-    pthread_t tids[numThreads]; // Store all of the thread ids
-    // Create each thread
-    for (int i = 0; i < numThreads; i++) {
-        if ((numThreads - 1) == i) {
-            endPos = dict->numWords;
-        }
-        CrackThreadData* data = create_crack_thread_data(cipherText, salt,
-                dict->words, startPos, endPos, found); 
-        pthread_create(&tids[i], 0, crack_thread, data);
-        startPos += increment;
-        endPos += increment;
-    }
-    // Wait on the result of each thread
-    for (int i = 0; i < numThreads; i++) {
-        pthread_join(tids[i], (void**) &crackReturned);
-        stats_add_crypt_call(stats, crackReturned->numCalls);
-        if (crackReturned->word != NULL) {
-            stats_add_crack_request_pass(stats);
-            result = crackReturned->word;
+void connection_service(Connection* conn, uint32_t events) {
+    if (events & (EPOLLERR | EPOLLHUP)) {
+        conn->hungUp = true;
+    }
+    connection_process_lines(conn);
+    connection_flush(conn);
+    while (!conn->stalled && !conn->hungUp
+            && conn->outSent == conn->outLength && connection_read(conn)) {
+        connection_process_lines(conn);
+        connection_flush(conn);
+    }
+
+    if (conn->hungUp && !conn->stalled && conn->inStart < conn->inLength) {
+        // Last line didn't end in a newline (a byte is always kept spare)
+        conn->in[conn->inLength] = '\0';
+        if (connection_start_line(conn, conn->in + conn->inStart)) {
+            conn->inStart = conn->inLength;
+        } else {
+            conn->stalled = true;
         }
+        connection_flush(conn);
     }
-    if (result == NULL) {
-        stats_add_crack_request_fail(stats);
-        result = FAILED;
+    if (conn->hungUp && !conn->inFlight && conn->inStart == conn->inLength
+            && conn->outSent == conn->outLength) {
+        connection_close(conn);
+        return;
     }
-    return result;
+    connection_update_events(conn);
 }
 
-/* crack_thread()
- * --------------
- * Function that tries to brute-force crack some ciphertext. This function
- * will go through a subset of words in the dictionary (all words in the
- * dictionary if single-threaded crack) and encrypt each one. If it has found
- * a match, it will return this word and notify all of the other threads to
- * stop cracking.
+/* connection_read()
+ * -----------------
+ * Reads whatever the client has sent into the connection's input buffer,
+ * first moving any partial line to the start of the buffer. If the client has
+ * hung up, or the read fails, the connection is marked as hung up.
  *
- * v: void pointer to CrackThreadData struct that contains the cipher text,
- * salt, words to go through, a start and an end point and the flag to tell
- * other threads to stop.
+ * conn: connection to read from
  *
- * Returns: CrackThreadReturn struct that contains the result of the crack
- * (either the word or null) and the number of crypt calls that the thread made
+ * Returns: false if there was nothing to read yet, otherwise true
  */
-void* crack_thread(void* v) {
+bool connection_read(Connection* conn) {
+    conn->inLength -= conn->inStart;
+    memmove(conn->in, conn->in + conn->inStart, conn->inLength);
+    conn->inStart = 0;
+    // Always leave room to null terminate a line
+    if (conn->inSize - conn->inLength <= READ_SIZE) {
+        conn->inSize *= 2;
+        conn->in = realloc(conn->in, conn->inSize);
+    }
 
-    // Unwrapping done in the function
-    CrackThreadData* crackData = (CrackThreadData*)v;
+    ssize_t numRead = read(conn->fd, conn->in + conn->inLength,
+            conn->inSize - conn->inLength - 1);
+    if (numRead < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        return false;
+    }
+    if (numRead <= 0) {
+        conn->hungUp = true;
+        return true;
+    }
+    conn->inLength += numRead;
+    return true;
+}
 
-    CrackThreadReturn* crackReturned = malloc(sizeof(crackReturned));
-    crackReturned->word = NULL;
-    crackReturned->numCalls = 0;
+/* connection_process_lines()
+ * --------------------------
+ * Starts each complete line in the connection's input buffer, in order,
+ * until there are none left or the next line has to wait on requests that
+ * are in progress (the connection is then stalled).
+ *
+ * conn: connection whose lines are processed
+ */
+void connection_process_lines(Connection* conn) {
+    conn->stalled = false;
+    while (1) {
+        char* line = conn->in + conn->inStart;
+        char* newline = memchr(line, '\n', conn->inLength - conn->inStart);
+        if (!newline) {
+            break;
+        }
+        *newline = '\0';
+        if (!connection_start_line(conn, line)) {
+            *newline = '\n'; // Left as it was for next time
+            conn->stalled = true;
+            break;
+        }
+        conn->inStart = newline + 1 - conn->in;
+    }
+}
+
+/* connection_start_line()
+ * -----------------------
+ * Works out a line's request ID, if it has one, and processes its command if
+ * it can start now. A line that starts with "#<digits> " is tagged with that
+ * ID, and once the connection is pipelined, untagged lines are given the next
+ * number as their ID. Tagged requests can start unless a plain request is in
+ * progress or too many requests are in progress, and plain requests can only
+ * start once nothing else is in progress.
+ *
+ * conn: connection the line was sent on
+ * line: the line, without its newline
+ *
+ * Returns: true if it was processed, false if it has to wait
+ */
+bool connection_start_line(Connection* conn, char* line) {
+    int tagLength = request_tag_length(line);
+
+    if (tagLength || conn->pipelined) {
+        if (conn->plainInFlight || conn->inFlight >= MAX_IN_FLIGHT) {
+            return false;
+        }
+    } else if (conn->inFlight) {
+        return false;
+    }
+
+    if (tagLength) {
+        // Without the # and the space
+        memcpy(conn->tag, line + 1, tagLength - 2);
+        conn->tag[tagLength - 2] = '\0';
+        line += tagLength;
+    } else if (conn->pipelined) {
+        snprintf(conn->tag, sizeof(conn->tag), "%u", ++conn->nextID);
+    } else {
+        conn->tag[0] = '\0';
+    }
+    process_command(line, conn);
+    return true;
+}
+
+/* request_tag_length()
+ * --------------------
+ * Finds the request ID that a line is tagged with - a # followed by 1 to
+ * MAX_TAG_LENGTH digits and a space.
+ *
+ * line: the line to check
+ *
+ * Returns: length of the tag including the # and the space, or 0 if the line
+ * isn't tagged
+ */
+int request_tag_length(const char* line) {
+    int length = 1;
+
+    if (line[0] != '#') {
+        return 0;
+    }
+    while (isdigit(line[length]) && length <= MAX_TAG_LENGTH) {
+        length++;
+    }
+    if (length == 1 || line[length] != ' ') {
+        return 0;
+    }
+    return length + 1;
+}
+
+/* connection_respond()
+ * --------------------
+ * Adds a response line to the connection's output buffer, tagged with the
+ * request's ID if it has one. It is sent by the next connection_flush().
+ *
+ * conn: connection to respond to
+ * tag: ID of the request being responded to (empty if none)
+ * result: the response, without a newline
+ */
+void connection_respond(Connection* conn, const char* tag,
+        const char* result) {
+    char prefix[MAX_TAG_LENGTH + 3];
+    size_t prefixLength = tag[0] ? (size_t)sprintf(prefix, "#%s ", tag) : 0;
+    size_t length = strlen(result);
+    size_t needed = conn->outLength + prefixLength + length + 1;
+
+    if (needed > conn->outSize) {
+        conn->outSize = needed * 2;
+        conn->out = realloc(conn->out, conn->outSize);
+    }
+    memcpy(conn->out + conn->outLength, prefix, prefixLength);
+    memcpy(conn->out + conn->outLength + prefixLength, result, length);
+    conn->out[needed - 1] = '\n';
+    conn->outLength = needed;
+}
+
+/* connection_flush()
+ * ------------------
+ * Sends as much of the connection's output buffer as the socket will take.
+ * If the client can no longer be written to, the rest of the output is
+ * thrown away and the connection is marked as hung up.
+ *
+ * conn: connection to send to
+ */
+void connection_flush(Connection* conn) {
+    while (conn->outSent < conn->outLength) {
+        ssize_t numSent = send(conn->fd, conn->out + conn->outSent,
+                conn->outLength - conn->outSent, MSG_NOSIGNAL);
+        if (numSent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return; // Wait for EPOLLOUT
+        }
+        if (numSent <= 0) {
+            conn->hungUp = true;
+            break;
+        }
+        conn->outSent += numSent;
+    }
+    conn->outSent = 0;
+    conn->outLength = 0;
+}
+
+/* connection_update_events()
+ * --------------------------
+ * Sets which epoll events the connection waits for. If the client hasn't
+ * taken all of the output yet it waits until it can be written to. Otherwise
+ * it waits for more input, unless it is stalled or the client has hung up,
+ * in which case it is taken out of epoll until a request finishes.
+ *
+ * conn: connection to update
+ */
+void connection_update_events(Connection* conn) {
+    struct epoll_event event;
+    int epollFd = conn->io->epollFd;
+    bool wantOutput = conn->outSent < conn->outLength;
+
+    if (!wantOutput && (conn->stalled || conn->hungUp)) {
+        if (conn->registered) {
+            epoll_ctl(epollFd, EPOLL_CTL_DEL, conn->fd, NULL);
+            conn->registered = false;
+        }
+        return;
+    }
+    event.events = wantOutput ? EPOLLOUT : EPOLLIN;
+    event.data.ptr = conn;
+    uint32_t previous = conn->events;
+    conn->events = event.events;
+    if (!conn->registered) {
+        // Added last, since the I/O thread can service (and even free) the
+        // connection as soon as it is in the epoll
+        conn->registered = true;
+        epoll_ctl(epollFd, EPOLL_CTL_ADD, conn->fd, &event);
+    } else if (event.events != previous) {
+        epoll_ctl(epollFd, EPOLL_CTL_MOD, conn->fd, &event);
+    }
+}
+
+/* connection_close()
+ * ------------------
+ * Closes a connection once the client has hung up and nothing is left to do
+ * for it. It allows another client connection and updates the stats. The
+ * connection is taken out of epoll before its socket is closed, and is put on
+ * its I/O thread's closed list to be freed once the current batch of events
+ * has been handled.
+ *
+ * conn: connection to close
+ */
+void connection_close(Connection* conn) {
+    if (conn->registered) {
+        epoll_ctl(conn->io->epollFd, EPOLL_CTL_DEL, conn->fd, NULL);
+    }
+    crack_pool_remove_client(conn->io->server->pool, conn->client);
+
+    // Once done, allow another client connection and remove 1 from 
+    // current connected clients stat
+    stats_complete_connection(conn->io->server->stats);
+    stats_worker_connection(conn->io->server->stats, conn->io->server->worker,
+            -1);
+    close(conn->fd);
+    sem_post(conn->maxConns);
+    conn->closed = true;
+    conn->nextClosed = conn->io->closedHead;
+    conn->io->closedHead = conn;
+}
+
+/* connection_free()
+ * -----------------
+ * Frees a connection that has been closed.
+ *
+ * conn: the closed connection
+ */
+void connection_free(Connection* conn) {
+    free(conn->in);
+    free(conn->out);
+    free(conn);
+}
+
+/* process_command()
+ * -----------------
+ * Processes each command from the client, determining whether it is a crack,
+ * crypt or invalid request. Whilst processing this command, it also updates the
+ * Statistics struct. Once processed it adds a response for the client, unless
+ * the command was handed to the crack workers, which respond once they have
+ * finished. A crack command can end with rules=<name> to also try every word
+ * mangled by a rule set, and a crackmask command tries every candidate of a
+ * mask instead. A crackbatch command gets a response for each of its cipher
+ * texts. A hello command switches the connection to pipelined mode. submit
+ * crack (or crackmask) starts a crack that no connection waits for, and
+ * status and result report on it. Responses are tagged with the connection's
+ * current request ID.
+ *
+ * command: command sent by the client
+ * conn: connection the command was sent on
+ */
+void process_command(char* command, Connection* conn) {
+    Statistics* stats = conn->io->server->stats;
+    char** parts = split_by_char(command, ' ', MAX_FIELDS);
+    char* result = NULL;
+    char cached[CIPHER_LENGTH + 1];
+    int numThreads;
+    const RuleSet* rules;
+    CrackMask* mask;
+
+    if (parts[0] == NULL) {
+        result = INVALID;
+    } else if (strcmp(parts[0], "crack") == 0) {
+        stats_add_crack_request(stats);
+        // Check if ciphertext valid, number of threads (and rules) valid
+        if (parts[1] == NULL || parts[2] == NULL) {
+            result = INVALID;
+        } else if (!valid_cipher_text(parts[1]) ||
+                !parse_crack_options(parts[2], &numThreads, &rules)) {
+            result = INVALID;
+        } else {
+            crack_call(parts[1], numThreads, rules, conn);
+        }
+    } else if (strcmp(parts[0], "crackmask") == 0) {
+        stats_add_crack_request(stats);
+        if (parts[1] == NULL || parts[2] == NULL
+                || !valid_cipher_text(parts[1])) {
+            result = INVALID;
+        } else if (!(mask = parse_mask_options(parts[2], &numThreads))) {
+            result = INVALID;
+        } else {
+            crack_mask_call(parts[1], numThreads, mask, conn);
+        }
+    } else if (strcmp(parts[0], "crackbatch") == 0) {
+        if (parts[1] == NULL || parts[2] == NULL) {
+            stats_add_crack_request(stats);
+            result = INVALID;
+        } else {
+            crack_batch_command(parts[1], parts[2], conn);
+        }
+    } else if (strcmp(parts[0], "hello") == 0 && parts[1] == NULL) {
+        conn->pipelined = true;
+        result = PIPELINED;
+    } else if (strcmp(parts[0], "submit") == 0 && parts[1] != NULL
+            && (strcmp(parts[1], "crack") == 0
+            || strcmp(parts[1], "crackmask") == 0)) {
+        stats_add_crack_request(stats);
+        submit_command(parts[1], parts[2], conn);
+    } else if (strcmp(parts[0], "status") == 0 && parts[1] != NULL
+            && parts[2] == NULL) {
+        job_status_command(parts[1], conn);
+    } else if (strcmp(parts[0], "result") == 0 && parts[1] != NULL
+            && parts[2] == NULL) {
+        job_result_command(parts[1], conn);
+    } else if (strcmp(parts[0], "reload") == 0 && parts[1] == NULL) {
+        result = dictionary_reload(conn->io->server) ? RELOADING : BUSY;
+    } else if (strcmp(parts[0], "crypt") == 0) {
+        stats_add_crypt_request(stats);
+        // Checking salt
+        if (parts[1] == NULL || parts[2] == NULL) {
+            result = INVALID;
+        } else if (!valid_salt(parts[2])) {
+            result = INVALID;
+        } else {
+            uint64_t start = now_micros();
+            result = crypt_command(parts[1], parts[2], conn, cached);
+            stats_record_latency(stats, LATENCY_CRYPT, start);
+        }
+    } else {
+        result = INVALID;
+    }
+
+    if (result) {
+        connection_respond(conn, conn->tag, result);
+    }
+    free(parts);
+}
+
+/* crack_batch_command()
+ * ---------------------
+ * Processes the arguments of a crackbatch command, which are the number of
+ * threads followed by the space separated cipher texts. Each cipher text
+ * counts as a crack request. If the number of threads is invalid, every
+ * cipher text gets an invalid response.
+ *
+ * numThreads: number of threads argument
+ * cipherTexts: the rest of the command
+ * conn: connection the command was sent on
+ */
+void crack_batch_command(char* numThreads, char* cipherTexts,
+        Connection* conn) {
+    char** parts = split_by_char(cipherTexts, ' ', 0);
+
+    for (int i = 0; parts[i]; i++) {
+        stats_add_crack_request(conn->io->server->stats);
+    }
+    if (valid_thread_num(numThreads)) {
+        crack_batch_call(parts, atoi(numThreads), conn);
+    } else {
+        for (int i = 0; parts[i]; i++) {
+            connection_respond(conn, conn->tag, INVALID);
+        }
+    }
+    free(parts);
+}
+
+/* default_crack_workers()
+ * -----------------------
+ * Works out how many crack worker threads the pool should have, which is the
+ * number of processors that are online on this machine.
+ *
+ * Returns: number of crack workers to create (at least 1)
+ */
+int default_crack_workers(void) {
+    long numProcessors = sysconf(_SC_NPROCESSORS_ONLN);
+    if (numProcessors < 1) {
+        return 1;
+    }
+    return (int)numProcessors;
+}
+
+/* create_crack_pool()
+ * -------------------
+ * Creates the server-wide crack scheduler and starts all of its worker
+ * threads. The workers live for as long as the server does and wait on the
+ * pool for crack tasks to run. Only numWorkers chunks of crack work can be
+ * running at any time, no matter how many clients are connected.
+ *
+ * numWorkers: number of worker threads to create (the core count cap)
+ *
+ * Returns: crack worker pool that is ready to accept jobs
+ */
+CrackPool* create_crack_pool(int numWorkers) {
+    CrackPool* pool = malloc(sizeof(CrackPool));
+    pthread_t threadID;
+
+    pool->readyHead = NULL;
+    pool->readyTail = NULL;
+    pool->clients = NULL;
+    pool->nextClientID = 1;
+    pool->queueDepth = 0;
+    pool->numWorkers = numWorkers;
+    pool->numBusy = 0;
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->available, NULL);
+
+    for (int i = 0; i < numWorkers; i++) {
+        pthread_create(&threadID, 0, crack_worker_thread, pool);
+        pthread_detach(threadID); // Workers never exit
+    }
+    return pool;
+}
+
+/* crack_pool_add_client()
+ * -----------------------
+ * Registers a newly connected client with the scheduler so that its crack
+ * requests get their own queue and a fair share of the workers.
+ *
+ * pool: crack worker pool
+ *
+ * Returns: the client's scheduling state, to be passed to crack_call()
+ */
+CrackClient* crack_pool_add_client(CrackPool* pool) {
+    CrackClient* client = calloc(1, sizeof(CrackClient));
+
+    pthread_mutex_lock(&pool->lock);
+    client->id = pool->nextClientID++;
+    client->next = pool->clients;
+    if (pool->clients) {
+        pool->clients->prev = client;
+    }
+    pool->clients = client;
+    pthread_mutex_unlock(&pool->lock);
+    return client;
+}
+
+/* crack_pool_remove_client()
+ * --------------------------
+ * Removes a client that has disconnected from the scheduler and frees it. The
+ * client must not have any crack requests in progress.
+ *
+ * pool: crack worker pool
+ * client: client to remove
+ */
+void crack_pool_remove_client(CrackPool* pool, CrackClient* client) {
+    pthread_mutex_lock(&pool->lock);
+    if (client->prev) {
+        client->prev->next = client->next;
+    } else {
+        pool->clients = client->next;
+    }
+    if (client->next) {
+        client->next->prev = client->prev;
+    }
+    pthread_mutex_unlock(&pool->lock);
+    free(client);
+}
+
+/* crack_pool_submit()
+ * -------------------
+ * Adds the given tasks to the end of their client's queue and wakes up the
+ * workers so they can start on them.
+ *
+ * pool: crack worker pool
+ * tasks: array of tasks for a crack job, all from the same client
+ * numTasks: number of tasks in the array
+ */
+void crack_pool_submit(CrackPool* pool, CrackTask* tasks, int numTasks) {
+    pthread_mutex_lock(&pool->lock);
+    for (int i = 0; i < numTasks; i++) {
+        crack_pool_enqueue(pool, &tasks[i]);
+    }
+    pthread_cond_broadcast(&pool->available);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+/* crack_pool_enqueue()
+ * --------------------
+ * Adds a task to the end of its client's queue. If the client had nothing
+ * queued, it joins the end of the ready list so it gets its turn after every
+ * other client that is waiting. The pool must be locked.
+ *
+ * pool: crack worker pool
+ * task: task to queue
+ */
+void crack_pool_enqueue(CrackPool* pool, CrackTask* task) {
+    CrackClient* client = task->client;
+
+    task->next = NULL;
+    if (client->tail) {
+        client->tail->next = task;
+    } else {
+        client->head = task;
+        client->nextReady = NULL;
+        if (pool->readyTail) {
+            pool->readyTail->nextReady = client;
+        } else {
+            pool->readyHead = client;
+        }
+        pool->readyTail = client;
+    }
+    client->tail = task;
+    client->numQueued++;
+    pool->queueDepth++;
+}
+
+/* crack_pool_take()
+ * -----------------
+ * Takes the next task for a worker to run, waiting until one is available if
+ * nothing is queued. Clients take turns in round-robin order: the task comes
+ * from the client at the front of the ready list, which then goes to the back
+ * of the list if it still has tasks queued.
+ *
+ * pool: crack worker pool
+ *
+ * Returns: the task that the calling worker should run a chunk of
+ */
+CrackTask* crack_pool_take(CrackPool* pool) {
+    pthread_mutex_lock(&pool->lock);
+    while (!pool->readyHead) {
+        pthread_cond_wait(&pool->available, &pool->lock);
+    }
+    CrackClient* client = pool->readyHead;
+    CrackTask* task = client->head;
+
+    client->head = task->next;
+    client->numQueued--;
+    pool->queueDepth--;
+    pool->numBusy++;
+    pool->readyHead = client->nextReady;
+    if (!pool->readyHead) {
+        pool->readyTail = NULL;
+    }
+    if (client->head) {
+        // Still has work, so it goes to the back of the line
+        client->nextReady = NULL;
+        if (pool->readyTail) {
+            pool->readyTail->nextReady = client;
+        } else {
+            pool->readyHead = client;
+        }
+        pool->readyTail = client;
+    } else {
+        client->tail = NULL;
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return task;
+}
+
+/* crack_pool_finish_chunk()
+ * -------------------------
+ * Records the work that a worker has done on a task's chunk against the
+ * task's client. If the task's job still has chunks left, the task is queued
+ * again so that it waits for its client's next turn.
+ *
+ * pool: crack worker pool
+ * task: task that a chunk was run for
+ * numCalls: number of words hashed in the chunk
+ * more: whether the task should be queued again
+ */
+void crack_pool_finish_chunk(CrackPool* pool, CrackTask* task, int numCalls,
+        bool more) {
+    pthread_mutex_lock(&pool->lock);
+    task->client->numCalls += numCalls;
+    pool->numBusy--;
+    if (more) {
+        crack_pool_enqueue(pool, task);
+        pthread_cond_signal(&pool->available);
+    }
+    pthread_mutex_unlock(&pool->lock);
+}
+
+/* crack_pool_print_stats()
+ * ------------------------
+ * Prints the number of crack tasks waiting for a worker, and the share of the
+ * crack work (words hashed) done for each connected client.
+ *
+ * pool: crack worker pool
+ * out: file to print the stats to
+ */
+void crack_pool_print_stats(CrackPool* pool, FILE* out) {
+    uint64_t totalCalls = 0;
+
+    pthread_mutex_lock(&pool->lock);
+    fprintf(out, "Crack workers: %d (%d busy)\nCrack queue depth: %u\n",
+            pool->numWorkers, pool->numBusy, pool->queueDepth);
+    for (CrackClient* client = pool->clients; client; client = client->next) {
+        totalCalls += client->numCalls;
+    }
+    for (CrackClient* client = pool->clients; client; client = client->next) {
+        fprintf(out, "Client %u crack share: %.1f%% (%u queued)\n",
+                client->id, totalCalls ? 100.0 * client->numCalls / totalCalls
+                : 0.0, client->numQueued);
+    }
+    pthread_mutex_unlock(&pool->lock);
+}
+
+/* crack_worker_thread()
+ * ---------------------
+ * Function that is ran by every thread in the crack worker pool. It takes
+ * tasks from the scheduler and runs one chunk of the task's job at a time,
+ * handing the task back to the scheduler in between so that other clients
+ * get their turn. Once a task has no chunks left its result is added to the
+ * job, and once the last task of a job is done, the job is finished and its
+ * result is handed back to the connection's I/O thread (or to the job table,
+ * for a submitted job).
+ *
+ * v: void pointer to the CrackPool the worker belongs to
+ */
+void* crack_worker_thread(void* v) {
+    CrackPool* pool = (CrackPool*)v;
+
+    while (1) {
+        CrackTask* task = crack_pool_take(pool);
+        CrackJob* job = task->job;
+        int numCalls = 0;
+        bool more;
+        if (__atomic_exchange_n(&job->waiting, false, __ATOMIC_RELAXED)) {
+            stats_record_latency(job->server->stats, LATENCY_CRACK_QUEUE,
+                    job->startMicros);
+        }
+        if (job->submitted) {
+            // Whatever chunk is claimed next is at least the claimed count
+            __atomic_store_n(&task->chunk, job_claimed_chunks(job),
+                    __ATOMIC_RELAXED);
+            __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        }
+        if (job->batch) {
+            more = batch_chunk(task, &numCalls);
+        } else if (job->entries) {
+            more = index_chunk(task, &numCalls);
+        } else if (job->rules) {
+            more = rules_chunk(task, &numCalls);
+        } else if (job->mask) {
+            more = mask_chunk(task, &numCalls);
+        } else {
+            more = crack_chunk(task, &numCalls);
+        }
+        task->numCalls += numCalls;
+        stats_add_crypt_call(job->server->stats, numCalls);
+        if (job->submitted) {
+            __atomic_add_fetch(&job->submitted->status->numHashed, numCalls,
+                    __ATOMIC_RELAXED);
+            __atomic_store_n(&task->chunk, NO_CHUNK, __ATOMIC_RELEASE);
+        }
+        crack_pool_finish_chunk(pool, task, numCalls, more);
+        if (more) {
+            continue;
+        }
+
+        // Add the result of this task to the job
+        pthread_mutex_lock(&job->lock);
+        job->numCalls += task->numCalls;
+        if (task->word != NULL) {
+            job->word = task->word;
+        }
+        bool last = --job->tasksLeft == 0;
+        pthread_mutex_unlock(&job->lock);
+        if (last) {
+            pthread_mutex_destroy(&job->lock);
+            crack_job_finish(job);
+            if (job->submitted) {
+                job_table_complete(job);
+            } else {
+                io_thread_complete(job);
+            }
+        }
+    }
+    return NULL;
+}
+
+/* crack_call()
+ * ------------
+ * Function that coordinates the cracking of ciphertext. If an index file is
+ * being used, or the salt index is enabled and the cipher text's salt has been
+ * indexed, the result is looked up. Otherwise one task per requested thread
+ * is queued for the client in the crack scheduler, and the workers that run
+ * them share the dictionary by claiming small chunks of it at a time. The
+ * requested number of threads is therefore a limit on how many workers can
+ * work on this request at once - no threads are created. If this is the
+ * first crack of a salt that isn't indexed, the workers hash the whole
+ * dictionary and the result is added to the salt index. Cipher texts in the
+ * potfile or the response cache are answered straight away, without any
+ * workers. With a rule set, every word is hashed once for each rule (mangled
+ * by the workers as they go), and neither index is used. The I/O thread does
+ * not wait for the workers - the last one to finish hands the result back to
+ * the connection.
+ *
+ * cipherText: cipher text that is being cracked
+ * numThreads: number of threads that is requested to being used to crack this
+ * cipher text
+ * rules: rule set to mangle the words with, or null if none
+ * conn: connection that the crack request came from
+ */
+void crack_call(char* cipherText, int numThreads, const RuleSet* rules,
+        Connection* conn) {
+    CrackJob* job = create_crack_job(conn->io->server, conn, NULL,
+            numThreads);
+
+    job->rules = rules;
+    if (crack_job_start(job, cipherText, numThreads)) {
+        crack_job_respond(conn, job);
+    }
+}
+
+/* crack_mask_call()
+ * -----------------
+ * Function that coordinates a crackmask request, which searches every
+ * candidate of a mask rather than the dictionary. It is started like
+ * crack_call(), with the mask's keyspace split into chunks that the workers
+ * claim in turn, so each worker hashes its own range of candidates.
+ *
+ * cipherText: cipher text that is being cracked
+ * numThreads: most workers that can work on the request at once
+ * mask: the mask, which the job frees
+ * conn: connection that the crack request came from
+ */
+void crack_mask_call(char* cipherText, int numThreads, CrackMask* mask,
+        Connection* conn) {
+    CrackJob* job = create_crack_job(conn->io->server, conn, mask,
+            numThreads);
+
+    if (crack_job_start(job, cipherText, numThreads)) {
+        crack_job_respond(conn, job);
+    }
+}
+
+/* crack_job_start()
+ * -----------------
+ * Starts a crack job for a cipher text, as described for crack_call(). The
+ * job is either finished straight away (when its result could be looked up
+ * or it can never match), or submitted to the crack workers.
+ *
+ * job: a new crack job, from create_crack_job(), with its rules or mask set
+ * cipherText: cipher text that is being cracked
+ * numThreads: most workers that can work on the job at once
+ *
+ * Returns: true if the job has already finished, false if the workers will
+ * finish it
+ */
+bool crack_job_start(CrackJob* job, char* cipherText, int numThreads) {
+    ServerContext* server = job->server;
+    Statistics* stats = server->stats;
+    IndexLookup lookup = INDEX_MISS;
+    IndexFile* indexFile = job->version ? job->version->indexFile : NULL;
+
+    // Decode the salt and hash from the cipher text once for all workers
+    des_target_init(&job->target, cipherText);
+    strcpy(job->cipherText, cipherText);
+
+    if (server->potfile
+            && (job->word = potfile_lookup(server->potfile, cipherText))) {
+        // Cracked before, so there is nothing to hash or look up
+        lookup = INDEX_HIT;
+        stats_add(stats, STAT_POTFILE_HITS, 1);
+    } else if (crack_cache_lookup(job)) {
+        lookup = INDEX_HIT;
+    } else if (indexFile && !job->target.impossible && !job->rules
+            && !job->mask) {
+        // Every salt is in the index file so there is nothing to hash
+        int position = index_file_lookup(indexFile,
+                des_salt_value(cipherText), job->target.block);
+        job->word = position >= 0 ? job->words[position] : NULL;
+        lookup = INDEX_HIT;
+        stats_add_index_hit(stats);
+    } else if (server->index && !job->target.impossible && !job->rules
+            && !job->mask && !job->cursor) {
+        // A resumed job has skipped words, so it can't index the salt
+        lookup = salt_index_lookup(server->index, job,
+                &job->version->source->dict);
+        if (lookup == INDEX_HIT) {
+            stats_add_index_hit(stats);
+            stats_add_crypt_call(stats, job->numCalls);
+        } else {
+            stats_add_index_miss(stats);
+        }
+        if (lookup == INDEX_BUILD) {
+            job->entries = malloc(sizeof(SaltIndexEntry) * job->numWords);
+        }
+    }
+
+    // Nothing to hash if it was looked up or can never match
+    if (lookup == INDEX_HIT || job->target.impossible) {
+        crack_job_finish(job);
+        return true;
+    }
+
+    // No more workers than there are chunks for them to claim
+    uint64_t numChunks = job_num_chunks(job);
+    crack_job_submit(job, numChunks < (uint64_t)numThreads ? numChunks
+            : (uint64_t)numThreads);
+    return false;
+}
+
+/* crack_batch_call()
+ * ------------------
+ * Function that coordinates the cracking of a batch of cipher texts. The
+ * cipher texts are grouped by salt, and each group has a small hash set of
+ * its cipher texts' hashes. The crack workers then hash each dictionary word
+ * once per salt (rather than once per cipher text), checking every hash
+ * against the set. A group stops being hashed once all of its cipher texts
+ * have been found. Cipher texts in the potfile are answered from it and left
+ * out of the groups. If an index file is being used, each cipher text is looked
+ * up instead. The salt index cache is not used for batches. Like crack_call(),
+ * the workers hand the results back to the connection once they finish.
+ *
+ * cipherTexts: null terminated array of the cipher texts to crack, which
+ * can include invalid cipher texts
+ * numThreads: number of threads that is requested to being used to crack the
+ * batch
+ * conn: connection that the crack request came from
+ */
+void crack_batch_call(char** cipherTexts, int numThreads, Connection* conn) {
+    ServerContext* server = conn->io->server;
+    CrackJob* job = create_crack_job(server, conn, NULL, numThreads);
+    CrackBatch* batch = create_crack_batch(cipherTexts, server->potfile);
+    IndexFile* indexFile = job->version->indexFile;
+    job->batch = batch;
+
+    // Only targets from the potfile have been answered yet
+    for (int i = 0; i < batch->numTargets; i++) {
+        if (batch->targets[i].word) {
+            stats_add(server->stats, STAT_POTFILE_HITS, 1);
+        }
+    }
+    if (indexFile) {
+        // Every salt is in the index file so there is nothing to hash
+        for (int i = 0; i < batch->numTargets; i++) {
+            BatchTarget* target = &batch->targets[i];
+            if (target->valid && !target->impossible && !target->word) {
+                int position = index_file_lookup(indexFile,
+                        des_salt_value(target->cipherText), target->block);
+                target->word = position >= 0 ? job->words[position] : NULL;
+                stats_add_index_hit(server->stats);
+            }
+        }
+    }
+
+    // Each group is split into the same chunks of the dictionary
+    int numChunks = batch->numGroups
+            * ((job->numWords + job->chunkSize - 1) / job->chunkSize);
+    if (numChunks == 0 || indexFile) {
+        crack_job_finish(job);
+        crack_job_respond(conn, job);
+        return;
+    }
+    crack_job_submit(job, numChunks < numThreads ? numChunks : numThreads);
+}
+
+/* create_crack_job()
+ * ------------------
+ * Allocates a crack job, with room for the given number of tasks, that will
+ * hash the whole dictionary (or a mask's candidates). The job is tagged with
+ * the ID of the request that the connection is processing. Unless it is
+ * searching a mask, it holds a reference to the dictionary in use until it is
+ * freed.
+ *
+ * server: ServerContext struct that contains the dictionary
+ * conn: connection that the crack request came from, or null for a submitted
+ * job
+ * mask: mask to search instead of the dictionary (which the job frees), or
+ * null
+ * maxTasks: the most tasks that the job may be split into
+ *
+ * Returns: the crack job, which has no target yet
+ */
+CrackJob* create_crack_job(ServerContext* server, Connection* conn,
+        CrackMask* mask, int maxTasks) {
+    CrackJob* job = malloc(sizeof(CrackJob) + sizeof(CrackTask) * maxTasks);
+
+    job->version = mask ? NULL : dictionary_acquire(server);
+    job->words = mask ? NULL : job->version->dict.words;
+    job->numWords = mask ? 0 : job->version->dict.numWords;
+    job->chunkSize = des_batch_size() * CHUNK_BATCHES;
+    job->cursor = 0;
+    job->entries = NULL;
+    job->batch = NULL;
+    job->rules = NULL;
+    job->mask = mask;
+    job->found = 0;
+    job->word = NULL;
+    job->numCalls = 0;
+    job->numTasks = 0;
+    job->server = server;
+    job->conn = conn;
+    strcpy(job->tag, conn ? conn->tag : "");
+    job->startMicros = now_micros();
+    job->waiting = false;
+    job->submitted = NULL;
+    return job;
+}
+
+/* crack_job_submit()
+ * ------------------
+ * Queues a crack job's tasks for the connection's client in the crack
+ * scheduler (or the job table's client, for a submitted job). The job counts
+ * as in progress on its connection until it has finished.
+ *
+ * job: the crack job
+ * numTasks: number of tasks to split the job into (at least 1)
+ */
+void crack_job_submit(CrackJob* job, int numTasks) {
+    CrackClient* client = job->conn ? job->conn->client
+            : job->server->jobs->client;
+
+    job->tasksLeft = numTasks;
+    job->waiting = true;
+    pthread_mutex_init(&job->lock, NULL);
+
+    for (int i = 0; i < numTasks; i++) {
+        job->tasks[i].job = job;
+        job->tasks[i].client = client;
+        job->tasks[i].chunk = NO_CHUNK;
+        job->tasks[i].numCalls = 0;
+        job->tasks[i].word = NULL;
+    }
+    __atomic_store_n(&job->numTasks, numTasks, __ATOMIC_RELEASE);
+    if (job->conn) {
+        job->conn->inFlight++;
+        if (!job->tag[0]) {
+            job->conn->plainInFlight = true;
+        }
+    }
+    crack_pool_submit(job->server->pool, job->tasks, numTasks);
+}
+
+/* crack_job_finish()
+ * ------------------
+ * Finishes a crack job once its result is known. If the workers indexed the
+ * job's salt, the index is added to the salt index cache. Cipher texts that
+ * were cracked are added to the potfile (if they aren't already in it), and
+ * every result is added to the response cache (apart from a mask that found
+ * nothing, which says nothing about the dictionary). It also updates the
+ * Statistics struct, counting each cipher text in a batch as a crack request,
+ * and adds to the weight of each dictionary word that was found. The words
+ * hashed for a successful single crack are counted towards the average
+ * words per successful crack (batches share their hashing between cipher
+ * texts, so they aren't).
+ *
+ * job: the crack job, which no worker can still be working on
+ */
+void crack_job_finish(CrackJob* job) {
+    ServerContext* server = job->server;
+    Statistics* stats = server->stats;
+
+    if (job->entries) {
+        salt_index_insert(server->index, des_salt_value(job->cipherText),
+                job->entries, job->numWords, job->version->source->generation);
+    }
+
+    if (!job->batch) {
+        if (job->word != NULL) {
+            dictionary_count_word(job->version, job->word);
+            if (server->potfile) {
+                potfile_add(server->potfile, job->cipherText, job->word);
+            }
+            crack_cache_insert(job, job->cipherText, job->word);
+            stats_add_crack_request_pass(stats);
+            stats_add(stats, STAT_SOLVED_CRACKS, 1);
+            stats_add(stats, STAT_SOLVED_CALLS, job->numCalls);
+        } else {
+            if (!job->mask) {
+                crack_cache_insert(job, job->cipherText, NULL);
+            }
+            stats_add_crack_request_fail(stats);
+        }
+        return;
+    }
+    for (int i = 0; i < job->batch->numTargets; i++) {
+        BatchTarget* target = &job->batch->targets[i];
+        if (target->valid && target->word != NULL) {
+            dictionary_count_word(job->version, target->word);
+            if (server->potfile) {
+                potfile_add(server->potfile, target->cipherText, target->word);
+            }
+            crack_cache_insert(job, target->cipherText, target->word);
+            stats_add_crack_request_pass(stats);
+        } else if (target->valid) {
+            crack_cache_insert(job, target->cipherText, NULL);
+            stats_add_crack_request_fail(stats);
+        }
+    }
+}
+
+/* crack_cache_lookup()
+ * --------------------
+ * Looks a crack job's cipher text up in the response cache. Cipher texts that
+ * can never match aren't looked up, since they are answered straight away.
+ * A cached failure doesn't answer a crack with rules or a mask, which try
+ * other words. A mask job has no dictionary generation, but since it only
+ * uses cached successes (which hold for every generation) any will do.
+ *
+ * job: the crack job. On a hit its word is set to the cached word (kept in
+ * the job), or null if the cipher text was cracked with the same dictionary
+ * and not found.
+ *
+ * Returns: whether the job's result was in the cache
+ */
+bool crack_cache_lookup(CrackJob* job) {
+    ResponseCache* cache = job->server->cache;
+    char key[CACHE_KEY_LENGTH + 1];
+    bool failed;
+    unsigned int generation = job->version
+            ? job->version->source->generation : 0;
+
+    if (!cache || job->target.impossible) {
+        return false;
+    }
+    crack_cache_key(key, job->cipherText);
+    if (!response_cache_lookup(cache, key, generation, job->cached, &failed)
+            || (failed && (job->rules || job->mask))) {
+        stats_add(job->server->stats, STAT_CACHE_MISSES, 1);
+        return false;
+    }
+    stats_add(job->server->stats, STAT_CACHE_HITS, 1);
+    job->word = failed ? NULL : job->cached;
+    return true;
+}
+
+/* crack_cache_insert()
+ * --------------------
+ * Adds the result of cracking a cipher text to the response cache, if there
+ * is one. A failure is tied to the dictionary generation the job cracked
+ * with (mask jobs, which have none, only add successes). Words too long to
+ * cache (which can only come from a potfile) are left out.
+ *
+ * job: the crack job that cracked the cipher text
+ * cipherText: the cipher text
+ * word: the word that was found, or null if none was
+ */
+void crack_cache_insert(CrackJob* job, const char* cipherText,
+        const char* word) {
+    ResponseCache* cache = job->server->cache;
+    char key[CACHE_KEY_LENGTH + 1];
+    unsigned int generation = job->version
+            ? job->version->source->generation : 0;
+
+    if (!cache || (word && strlen(word) > CIPHER_LENGTH)) {
+        return;
+    }
+    crack_cache_key(key, cipherText);
+    response_cache_insert(cache, key, word, generation);
+}
+
+/* crack_job_respond()
+ * -------------------
+ * Adds the results of a finished crack job to the connection's responses -
+ * one line for a crack, or one line per cipher text (in the order they were
+ * sent) for a batch, each tagged with the job's request ID. The time taken to
+ * answer the request is recorded, and the job (and its reference to the
+ * dictionary) is then freed.
+ *
+ * conn: connection that the crack request came from
+ * job: the finished crack job
+ */
+void crack_job_respond(Connection* conn, CrackJob* job) {
+    CrackBatch* batch = job->batch;
+
+    if (!batch) {
+        connection_respond(conn, job->tag, job->word ? job->word : FAILED);
+        stats_record_latency(job->server->stats, LATENCY_CRACK,
+                job->startMicros);
+        dictionary_release(job->version);
+        free(job->mask);
+        free(job);
+        return;
+    }
+    for (int i = 0; i < batch->numTargets; i++) {
+        BatchTarget* target = &batch->targets[i];
+        if (!target->valid) {
+            connection_respond(conn, job->tag, INVALID);
+        } else {
+            connection_respond(conn, job->tag,
+                    target->word ? target->word : FAILED);
+        }
+    }
+    stats_record_latency(job->server->stats, LATENCY_CRACK_BATCH,
+            job->startMicros);
+    free_crack_batch(batch);
+    dictionary_release(job->version);
+    free(job);
+}
+
+/* create_crack_batch()
+ * --------------------
+ * Decodes the cipher texts of a batch crack and groups the ones that could
+ * match a word by salt. Each group gets a hash set of its cipher texts'
+ * hashes, with room for at least twice as many as are in the group. Cipher
+ * texts with the same hash are linked together so that they are all answered
+ * by the same word. Cipher texts that are in the potfile are answered from it
+ * and aren't grouped.
+ *
+ * cipherTexts: null terminated array of the cipher texts
+ * potfile: potfile to answer cipher texts from, or null if none
+ *
+ * Returns: the batch
+ */
+CrackBatch* create_crack_batch(char** cipherTexts, Potfile* potfile) {
+    CrackBatch* batch = malloc(sizeof(CrackBatch));
+    int* groupOf = malloc(sizeof(int) * DES_NUM_SALTS);
+    int numTargets = 0;
+
+    while (cipherTexts[numTargets]) {
+        numTargets++;
+    }
+    batch->targets = calloc(numTargets, sizeof(BatchTarget));
+    batch->groups = calloc(numTargets, sizeof(BatchGroup));
+    batch->numTargets = numTargets;
+    batch->numGroups = 0;
+    memset(groupOf, -1, sizeof(int) * DES_NUM_SALTS);
+
+    // First count the targets in each group
+    for (int i = 0; i < numTargets; i++) {
+        BatchTarget* target = &batch->targets[i];
+        target->valid = valid_cipher_text(cipherTexts[i]);
+        if (!target->valid) {
+            continue;
+        }
+        DesTarget decoded;
+        des_target_init(&decoded, cipherTexts[i]);
+        strcpy(target->cipherText, cipherTexts[i]);
+        target->block = decoded.block;
+        target->impossible = decoded.impossible;
+        target->nextSame = -1;
+        if (potfile) {
+            target->word = potfile_lookup(potfile, cipherTexts[i]);
+        }
+        if (target->impossible || target->word) {
+            continue;
+        }
+        int salt = des_salt_value(cipherTexts[i]);
+        if (groupOf[salt] < 0) {
+            groupOf[salt] = batch->numGroups++;
+            batch->groups[groupOf[salt]].salt = decoded.salt;
+        }
+        batch->groups[groupOf[salt]].numTargets++;
+    }
+
+    // Then size each hash set and add the targets to it
+    for (int g = 0; g < batch->numGroups; g++) {
+        BatchGroup* group = &batch->groups[g];
+        int numSlots = 1;
+        while (numSlots < group->numTargets * 2) {
+            numSlots *= 2;
+        }
+        group->numSlots = numSlots;
+        group->slots = malloc(sizeof(int) * numSlots);
+        memset(group->slots, -1, sizeof(int) * numSlots);
+    }
+    for (int i = 0; i < numTargets; i++) {
+        BatchTarget* target = &batch->targets[i];
+        if (target->valid && !target->impossible && !target->word) {
+            BatchGroup* group = &batch->groups[groupOf[des_salt_value(
+                    target->cipherText)]];
+            crack_batch_add(batch, group, i);
+        }
+    }
+    free(groupOf);
+    return batch;
+}
+
+/* crack_batch_add()
+ * -----------------
+ * Adds a target to its group's hash set, using linear probing. If a target
+ * with the same hash is already in the set, the new target is linked to it
+ * instead.
+ *
+ * batch: batch that the target is in
+ * group: group for the target's salt
+ * index: index of the target in the batch
+ */
+void crack_batch_add(CrackBatch* batch, BatchGroup* group, int index) {
+    uint64_t block = batch->targets[index].block;
+    int mask = group->numSlots - 1;
+
+    for (int slot = batch_slot(block, mask); 1; slot = (slot + 1) & mask) {
+        int other = group->slots[slot];
+        if (other < 0) {
+            group->slots[slot] = index;
+            group->remaining++;
+            return;
+        }
+        if (batch->targets[other].block == block) {
+            batch->targets[index].nextSame = batch->targets[other].nextSame;
+            batch->targets[other].nextSame = index;
+            return;
+        }
+    }
+}
+
+/* crack_batch_find()
+ * ------------------
+ * Looks a hash up in a group's hash set.
+ *
+ * batch: batch that the group is in
+ * group: group to look in
+ * block: the hash to look up
+ *
+ * Returns: index of the first target with the hash, or -1 if none has it
+ */
+int crack_batch_find(CrackBatch* batch, BatchGroup* group, uint64_t block) {
+    int mask = group->numSlots - 1;
+
+    for (int slot = batch_slot(block, mask); 1; slot = (slot + 1) & mask) {
+        int index = group->slots[slot];
+        if (index < 0 || batch->targets[index].block == block) {
+            return index;
+        }
+    }
+}
+
+/* batch_slot()
+ * ------------
+ * Works out the first slot to try for a hash in a hash set. DES output is
+ * already well mixed, so the low bits are used as they are.
+ *
+ * block: the hash
+ * mask: number of slots in the set minus 1
+ *
+ * Returns: slot number
+ */
+int batch_slot(uint64_t block, int mask) {
+    return (int)(block ^ (block >> 32)) & mask;
+}
+
+/* free_crack_batch()
+ * ------------------
+ * Frees a batch and its groups.
+ *
+ * batch: batch to free
+ */
+void free_crack_batch(CrackBatch* batch) {
+    for (int g = 0; g < batch->numGroups; g++) {
+        free(batch->groups[g].slots);
+    }
+    free(batch->groups);
+    free(batch->targets);
+    free(batch);
+}
+
+/* claim_chunk()
+ * -------------
+ * Claims the next unclaimed chunk of the dictionary for a job. The job's
+ * cursor is advanced atomically, so workers never wait on each other to get
+ * work and a slow worker only holds up the chunk it is on.
+ *
+ * job: CrackJob struct to claim a chunk of
+ * endPos: set to the position after the last word in the chunk
+ *
+ * Returns: the position of the first word in the chunk, or -1 if every chunk
+ * has been claimed
+ */
+int claim_chunk(CrackJob* job, int* endPos) {
+    int startPos = __atomic_fetch_add(&job->cursor, job->chunkSize,
+            __ATOMIC_RELAXED);
+    if (startPos >= job->numWords) {
+        return -1;
+    }
+    *endPos = job->numWords - startPos < job->chunkSize ? job->numWords
+            : startPos + job->chunkSize;
+    return startPos;
+}
+
+/* crack_chunk()
+ * -------------
+ * Function that tries to brute-force crack some ciphertext. This function
+ * claims the next chunk of the dictionary for the task's job and hashes it in
+ * batches with the bitsliced DES engine. If it has found a match, it stores
+ * this word in the task and notifies all of the other workers to stop
+ * cracking.
+ *
+ * task: CrackTask struct whose job contains the decoded cipher text, words,
+ * cursor and the flag to tell other workers to stop
+ * numCalls: set to the number of words that were hashed
+ *
+ * Returns: whether the task should be run again for the job's next chunk
+ */
+bool crack_chunk(CrackTask* task, int* numCalls) {
+    CrackJob* job = task->job;
+    int batchSize = des_batch_size();
+    int startPos, endPos;
+
+    // Stop if another worker found the result or every chunk is claimed
+    if (job->found || (startPos = claim_chunk(job, &endPos)) < 0) {
+        return false;
+    }
+    // Go through each batch of words in the chunk and brute-force
+    for (int i = startPos; i < endPos && job->found == 0; i += batchSize) {
+        int numWords = endPos - i < batchSize ? endPos - i : batchSize;
+        int match = des_crack_batch(&job->target, job->words + i, numWords);
+        *numCalls += numWords; // Every word in the batch was hashed
+        // If its a match, tell other workers to stop
+        if (match >= 0) {
+            job->found = 1;
+            task->word = job->words[i + match];
+            return false;
+        }
+    }
+    return job->found == 0;
+}
+
+/* index_chunk()
+ * -------------
+ * Function that claims the next chunk of the dictionary for the task's job,
+ * hashing every word in it with the job's salt and storing them as salt index
+ * entries. Unlike crack_chunk() it does not stop once a match is found, as
+ * the index needs every word. A matching word is still stored in the task so
+ * the crack can be answered. Entries hold the word's position in the order
+ * the words were read, so that a re-sort doesn't change what they point at.
+ *
+ * task: CrackTask struct whose job contains the decoded cipher text, words,
+ * cursor and the entries to fill in
+ * numCalls: set to the number of words that were hashed
+ *
+ * Returns: whether the task should be run again for the job's next chunk
+ */
+bool index_chunk(CrackTask* task, int* numCalls) {
+    CrackJob* job = task->job;
+    Dictionary* source = &job->version->source->dict;
+    bool sorted = job->words != source->words;
+    int batchSize = des_batch_size();
+    uint64_t blocks[DES_MAX_BATCH];
+    int startPos, endPos;
+
+    if ((startPos = claim_chunk(job, &endPos)) < 0) {
+        return false;
+    }
+    for (int i = startPos; i < endPos; i += batchSize) {
+        int numWords = endPos - i < batchSize ? endPos - i : batchSize;
+        des_hash_batch(&job->target.salt, job->words + i, numWords, blocks);
+        *numCalls += numWords;
+        for (int j = 0; j < numWords; j++) {
+            job->entries[i + j].tag = blocks[j] >> 32;
+            job->entries[i + j].word = sorted
+                    ? word_position(source, job->words[i + j]) : i + j;
+            if (!task->word && blocks[j] == job->target.block) {
+                task->word = job->words[i + j];
+            }
+        }
+    }
+    return true;
+}
+
+/* batch_chunk()
+ * -------------
+ * Function that claims the next chunk of a batch crack, which is a chunk of
+ * the dictionary for one of the batch's salts. Chunks of a group whose
+ * cipher texts have all been found are skipped. Every word in the chunk is
+ * hashed with the group's salt, and each hash is looked up in the group's
+ * hash set. The first word found for a hash answers every cipher text with
+ * that hash.
+ *
+ * task: CrackTask struct whose job contains the batch and the words
+ * numCalls: set to the number of words that were hashed
+ *
+ * Returns: whether the task should be run again for the job's next chunk
+ */
+bool batch_chunk(CrackTask* task, int* numCalls) {
+    CrackJob* job = task->job;
+    CrackBatch* batch = job->batch;
+    int chunksPerGroup = (job->numWords + job->chunkSize - 1) / job->chunkSize;
+    int batchSize = des_batch_size();
+    uint64_t blocks[DES_MAX_BATCH];
+    BatchGroup* group;
+    int chunk;
+
+    // The cursor counts chunks, in order of group
+    do {
+        chunk = __atomic_fetch_add(&job->cursor, 1, __ATOMIC_RELAXED);
+        if (chunk >= batch->numGroups * chunksPerGroup) {
+            return false;
+        }
+        group = &batch->groups[chunk / chunksPerGroup];
+    } while (__atomic_load_n(&group->remaining, __ATOMIC_RELAXED) == 0);
+
+    int startPos = (chunk % chunksPerGroup) * job->chunkSize;
+    int endPos = job->numWords - startPos < job->chunkSize ? job->numWords
+            : startPos + job->chunkSize;
+    for (int i = startPos; i < endPos; i += batchSize) {
+        int numWords = endPos - i < batchSize ? endPos - i : batchSize;
+        des_hash_batch(&group->salt, job->words + i, numWords, blocks);
+        *numCalls += numWords;
+        for (int j = 0; j < numWords; j++) {
+            int index = crack_batch_find(batch, group, blocks[j]);
+            char* none = NULL;
+            // Only the first word found for a hash is kept
+            if (index >= 0 && __atomic_compare_exchange_n(
+                    &batch->targets[index].word, &none, job->words[i + j],
+                    false, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                for (int same = batch->targets[index].nextSame; same >= 0;
+                        same = batch->targets[same].nextSame) {
+                    batch->targets[same].word = job->words[i + j];
+                }
+                __atomic_sub_fetch(&group->remaining, 1, __ATOMIC_RELAXED);
+            }
+        }
+        if (__atomic_load_n(&group->remaining, __ATOMIC_RELAXED) == 0) {
+            break;
+        }
+    }
+    return true;
+}
+
+/* rules_chunk()
+ * -------------
+ * Function that claims the next chunk of a crack with rules, which is a chunk
+ * of the dictionary for one of the rules. Every rule goes through the whole
+ * dictionary before the next one starts, so the words as they are (the first
+ * rule) are tried first. Each word in the chunk is mangled by the rule into a
+ * small buffer on the worker's stack, and the buffer is hashed whenever it is
+ * full - the mangled words are never kept anywhere else. Words that the rule
+ * rejects aren't hashed. A matching word is copied into the task.
+ *
+ * task: CrackTask struct whose job contains the decoded cipher text, words,
+ * rules and cursor
+ * numCalls: set to the number of words that were hashed
+ *
+ * Returns: whether the task should be run again for the job's next chunk
+ */
+bool rules_chunk(CrackTask* task, int* numCalls) {
+    CrackJob* job = task->job;
+    int chunksPerRule = (job->numWords + job->chunkSize - 1) / job->chunkSize;
+    int batchSize = des_batch_size();
+    char candidates[DES_MAX_BATCH][MAX_WORD_LENGTH + 1];
+    char* batch[DES_MAX_BATCH];
+    int chunk;
+
+    if (job->found || (chunk = __atomic_fetch_add(&job->cursor, 1,
+            __ATOMIC_RELAXED)) >= chunksPerRule * job->rules->numRules) {
+        return false;
+    }
+    int rule = chunk / chunksPerRule;
+    int startPos = (chunk % chunksPerRule) * job->chunkSize;
+    int endPos = job->numWords - startPos < job->chunkSize ? job->numWords
+            : startPos + job->chunkSize;
+    for (int i = 0; i < batchSize; i++) {
+        batch[i] = candidates[i];
+    }
+
+    for (int i = startPos; i < endPos && job->found == 0;) {
+        int numCandidates = 0;
+        for (; i < endPos && numCandidates < batchSize; i++) {
+            numCandidates += rule_set_apply(job->rules, rule, job->words[i],
+                    candidates[numCandidates]);
+        }
+        if (!numCandidates) {
+            break;
+        }
+        int match = des_crack_batch(&job->target, batch, numCandidates);
+        *numCalls += numCandidates;
+        if (match >= 0) {
+            job->found = 1;
+            strcpy(task->candidate, candidates[match]);
+            task->word = task->candidate;
+            return false;
+        }
+    }
+    return job->found == 0;
+}
+
+/* mask_chunk()
+ * ------------
+ * Function that claims the next chunk of a crackmask job's keyspace, and
+ * hashes every candidate in it. Candidates are worked out from their number
+ * (only the first of the chunk needs any division) into a small buffer on
+ * the worker's stack, which is hashed whenever it is full. Like
+ * crack_chunk(), it stops as soon as any worker has found the word.
+ *
+ * task: CrackTask struct whose job contains the decoded cipher text, mask and
+ * the flag to tell other workers to stop
+ * numCalls: set to the number of candidates that were hashed
+ *
+ * Returns: whether the task should be run again for the job's next chunk
+ */
+bool mask_chunk(CrackTask* task, int* numCalls) {
+    CrackJob* job = task->job;
+    Mask* mask = &job->mask->mask;
+    int batchSize = des_batch_size();
+    char candidates[DES_MAX_BATCH][MAX_WORD_LENGTH + 1];
+    char* batch[DES_MAX_BATCH];
+    int digits[MAX_WORD_LENGTH];
+    uint64_t chunk;
+
+    if (job->found || (chunk = __atomic_fetch_add(&job->mask->cursor, 1,
+            __ATOMIC_RELAXED)) >= job_num_chunks(job)) {
+        return false;
+    }
+    uint64_t startPos = chunk * job->chunkSize;
+    uint64_t endPos = mask->keyspace - startPos < (uint64_t)job->chunkSize
+            ? mask->keyspace : startPos + job->chunkSize;
+    mask_digits(mask, startPos, digits);
+
+    for (uint64_t i = startPos; i < endPos && job->found == 0;) {
+        int numCandidates = endPos - i < (uint64_t)batchSize ? endPos - i
+                : (uint64_t)batchSize;
+        for (int j = 0; j < numCandidates; j++) {
+            mask_candidate(mask, digits, candidates[j]);
+            mask_increment(mask, digits);
+            batch[j] = candidates[j];
+        }
+        int match = des_crack_batch(&job->target, batch, numCandidates);
+        *numCalls += numCandidates;
+        i += numCandidates;
+        if (match >= 0) {
+            job->found = 1;
+            strcpy(task->candidate, candidates[match]);
+            task->word = task->candidate;
+            return false;
+        }
+    }
+    return job->found == 0;
+}
+
+/* job_num_chunks()
+ * ----------------
+ * Works out how many chunks a single crack job is split into - one for each
+ * chunkSize candidates it hashes.
+ *
+ * job: the crack job
+ *
+ * Returns: the number of chunks
+ */
+uint64_t job_num_chunks(CrackJob* job) {
+    uint64_t numWords = job->mask ? job->mask->mask.keyspace
+            : (uint64_t)job->numWords;
+    uint64_t numChunks = (numWords + job->chunkSize - 1) / job->chunkSize;
+
+    return job->rules ? numChunks * job->rules->numRules : numChunks;
+}
+
+/* job_num_candidates()
+ * --------------------
+ * Works out how many candidates a single crack job hashes if nothing
+ * matches - every word (once for each rule, if it has any), or every
+ * candidate of its mask.
+ *
+ * job: the crack job
+ *
+ * Returns: the number of candidates
+ */
+uint64_t job_num_candidates(CrackJob* job) {
+    if (job->mask) {
+        return job->mask->mask.keyspace;
+    }
+    return (uint64_t)job->numWords * (job->rules ? job->rules->numRules : 1);
+}
+
+/* create_salt_index_cache()
+ * -------------------------
+ * Creates an empty salt index cache.
+ *
+ * memoryLimit: the most bytes that the cached indexes can use
+ *
+ * Returns: the salt index cache
+ */
+SaltIndexCache* create_salt_index_cache(size_t memoryLimit) {
+    SaltIndexCache* cache = calloc(1, sizeof(SaltIndexCache));
+    cache->memoryLimit = memoryLimit;
+    pthread_mutex_init(&cache->lock, NULL);
+    return cache;
+}
+
+/* salt_index_lookup()
+ * -------------------
+ * Looks a cipher text up in the salt index cache. If its salt is indexed, the
+ * words whose hash has the same top 32 bits are found with a binary search
+ * and then checked with crypt_r(), so the crack takes a single lookup. If the
+ * salt isn't indexed, and no other crack is indexing it, the salt is marked as
+ * being built and the caller must add its index with salt_index_insert().
+ * An index that could never fit in the cache isn't built, since building one
+ * means hashing every word without stopping at a match. Jobs cracking with
+ * words from a different generation to the cache's always miss. The crypt_r()
+ * calls use a buffer kept for each thread.
+ *
+ * cache: salt index cache
+ * job: crack job for the cipher text. On an INDEX_HIT its word is set to the
+ * matching word (or null), and its numCalls is increased by the number of
+ * crypt_r() calls made.
+ * dict: the job's dictionary words in the order they were read, which the
+ * indexes hold positions in
+ *
+ * Returns: whether the lookup was a hit, a miss or the caller should build
+ * the index for this salt
+ */
+IndexLookup salt_index_lookup(SaltIndexCache* cache, CrackJob* job,
+        Dictionary* dict) {
+    char* cipherText = job->cipherText;
+    int salt = des_salt_value(cipherText);
+    uint32_t tag = job->target.block >> 32;
+
+    pthread_mutex_lock(&cache->lock);
+    if (job->version->source->generation != cache->generation) {
+        // The indexes are from other words, so positions won't match
+        pthread_mutex_unlock(&cache->lock);
+        return INDEX_MISS;
+    }
+    SaltIndex* index = cache->salts[salt];
+    if (!index) {
+        size_t size = sizeof(SaltIndex) + sizeof(SaltIndexEntry)
+                * dict->numWords;
+        IndexLookup result = cache->building[salt]
+                || size > cache->memoryLimit ? INDEX_MISS : INDEX_BUILD;
+        cache->building[salt] |= result == INDEX_BUILD;
+        pthread_mutex_unlock(&cache->lock);
+        return result;
+    }
+
+    // Move the index to the front of the recently used list
+    salt_index_unlink(cache, index);
+    index->older = cache->newest;
+    if (cache->newest) {
+        cache->newest->newer = index;
+    }
+    cache->newest = index;
+    if (!cache->oldest) {
+        cache->oldest = index;
+    }
+
+    // Find the first entry with the tag
+    int low = 0;
+    int high = index->numEntries;
+    while (low < high) {
+        int mid = low + (high - low) / 2;
+        if (index->entries[mid].tag < tag) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    // Copy out the candidates so they can be checked without the lock
+    int numCandidates = 0;
+    while (low + numCandidates < index->numEntries
+            && index->entries[low + numCandidates].tag == tag) {
+        numCandidates++;
+    }
+    uint32_t* candidates = malloc(sizeof(uint32_t) * (numCandidates + 1));
+    for (int i = 0; i < numCandidates; i++) {
+        candidates[i] = index->entries[low + i].word;
+    }
+    pthread_mutex_unlock(&cache->lock);
+
+    job->word = NULL;
+    if (numCandidates) {
+        static __thread struct crypt_data* data = NULL;
+        if (!data) {
+            data = calloc(1, sizeof(struct crypt_data));
+        }
+        char saltText[SALT_LENGTH + 1] = {cipherText[0], cipherText[1], '\0'};
+        for (int i = 0; i < numCandidates && !job->word; i++) {
+            char* candidate = dict->words[candidates[i]];
+            job->numCalls++;
+            if (!strcmp(crypt_r(candidate, saltText, data), cipherText)) {
+                job->word = candidate;
+            }
+        }
+    }
+    free(candidates);
+    return INDEX_HIT;
+}
+
+/* salt_index_insert()
+ * -------------------
+ * Sorts the entries built for a salt and adds them to the cache as that
+ * salt's index. The least recently used indexes are evicted until the new
+ * index fits within the memory limit. If it can never fit, or it was built
+ * from a dictionary that has since been replaced, it is discarded.
+ *
+ * cache: salt index cache
+ * salt: number of the salt that was indexed
+ * entries: one entry for every word in the dictionary (ownership is taken)
+ * numEntries: number of entries
+ * generation: generation of the dictionary words the index was built from
+ */
+void salt_index_insert(SaltIndexCache* cache, int salt,
+        SaltIndexEntry* entries, int numEntries, unsigned int generation) {
+    size_t size = sizeof(SaltIndex) + sizeof(SaltIndexEntry) * numEntries;
+
+    qsort(entries, numEntries, sizeof(SaltIndexEntry), compare_index_entries);
+
+    pthread_mutex_lock(&cache->lock);
+    if (generation != cache->generation) {
+        pthread_mutex_unlock(&cache->lock);
+        free(entries);
+        return;
+    }
+    cache->building[salt] = false;
+    if (size > cache->memoryLimit) {
+        pthread_mutex_unlock(&cache->lock);
+        free(entries);
+        return;
+    }
+    while (cache->memoryUsed + size > cache->memoryLimit) {
+        SaltIndex* oldest = cache->oldest;
+        salt_index_unlink(cache, oldest);
+        cache->salts[oldest->salt] = NULL;
+        cache->memoryUsed -= sizeof(SaltIndex)
+                + sizeof(SaltIndexEntry) * oldest->numEntries;
+        free(oldest->entries);
+        free(oldest);
+    }
+
+    SaltIndex* index = malloc(sizeof(SaltIndex));
+    index->salt = salt;
+    index->entries = entries;
+    index->numEntries = numEntries;
+    index->newer = NULL;
+    index->older = cache->newest;
+    if (cache->newest) {
+        cache->newest->newer = index;
+    }
+    cache->newest = index;
+    if (!cache->oldest) {
+        cache->oldest = index;
+    }
+    cache->salts[salt] = index;
+    cache->memoryUsed += size;
+    pthread_mutex_unlock(&cache->lock);
+}
+
+/* salt_index_clear()
+ * ------------------
+ * Empties the salt index cache when the dictionary is replaced, since the
+ * indexes hold positions in the old dictionary. Indexes that are still being
+ * built from the old dictionary are discarded when they are inserted.
+ *
+ * cache: salt index cache
+ * generation: generation of the new dictionary
+ */
+void salt_index_clear(SaltIndexCache* cache, unsigned int generation) {
+    pthread_mutex_lock(&cache->lock);
+    while (cache->oldest) {
+        SaltIndex* oldest = cache->oldest;
+        salt_index_unlink(cache, oldest);
+        free(oldest->entries);
+        free(oldest);
+    }
+    memset(cache->salts, 0, sizeof(cache->salts));
+    memset(cache->building, 0, sizeof(cache->building));
+    cache->memoryUsed = 0;
+    cache->generation = generation;
+    pthread_mutex_unlock(&cache->lock);
+}
+
+/* salt_index_unlink()
+ * -------------------
+ * Removes an index from the cache's recently used list. The cache must be
+ * locked.
+ *
+ * cache: salt index cache
+ * index: index to remove from the list
+ */
+void salt_index_unlink(SaltIndexCache* cache, SaltIndex* index) {
+    if (index->newer) {
+        index->newer->older = index->older;
+    } else {
+        cache->newest = index->older;
+    }
+    if (index->older) {
+        index->older->newer = index->newer;
+    } else {
+        cache->oldest = index->newer;
+    }
+    index->newer = NULL;
+    index->older = NULL;
+}
+
+/* compare_index_entries()
+ * -----------------------
+ * Comparison function for qsort() that orders salt index entries by tag.
+ *
+ * a: pointer to the first SaltIndexEntry
+ * b: pointer to the second SaltIndexEntry
+ *
+ * Returns: negative, zero or positive if a's tag is less than, equal to or
+ * greater than b's tag
+ */
+int compare_index_entries(const void* a, const void* b) {
+    uint32_t tagA = ((const SaltIndexEntry*)a)->tag;
+    uint32_t tagB = ((const SaltIndexEntry*)b)->tag;
+    return (tagA > tagB) - (tagA < tagB);
+}
+
+/* create_dictionary_version()
+ * ---------------------------
+ * Allocates a version of the dictionary that no one is using yet, with the
+ * words in the order they were read.
+ *
+ * dict: the dictionary (ownership is taken)
+ * indexFile: index file built from the dictionary, or null if none
+ * generation: number of times the dictionary has been reloaded or re-sorted
+ *
+ * Returns: the dictionary version
+ */
+DictionaryVersion* create_dictionary_version(Dictionary dict,
+        IndexFile* indexFile, unsigned int generation) {
+    DictionaryVersion* version = malloc(sizeof(DictionaryVersion));
+    version->source = malloc(sizeof(DictionaryWords));
+    version->source->dict = dict;
+    version->source->weights = NULL;
+    version->source->changed = false;
+    version->source->refs = 1;
+    version->source->generation = generation;
+    version->dict = dict;
+    version->indexFile = indexFile;
+    version->generation = generation;
+    version->refs = 0;
+    version->nextRetired = NULL;
+    return version;
+}
+
+/* sort_dictionary_version()
+ * -------------------------
+ * Replaces a new dictionary version (in the order its words were read) with
+ * one in frequency order. The version given must not have been published.
+ *
+ * version: the dictionary version
+ * weights: weights of its words (ownership is taken)
+ *
+ * Returns: the dictionary version in frequency order
+ */
+DictionaryVersion* sort_dictionary_version(DictionaryVersion* version,
+        uint32_t* weights) {
+    version->source->weights = weights;
+    DictionaryVersion* sorted = create_sorted_version(version->source,
+            version->generation);
+    free_dictionary_version(version);
+    return sorted;
+}
+
+/* create_sorted_version()
+ * -----------------------
+ * Allocates a version of the dictionary with its words ordered by their
+ * current weights, sharing the words themselves with the versions before it.
+ * No index file is used, since the words aren't in the order it was built
+ * from.
+ *
+ * source: the words, which must have weights
+ * generation: number of times the dictionary has been reloaded or re-sorted
+ *
+ * Returns: the dictionary version
+ */
+DictionaryVersion* create_sorted_version(DictionaryWords* source,
+        unsigned int generation) {
+    return create_ordered_version(source,
+            order_by_weight(&source->dict, source->weights), generation);
+}
+
+/* create_ordered_version()
+ * ------------------------
+ * Allocates a version of the dictionary with its words in the given order,
+ * sharing the words themselves with the versions before it. No index file is
+ * used.
+ *
+ * source: the words
+ * words: words array of source's words in the order to crack them in
+ * (ownership is taken)
+ * generation: number of times the dictionary has been reloaded or re-sorted
+ *
+ * Returns: the dictionary version
+ */
+DictionaryVersion* create_ordered_version(DictionaryWords* source,
+        char** words, unsigned int generation) {
+    DictionaryVersion* version = malloc(sizeof(DictionaryVersion));
+    version->dict = source->dict;
+    version->dict.words = words;
+    version->source = source;
+    __atomic_add_fetch(&source->refs, 1, __ATOMIC_SEQ_CST);
+    version->indexFile = NULL;
+    version->generation = generation;
+    version->refs = 0;
+    version->nextRetired = NULL;
+    return version;
+}
+
+/* dictionary_acquire()
+ * --------------------
+ * Gets a reference to the dictionary in use, without taking a lock. The
+ * reference is counted first, then the version is checked to still be in
+ * use. A version is only retired once it has been replaced, so either the
+ * reference is counted before the retired version's count is checked (and it
+ * isn't freed), or this sees the new version and tries again.
+ *
+ * server: ServerContext struct that holds the dictionary in use
+ *
+ * Returns: the dictionary version, which must be given back with
+ * dictionary_release()
+ */
+DictionaryVersion* dictionary_acquire(ServerContext* server) {
+    while (1) {
+        DictionaryVersion* version = __atomic_load_n(&server->version,
+                __ATOMIC_SEQ_CST);
+        __atomic_add_fetch(&version->refs, 1, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&server->version, __ATOMIC_SEQ_CST) == version) {
+            return version;
+        }
+        __atomic_sub_fetch(&version->refs, 1, __ATOMIC_SEQ_CST);
+    }
+}
+
+/* dictionary_release()
+ * --------------------
+ * Gives back a reference to a dictionary version from dictionary_acquire().
+ *
+ * version: the dictionary version, or null (for a job searching a mask)
+ */
+void dictionary_release(DictionaryVersion* version) {
+    if (version) {
+        __atomic_sub_fetch(&version->refs, 1, __ATOMIC_SEQ_CST);
+    }
+}
+
+/* dictionary_publish()
+ * --------------------
+ * Makes a new dictionary version the one that new crack requests use. If it
+ * has different words (rather than just a new order), salt indexes built from
+ * the old version's words no longer count.
+ *
+ * server: ServerContext struct that holds the dictionary in use, whose
+ * publishLock must be held
+ * version: the new dictionary version
+ */
+void dictionary_publish(ServerContext* server, DictionaryVersion* version) {
+    if (server->index && version->source != server->version->source) {
+        salt_index_clear(server->index, version->source->generation);
+    }
+    __atomic_store_n(&server->version, version, __ATOMIC_SEQ_CST);
+}
+
+/* dictionary_retire()
+ * -------------------
+ * Adds a dictionary version that has been replaced to the server's retired
+ * versions, without waiting for the requests still using it (which may run
+ * for hours) to finish. dictionary_free_retired() frees it once they have.
+ *
+ * server: ServerContext struct that holds the dictionary in use, whose
+ * publishLock must be held
+ * old: the dictionary version that has been replaced
+ */
+void dictionary_retire(ServerContext* server, DictionaryVersion* old) {
+    old->nextRetired = server->retired;
+    server->retired = old;
+}
+
+/* dictionary_free_retired()
+ * -------------------------
+ * Frees the words of each retired dictionary version that nothing is using
+ * any more, and takes it off the retired list.
+ *
+ * server: ServerContext struct that holds the retired versions
+ */
+void dictionary_free_retired(ServerContext* server) {
+    pthread_mutex_lock(&server->publishLock);
+    DictionaryVersion** link = &server->retired;
+    while (*link) {
+        DictionaryVersion* old = *link;
+        if (__atomic_load_n(&old->refs, __ATOMIC_SEQ_CST)) {
+            link = &old->nextRetired;
+        } else {
+            *link = old->nextRetired;
+            free_dictionary_version(old);
+        }
+    }
+    pthread_mutex_unlock(&server->publishLock);
+}
+
+/* free_dictionary_version()
+ * -------------------------
+ * Frees a dictionary version's words array (if it has its own) and gives back
+ * its reference to the words, freeing them if it was the last. Nothing may be
+ * using the version.
+ *
+ * version: the dictionary version
+ */
+void free_dictionary_version(DictionaryVersion* version) {
+    DictionaryWords* source = version->source;
+
+    if (version->dict.words != source->dict.words) {
+        free(version->dict.words);
+    }
+    if (!__atomic_sub_fetch(&source->refs, 1, __ATOMIC_SEQ_CST)) {
+        free_dictionary(source->dict);
+        free(source->weights);
+        free(source);
+    }
+}
+
+/* dictionary_count_word()
+ * -----------------------
+ * Adds one to the weight of a word that a crack found, if the words are
+ * cracked in frequency order and it is one of the dictionary's words (rather
+ * than a word made by rules or a mask). The next re-sort moves it earlier.
+ *
+ * version: dictionary version that the crack used (null for a mask)
+ * word: the word that was found
+ */
+void dictionary_count_word(DictionaryVersion* version, const char* word) {
+    if (!version || !version->source->weights) {
+        return;
+    }
+    DictionaryWords* source = version->source;
+    int position = word_position(&source->dict, word);
+    if (position >= 0) {
+        __atomic_add_fetch(&source->weights[position], 1, __ATOMIC_RELAXED);
+        __atomic_store_n(&source->changed, true, __ATOMIC_RELEASE);
+    }
+}
+
+/* dictionary_reload()
+ * -------------------
+ * Starts reloading the dictionary in the background, unless a reload is
+ * already running.
+ *
+ * server: ServerContext struct that holds the dictionary in use
+ *
+ * Returns: whether a reload was started
+ */
+bool dictionary_reload(ServerContext* server) {
+    pthread_t threadID;
+
+    if (__atomic_exchange_n(&server->reloading, true, __ATOMIC_ACQ_REL)) {
+        return false;
+    }
+    pthread_create(&threadID, 0, reload_thread, server);
+    pthread_detach(threadID);
+    return true;
+}
+
+/* reload_thread()
+ * ---------------
+ * Function that is run by the thread that reloads the dictionary. The file is
+ * read again (as it was at startup) and the new dictionary is published for
+ * new crack requests, while requests in progress finish with the old one. The
+ * index file is only used with the new dictionary if it was built from it,
+ * and salt indexes and cached failures from the old dictionary no longer
+ * count. If the words are in frequency order, the weights of the words that
+ * are still in the dictionary are kept. The old dictionary is retired, to be
+ * freed once nothing is using it, so another reload can start straight away.
+ * If the file can't be read, the old dictionary stays in use.
+ *
+ * v: void pointer to the ServerContext struct
+ */
+void* reload_thread(void* v) {
+    ServerContext* server = (ServerContext*)v;
+    Dictionary dict;
+    uint64_t start = now_micros();
+
+    if (read_dictionary(server->dictFileName, DICTIONARY_DEDUP
+            | (server->truncate ? DICTIONARY_TRUNCATE : 0), &dict)
+            != DICTIONARY_OK) {
+        fprintf(stderr, RELOAD_FAILED_MESSAGE, server->dictFileName);
+        __atomic_store_n(&server->reloading, false, __ATOMIC_RELEASE);
+        return NULL;
+    }
+    IndexFile* indexFile = NULL;
+    if (server->indexFile && index_file_matches(server->indexFile, &dict)) {
+        indexFile = server->indexFile;
+    } else if (server->indexFile) {
+        fprintf(stderr, INDEX_UNUSED_MESSAGE);
+    }
+
+    pthread_mutex_lock(&server->publishLock);
+    DictionaryVersion* old = server->version;
+    DictionaryVersion* version = create_dictionary_version(dict, indexFile,
+            old->generation + 1);
+    if (old->source->weights) {
+        uint32_t* weights = calloc(dict.numWords, sizeof(uint32_t));
+        carry_word_weights(&old->source->dict, old->source->weights, &dict,
+                weights);
+        version = sort_dictionary_version(version, weights);
+    }
+    dictionary_publish(server, version);
+    dictionary_retire(server, old);
+    pthread_mutex_unlock(&server->publishLock);
+    __atomic_store_n(&server->reloading, false, __ATOMIC_RELEASE);
+    fprintf(stderr, RELOAD_MESSAGE, dict.numWords, dict.numBytes,
+            (double)(now_micros() - start) / MICROS_PER_SECOND);
+    return NULL;
+}
+
+/* resort_thread()
+ * ---------------
+ * Function that is run by the thread that keeps a dictionary in frequency
+ * order. Every RESORT_SECONDS, if successful cracks have changed the weights,
+ * the words are sorted again and the new order is published as a new
+ * dictionary generation. Requests in progress finish with the old order.
+ * Since the words themselves are the same, salt indexes and cached failures
+ * still hold.
+ *
+ * v: void pointer to the ServerContext struct
+ */
+void* resort_thread(void* v) {
+    ServerContext* server = (ServerContext*)v;
+
+    while (1) {
+        sleep(RESORT_SECONDS);
+        pthread_mutex_lock(&server->publishLock);
+        DictionaryVersion* old = server->version;
+        if (!old->source->weights || !__atomic_exchange_n(
+                &old->source->changed, false, __ATOMIC_ACQ_REL)) {
+            pthread_mutex_unlock(&server->publishLock);
+            continue;
+        }
+        DictionaryVersion* version = create_sorted_version(old->source,
+                old->generation + 1);
+        dictionary_publish(server, version);
+        dictionary_retire(server, old);
+        pthread_mutex_unlock(&server->publishLock);
+    }
+    return NULL;
+}
+
+/* create_job_statuses()
+ * ---------------------
+ * Creates the statuses of submitted jobs, with no jobs in them. If there are
+ * prefork worker processes they are put in a shared mapping (before the
+ * workers are forked), so that every worker sees the others' jobs. The lock
+ * is robust, so a worker that exits while holding it doesn't stop the rest.
+ *
+ * size: the most jobs that each worker keeps
+ * numWorkers: number of prefork worker processes (0 if there are none)
+ *
+ * Returns: the job statuses, or null if they couldn't be made
+ */
+JobStatuses* create_job_statuses(int size, int numWorkers) {
+    size_t bytes = sizeof(JobStatuses)
+            + sizeof(JobStatus) * size * (numWorkers ? numWorkers : 1);
+    JobStatuses* statuses;
+    pthread_mutexattr_t attr;
+
+    if (numWorkers) {
+        statuses = mmap(NULL, bytes, PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        if (statuses == MAP_FAILED) {
+            return NULL;
+        }
+    } else if (!(statuses = malloc(bytes))) {
+        return NULL;
+    }
+    memset(statuses, 0, bytes);
+    statuses->size = size;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, numWorkers ? PTHREAD_PROCESS_SHARED
+            : PTHREAD_PROCESS_PRIVATE);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    pthread_mutex_init(&statuses->lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+    return statuses;
+}
+
+/* job_statuses_lock()
+ * -------------------
+ * Locks the job statuses. If the prefork worker process that last held the
+ * lock exited while holding it, the lock is taken over (what it was changing
+ * is cleared when it is started again).
+ *
+ * statuses: the job statuses
+ */
+void job_statuses_lock(JobStatuses* statuses) {
+    if (pthread_mutex_lock(&statuses->lock) == EOWNERDEAD) {
+        pthread_mutex_consistent(&statuses->lock);
+    }
+}
+
+/* create_job_table()
+ * ------------------
+ * Creates an empty table of submitted jobs, and the crack scheduler client
+ * that they are all queued for. A prefork worker process that is started
+ * again keeps the results of the jobs that the one before it finished, and
+ * gives out IDs after the ones it did. The jobs it was running are forgotten
+ * (unless they are resumed from their checkpoints).
+ *
+ * pool: crack worker pool that the jobs are run on
+ * statuses: the job statuses of every worker, whose size is the most jobs
+ * that are kept
+ * worker: number of this prefork worker process (0 if there are none)
+ * numWorkers: number of prefork worker processes (0 if there are none)
+ *
+ * Returns: the job table
+ */
+JobTable* create_job_table(CrackPool* pool, JobStatuses* statuses,
+        int worker, int numWorkers) {
+    JobTable* table = malloc(sizeof(JobTable));
+    int size = statuses->size;
+    JobStatus* own = &statuses->slots[worker * size];
+
+    unsigned int lastID = 0;
+
+    table->slots = calloc(size, sizeof(SubmittedJob));
+    job_statuses_lock(statuses);
+    for (int i = 0; i < size; i++) {
+        table->slots[i].status = &own[i];
+        lastID = own[i].id > lastID ? own[i].id : lastID;
+        if (own[i].running) {
+            memset(&own[i], 0, sizeof(JobStatus));
+            statuses->numRunning--;
+        }
+    }
+    pthread_mutex_unlock(&statuses->lock);
+    table->size = size;
+    table->statuses = statuses;
+    table->firstID = worker;
+    table->idStep = numWorkers ? numWorkers : 1;
+    table->nextID = (lastID ? lastID : table->firstID) + table->idStep;
+    table->client = crack_pool_add_client(pool);
+    pthread_mutex_init(&table->lock, NULL);
+    pthread_mutex_init(&table->checkpointLock, NULL);
+    return table;
+}
+
+/* submit_command()
+ * ----------------
+ * Processes a submit crack or submit crackmask command, which starts a crack
+ * that no connection waits for. It is answered straight away with the job's ID,
+ * which status and result commands can then be sent with (on any connection).
+ * If the oldest job that is kept is still running, the job isn't started and
+ * the response is busy instead.
+ *
+ * kind: the command to submit (crack or crackmask)
+ * args: the arguments of that command, or null if there were none
+ * conn: connection the command was sent on
+ */
+void submit_command(char* kind, char* args, Connection* conn) {
+    char response[JOB_RESPONSE_LENGTH];
+    unsigned int id;
+    SubmitStatus status = args ? job_table_submit(conn->io->server, kind,
+            args, NULL, &id) : SUBMIT_INVALID;
+
+    if (status == SUBMIT_INVALID) {
+        connection_respond(conn, conn->tag, INVALID);
+    } else if (status == SUBMIT_BUSY) {
+        connection_respond(conn, conn->tag, BUSY);
+    } else {
+        sprintf(response, "%s %u", SUBMITTED, id);
+        connection_respond(conn, conn->tag, response);
+    }
+}
+
+/* job_table_submit()
+ * ------------------
+ * Adds a crack or crackmask job to the job table and starts it. A new job
+ * gets the next ID. A job resumed from a checkpoint keeps its ID and starts
+ * from the position it had reached, unless it cracks the dictionary and the
+ * dictionary has changed since, in which case it starts again.
+ *
+ * server: ServerContext struct that holds the job table
+ * kind: the command to submit (crack or crackmask)
+ * args: the arguments of that command (changed as they are parsed)
+ * resume: the job's checkpoint, or null for a new job. Its position is set
+ * to where the job actually starts from.
+ * id: set to the job's ID if it is started
+ *
+ * Returns: whether the job was started, was invalid, or had no free slot
+ */
+SubmitStatus job_table_submit(ServerContext* server, char* kind, char* args,
+        JobCheckpoint* resume, unsigned int* id) {
+    JobTable* table = server->jobs;
+    char* command = malloc(strlen(kind) + strlen(args) + 2);
+    sprintf(command, "%s %s", kind, args);
+    char** parts = split_by_char(args, ' ', 2);
+    int numThreads;
+    const RuleSet* rules = NULL;
+    CrackMask* mask = NULL;
+
+    if (parts[1] == NULL || !valid_cipher_text(parts[0])
+            || (strcmp(kind, "crack") == 0
+            ? !parse_crack_options(parts[1], &numThreads, &rules)
+            : !(mask = parse_mask_options(parts[1], &numThreads)))) {
+        free(command);
+        free(parts);
+        return SUBMIT_INVALID;
+    }
+    // The checksum is worked out before the table is locked
+    CrackJob* job = create_crack_job(server, NULL, mask, numThreads);
+    job->rules = rules;
+    uint64_t checksum = server->stateDir && !mask
+            ? dictionary_checksum(&job->version->dict) : 0;
+    if (resume && resume->checksum != checksum
+            && job_use_saved_order(server, job, resume->checksum)) {
+        checksum = resume->checksum;
+    }
+
+    pthread_mutex_lock(&table->lock);
+    // A checkpoint from another worker (if there were more or fewer of them)
+    // gets a new ID
+    *id = resume && resume->id % table->idStep == table->firstID
+            ? resume->id : table->nextID;
+    SubmittedJob* submitted = &table->slots[*id / table->idStep
+            % table->size];
+    if (submitted->job) {
+        pthread_mutex_unlock(&table->lock);
+        dictionary_release(job->version);
+        free(job);
+        free(mask);
+        free(command);
+        free(parts);
+        return SUBMIT_BUSY;
+    }
+    if (*id >= table->nextID) {
+        table->nextID = *id + table->idStep;
+    }
+    free(submitted->command);
+    submitted->id = *id;
+    submitted->job = job;
+    submitted->resumed = 0;
+    submitted->command = command;
+    submitted->checksum = checksum;
+    if (resume && resume->checksum != checksum) {
+        fprintf(stderr, RESUME_RESTART_MESSAGE, *id);
+        resume->position = 0;
+    } else if (resume) {
+        job_resume_at(job, resume->position);
+        submitted->resumed = job_chunk_position(job, job_claimed_chunks(job));
+        resume->position = submitted->resumed;
+    }
+    job->submitted = submitted;
+    JobStatus* status = submitted->status;
+    job_statuses_lock(table->statuses);
+    table->statuses->numRunning++;
+    status->id = *id;
+    status->running = true;
+    status->found = false;
+    status->numHashed = submitted->resumed;
+    status->numCandidates = job_num_candidates(job);
+    pthread_mutex_unlock(&table->statuses->lock);
+    pthread_mutex_unlock(&table->lock);
+
+    if (crack_job_start(job, parts[0], numThreads)) {
+        job_table_complete(job);
+    }
+    free(parts);
+    return SUBMIT_STARTED;
+}
+
+/* job_status_command()
+ * --------------------
+ * Processes a status command, which is answered with whether a submitted job
+ * is running or done, and the candidates it has hashed out of the ones it
+ * would hash if nothing matched (eg ":running 4096/30000"). Jobs that have been
+ * replaced by newer ones, or were never submitted, are unknown. Any prefork
+ * worker process can answer for a job, whichever one it was submitted to.
+ *
+ * jobID: the job ID argument
+ * conn: connection the command was sent on
+ */
+void job_status_command(char* jobID, Connection* conn) {
+    JobTable* table = conn->io->server->jobs;
+    char response[JOB_RESPONSE_LENGTH];
+    unsigned int id;
+
+    if (!parse_job_id(jobID, &id)) {
+        connection_respond(conn, conn->tag, INVALID);
+        return;
+    }
+    job_statuses_lock(table->statuses);
+    JobStatus* status = job_table_find(table, id);
+    if (!status) {
+        strcpy(response, UNKNOWN);
+    } else {
+        sprintf(response, "%s %lu/%lu", status->running ? RUNNING : DONE,
+                __atomic_load_n(&status->numHashed, __ATOMIC_RELAXED),
+                status->numCandidates);
+    }
+    pthread_mutex_unlock(&table->statuses->lock);
+    connection_respond(conn, conn->tag, response);
+}
+
+/* job_result_command()
+ * --------------------
+ * Processes a result command, which is answered like a crack command once the
+ * submitted job is done. A job that is still running is answered with
+ * running, and one that isn't kept with unknown. The result stays until the
+ * job is replaced, so it can be fetched more than once (from any prefork
+ * worker process).
+ *
+ * jobID: the job ID argument
+ * conn: connection the command was sent on
+ */
+void job_result_command(char* jobID, Connection* conn) {
+    JobTable* table = conn->io->server->jobs;
+    char response[JOB_RESPONSE_LENGTH];
+    unsigned int id;
+
+    if (!parse_job_id(jobID, &id)) {
+        connection_respond(conn, conn->tag, INVALID);
+        return;
+    }
+    // The word is copied while the job can't be replaced
+    job_statuses_lock(table->statuses);
+    JobStatus* status = job_table_find(table, id);
+    if (!status) {
+        strcpy(response, UNKNOWN);
+    } else if (status->running) {
+        strcpy(response, RUNNING);
+    } else {
+        strcpy(response, status->found ? status->word : FAILED);
+    }
+    pthread_mutex_unlock(&table->statuses->lock);
+    connection_respond(conn, conn->tag, response);
+}
+
+/* job_table_find()
+ * ----------------
+ * Finds the status of a submitted job, in the slots of the prefork worker
+ * process that gave out its ID.
+ *
+ * table: the job table, whose job statuses must be locked
+ * id: ID of the job (never 0)
+ *
+ * Returns: the job's status, or null if the job isn't kept
+ */
+JobStatus* job_table_find(JobTable* table, unsigned int id) {
+    JobStatus* status = &table->statuses->slots[id % table->idStep
+            * table->size + id / table->idStep % table->size];
+
+    return status->id == id ? status : NULL;
+}
+
+/* job_table_complete()
+ * --------------------
+ * Records the result of a submitted job that has finished in its status, in
+ * place of the connection response that other crack jobs get. The word is
+ * copied, since the dictionary it came from may be freed once the job is. The
+ * time taken to crack is recorded, and the job (and its reference to the
+ * dictionary) is then freed. The job's checkpoint file is removed once the
+ * table has been unlocked (holding checkpointLock, so that the checkpoint
+ * thread can't write it again).
+ *
+ * job: the finished crack job
+ */
+void job_table_complete(CrackJob* job) {
+    ServerContext* server = job->server;
+    JobTable* table = server->jobs;
+    SubmittedJob* submitted = job->submitted;
+
+    pthread_mutex_lock(&table->lock);
+    JobStatus* status = submitted->status;
+    job_statuses_lock(table->statuses);
+    status->running = false;
+    status->found = job->word != NULL;
+    if (job->word) {
+        // A potfile's word may be longer, but crypt() only uses this much
+        strncpy(status->word, job->word, MAX_WORD_LENGTH);
+    }
+    status->numHashed = submitted->resumed + job->numCalls;
+    table->statuses->numRunning--;
+    pthread_mutex_unlock(&table->statuses->lock);
+    submitted->job = NULL;
+    unsigned int id = submitted->id;
+    pthread_mutex_unlock(&table->lock);
+    if (server->stateDir) {
+        char* fileName = checkpoint_file_name(server->stateDir, id,
+                CHECKPOINT_SUFFIX);
+        pthread_mutex_lock(&table->checkpointLock);
+        unlink(fileName);
+        pthread_mutex_unlock(&table->checkpointLock);
+        free(fileName);
+    }
+
+    stats_record_latency(job->server->stats, LATENCY_CRACK, job->startMicros);
+    dictionary_release(job->version);
+    free(job->mask);
+    free(job);
+}
+
+/* parse_job_id()
+ * --------------
+ * Converts the job ID argument of a status or result command to a number. It
+ * must be 1 to MAX_JOB_ID_LENGTH digits and not 0.
+ *
+ * arg: the argument
+ * id: set to the job ID if it is valid
+ *
+ * Returns: whether the job ID is valid
+ */
+bool parse_job_id(char* arg, unsigned int* id) {
+    int length = strlen(arg);
+
+    if (length == 0 || length > MAX_JOB_ID_LENGTH) {
+        return false;
+    }
+    for (int i = 0; i < length; i++) {
+        if (!isdigit(arg[i])) {
+            return false;
+        }
+    }
+    unsigned long value = strtoul(arg, NULL, 10);
+    if (value == 0 || value > UINT_MAX) {
+        return false;
+    }
+    *id = value;
+    return true;
+}
+
+/* run_workers()
+ * -------------
+ * Runs the server as prefork worker processes that all accept connections on
+ * the same listening sockets. The dictionary is moved into a read-only shared
+ * mapping first, so that the workers share one copy of it, and the stats and
+ * job statuses are made in shared memory. Each worker has its own crack
+ * worker pool, caches and job table (and its own subdirectory of the state
+ * directory, if there is one), but can answer for any worker's jobs. This
+ * process then looks after the workers and never returns.
+ *
+ * serv: listening socket
+ * metricsServ: listening socket for the metrics page, or -1 if not used
+ * dict: the dictionary
+ * details: server details from the command line
+ * indexFile: precomputed index file, or null if none was given
+ * potfile: potfile of cracked cipher texts, or null if none was given
+ * weights: weights of the dictionary's words if they are cracked in frequency
+ * order, otherwise null
+ */
+void run_workers(int serv, int metricsServ, Dictionary dict,
+        ServerDetails details, IndexFile* indexFile, Potfile* potfile,
+        uint32_t* weights) {
+    WorkerProcesses* workers = malloc(sizeof(WorkerProcesses));
+    sigset_t set;
+
+    share_dictionary(&dict); // If it can't be, the pages are still shared
+    workers->serv = serv;
+    workers->metricsServ = metricsServ;
+    workers->dict = dict;
+    workers->details = details;
+    workers->indexFile = indexFile;
+    workers->potfile = potfile;
+    workers->weights = weights;
+    workers->stats = configure_stats(true);
+    workers->statuses = create_job_statuses(details.retainedJobs,
+            details.numWorkers);
+    workers->pids = calloc(details.numWorkers, sizeof(pid_t));
+    workers->started = calloc(details.numWorkers, sizeof(bool));
+    workers->stateDirs = NULL;
+    if (details.stateDirName) {
+        workers->stateDirs = malloc(sizeof(char*) * details.numWorkers);
+        for (int i = 0; i < details.numWorkers; i++) {
+            workers->stateDirs[i] = malloc(strlen(details.stateDirName)
+                    + MAX_JOB_ID_LENGTH + 2);
+            sprintf(workers->stateDirs[i], "%s/%d", details.stateDirName, i);
+            mkdir(workers->stateDirs[i], 0755); // If it doesn't exist yet
+            if (access(workers->stateDirs[i], W_OK | X_OK) != 0) {
+                state_dir_error(workers->stateDirs[i]);
+            }
+        }
+    }
+
+    // Workers inherit the mask, and only this process waits for signals
+    sigemptyset(&set);
+    sigaddset(&set, SIGHUP);
+    sigaddset(&set, SIGUSR1);
+    sigaddset(&set, SIGCHLD);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+    supervise_workers(workers, &set); // Which starts the workers
+}
+
+/* start_worker()
+ * --------------
+ * Forks a prefork worker process. The worker exits if this process does,
+ * restarts the potfile's flush thread (threads aren't copied by fork()) and
+ * then serves connections like a single server process, using its own state
+ * directory and job IDs. The cores to crack on are shared out between the
+ * workers, so that they don't start more crack worker threads between them
+ * than one process would (each gets at least one). A worker that is started
+ * again knows it has been, so the jobs it resumes aren't counted twice.
+ *
+ * workers: the worker processes
+ * worker: number of the worker to start
+ */
+void start_worker(WorkerProcesses* workers, int worker) {
+    pid_t parent = getpid();
+    pid_t pid = fork();
+
+    if (pid < 0) {
+        perror("Error starting worker");
+        workers->pids[worker] = 0; // Tried again with the next sample
+        return;
+    } else if (pid > 0) {
+        workers->pids[worker] = pid;
+        workers->started[worker] = true;
+        return;
+    }
+    prctl(PR_SET_PDEATHSIG, SIGTERM);
+    if (getppid() != parent) {
+        exit(0); // The parent exited before the death signal was set
+    }
+    ServerDetails details = workers->details;
+    details.stateDirName = workers->stateDirs ? workers->stateDirs[worker]
+            : NULL;
+    details.worker = worker;
+    details.restarted = workers->started[worker];
+    details.numCores = details.numCores / details.numWorkers
+            + (worker < details.numCores % details.numWorkers);
+    if (!details.numCores) {
+        details.numCores = 1;
+    }
+    if (workers->potfile) {
+        potfile_restart(workers->potfile);
+    }
+    process_connections(workers->serv, workers->metricsServ, workers->dict,
+            details, workers->indexFile, workers->potfile, workers->weights,
+            workers->stats, workers->statuses);
+    exit(0);
+}
+
+/* supervise_workers()
+ * -------------------
+ * Function that is run by the parent of the prefork workers once they have
+ * started. Like the stats thread of a single server process, it samples the
+ * total crypt() calls once a second and prints the stats (added up over every
+ * worker) on a SIGHUP. A SIGUSR1 is passed on to every worker, which each
+ * reload the dictionary. Workers that exit (eg if one crashes) are started
+ * again with the next sample, so one that keeps exiting is only started once
+ * a second.
+ *
+ * workers: the worker processes
+ * set: the signals to wait for (SIGHUP, SIGUSR1 and SIGCHLD)
+ */
+void supervise_workers(WorkerProcesses* workers, sigset_t* set) {
+    StatsSnapshot* snapshot = malloc(sizeof(StatsSnapshot));
+    uint64_t nextSample = now_micros();
+
+    while (1) {
+        uint64_t now = now_micros();
+        if (now >= nextSample) {
+            stats_sample_rates(workers->stats, now);
+            nextSample = now + MICROS_PER_SECOND;
+            for (int i = 0; i < workers->details.numWorkers; i++) {
+                if (!workers->pids[i]) {
+                    start_worker(workers, i);
+                }
+            }
+        }
+        uint64_t wait = nextSample - now;
+        struct timespec timeout = {.tv_sec = wait / MICROS_PER_SECOND,
+                .tv_nsec = wait % MICROS_PER_SECOND * 1000};
+        int signal = sigtimedwait(set, NULL, &timeout);
+        if (signal == SIGHUP) {
+            stats_report(workers->stats, NULL, snapshot);
+        } else if (signal == SIGUSR1) {
+            for (int i = 0; i < workers->details.numWorkers; i++) {
+                if (workers->pids[i]) {
+                    kill(workers->pids[i], SIGUSR1);
+                }
+            }
+        }
+        reap_workers(workers);
+    }
+}
+
+/* reap_workers()
+ * --------------
+ * Waits for any worker processes that have exited, without blocking, and
+ * marks them to be started again. Connections that a worker still had open
+ * are counted as completed, since it never got to close them, and its crack
+ * worker pool's gauges are cleared.
+ *
+ * workers: the worker processes
+ */
+void reap_workers(WorkerProcesses* workers) {
+    pid_t pid;
+    int status;
+
+    while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+        for (int i = 0; i < workers->details.numWorkers; i++) {
+            if (workers->pids[i] == pid) {
+                fprintf(stderr, WORKER_EXIT_MESSAGE, i, pid);
+                workers->pids[i] = 0;
+                stats_add(workers->stats, STAT_COMPLETED, __atomic_exchange_n(
+                        &workers->stats->workerConnections[i], 0,
+                        __ATOMIC_RELAXED));
+                for (int gauge = 0; gauge < NUM_POOL_GAUGES; gauge++) {
+                    __atomic_store_n(&workers->stats->workerGauges[i][gauge],
+                            0, __ATOMIC_RELAXED);
+                }
+            }
+        }
+    }
+}
+
+/* checkpoint_thread()
+ * -------------------
+ * Function that is run by the thread that checkpoints submitted jobs. Every
+ * CHECKPOINT_SECONDS, each running job's checkpoint file is rewritten with
+ * how far it has got, so that a restarted server can resume it from there.
+ * The checkpoints are taken while the table is locked, and written once it
+ * has been unlocked, so that submitting and polling jobs never waits for the
+ * files to be written.
+ *
+ * v: void pointer to the ServerContext struct
+ */
+void* checkpoint_thread(void* v) {
+    ServerContext* server = (ServerContext*)v;
+    JobTable* table = server->jobs;
+    JobCheckpoint* checkpoints = malloc(sizeof(JobCheckpoint)
+            * (table->size + 1));
+
+    while (1) {
+        sleep(CHECKPOINT_SECONDS);
+        int numCheckpoints = 0;
+        // Before the table, so no job taken can have its file removed first
+        pthread_mutex_lock(&table->checkpointLock);
+        pthread_mutex_lock(&table->lock);
+        for (int i = 0; i < table->size; i++) {
+            if (table->slots[i].job) {
+                job_checkpoint_take(&table->slots[i],
+                        &checkpoints[numCheckpoints++]);
+            }
+        }
+        pthread_mutex_unlock(&table->lock);
+        for (int i = 0; i < numCheckpoints; i++) {
+            job_checkpoint_write(server->stateDir, &checkpoints[i]);
+        }
+        pthread_mutex_unlock(&table->checkpointLock);
+    }
+    return NULL;
+}
+
+/* job_checkpoint_take()
+ * ---------------------
+ * Takes a running job's checkpoint, to be written once its table has been
+ * unlocked. The job's dictionary version gets another reference, since the
+ * job may finish (and give back its own) before the order is saved.
+ *
+ * submitted: the running job, whose table must be locked
+ * checkpoint: set to the checkpoint, which must be written with
+ * job_checkpoint_write()
+ */
+void job_checkpoint_take(SubmittedJob* submitted, JobCheckpoint* checkpoint) {
+    CrackJob* job = submitted->job;
+
+    checkpoint->id = submitted->id;
+    checkpoint->position = job_chunk_position(job, job_finished_chunks(job));
+    checkpoint->checksum = submitted->checksum;
+    checkpoint->command = strdup(submitted->command);
+    checkpoint->version = NULL;
+    if (job->version && job->version->source->weights) {
+        checkpoint->version = job->version;
+        __atomic_add_fetch(&job->version->refs, 1, __ATOMIC_SEQ_CST);
+    }
+}
+
+/* job_checkpoint_write()
+ * ----------------------
+ * Writes a running job's checkpoint file. The first line is the job's ID,
+ * the position in its candidates that every candidate before has been
+ * hashed, and the checksum of its dictionary. The second is the command that
+ * was submitted. The file is written under a temporary name and renamed, so
+ * a checkpoint file is always complete. If it can't be written, the last
+ * checkpoint is kept. A job cracking in frequency order also has its order
+ * saved, since re-sorts will have changed it by the time it is resumed. The
+ * checkpoint's copy of the command and reference to the version are then
+ * given back.
+ *
+ * stateDir: the state directory
+ * checkpoint: the checkpoint from job_checkpoint_take(), whose table's
+ * checkpointLock must be held
+ */
+void job_checkpoint_write(const char* stateDir, JobCheckpoint* checkpoint) {
+    char* tempName = checkpoint_file_name(stateDir, checkpoint->id,
+            CHECKPOINT_TEMP_SUFFIX);
+    char* fileName = checkpoint_file_name(stateDir, checkpoint->id,
+            CHECKPOINT_SUFFIX);
+    FILE* file = fopen(tempName, "w");
+
+    if (file) {
+        fprintf(file, "%u %lu %lu\n%s\n", checkpoint->id,
+                checkpoint->position, checkpoint->checksum,
+                checkpoint->command);
+        if (fclose(file) == 0) {
+            rename(tempName, fileName);
+        } else {
+            unlink(tempName);
+        }
+    }
+    free(tempName);
+    free(fileName);
+    if (checkpoint->version) {
+        order_file_write(stateDir, checkpoint->version, checkpoint->checksum);
+    }
+    dictionary_release(checkpoint->version);
+    free(checkpoint->command);
+}
+
+/* checkpoint_file_name()
+ * ----------------------
+ * Makes the name of a job's checkpoint file in the state directory.
+ *
+ * stateDir: the state directory
+ * id: the job's ID
+ * suffix: the suffix of the file
+ *
+ * Returns: the name, which must be freed
+ */
+char* checkpoint_file_name(const char* stateDir, unsigned int id,
+        const char* suffix) {
+    char* name = malloc(strlen(stateDir) + MAX_JOB_ID_LENGTH + strlen(suffix)
+            + 2);
+
+    sprintf(name, "%s/%u%s", stateDir, id, suffix);
+    return name;
+}
+
+/* order_file_write()
+ * ------------------
+ * Saves the order of a dictionary version's words to the state directory, as
+ * the position of each word in the order the words were read (a 32-bit
+ * integer each), unless it has already been saved. Like a checkpoint, it is
+ * written under a temporary name and renamed.
+ *
+ * stateDir: the state directory
+ * version: the dictionary version
+ * checksum: checksum of the version's words in its order
+ */
+void order_file_write(const char* stateDir, DictionaryVersion* version,
+        uint64_t checksum) {
+    Dictionary* source = &version->source->dict;
+    char* fileName = order_file_name(stateDir, checksum, ORDER_SUFFIX);
+
+    if (access(fileName, F_OK) == 0) {
+        free(fileName);
+        return;
+    }
+    char* tempName = order_file_name(stateDir, checksum,
+            CHECKPOINT_TEMP_SUFFIX);
+    FILE* file = fopen(tempName, "w");
+    if (file) {
+        uint32_t* positions = malloc(sizeof(uint32_t)
+                * (version->dict.numWords + 1));
+        for (int i = 0; i < version->dict.numWords; i++) {
+            positions[i] = word_position(source, version->dict.words[i]);
+        }
+        size_t written = fwrite(positions, sizeof(uint32_t),
+                version->dict.numWords, file);
+        free(positions);
+        if (fclose(file) == 0 && written == (size_t)version->dict.numWords) {
+            rename(tempName, fileName);
+        } else {
+            unlink(tempName);
+        }
+    }
+    free(tempName);
+    free(fileName);
+}
+
+/* order_file_name()
+ * -----------------
+ * Makes the name of a saved order's file in the state directory.
+ *
+ * stateDir: the state directory
+ * checksum: checksum of the dictionary words in the order
+ * suffix: the suffix of the file
+ *
+ * Returns: the name, which must be freed
+ */
+char* order_file_name(const char* stateDir, uint64_t checksum,
+        const char* suffix) {
+    char* name = malloc(strlen(stateDir) + 2 * sizeof(uint64_t)
+            + strlen(suffix) + 2);
+
+    sprintf(name, "%s/%016lx%s", stateDir, checksum, suffix);
+    return name;
+}
+
+/* job_use_saved_order()
+ * ---------------------
+ * Switches a resumed job over to the frequency order it was cracking in
+ * before the restart, if that order was saved and is an order of the same
+ * words. The order gets its own dictionary version, which is retired
+ * straight away so that it is freed once the job finishes.
+ *
+ * server: ServerContext struct that holds the dictionary in use
+ * job: the resumed crack job, which holds a reference to the dictionary
+ * checksum: checksum of the words in the order the job was cracking in
+ *
+ * Returns: whether the job now cracks in the saved order
+ */
+bool job_use_saved_order(ServerContext* server, CrackJob* job,
+        uint64_t checksum) {
+    if (!job->version || !job->version->source->weights) {
+        return false;
+    }
+    Dictionary* source = &job->version->source->dict;
+    char* fileName = order_file_name(server->stateDir, checksum, ORDER_SUFFIX);
+    FILE* file = fopen(fileName, "r");
+    free(fileName);
+    if (!file) {
+        return false;
+    }
+    uint32_t* positions = malloc(sizeof(uint32_t) * (source->numWords + 1));
+    bool valid = fread(positions, sizeof(uint32_t), source->numWords, file)
+            == (size_t)source->numWords && fgetc(file) == EOF;
+    fclose(file);
+    char** words = malloc(sizeof(char*) * (source->numWords + 1));
+    for (int i = 0; valid && i < source->numWords; i++) {
+        valid = positions[i] < (uint32_t)source->numWords;
+        words[i] = valid ? source->words[positions[i]] : NULL;
+    }
+    free(positions);
+    if (!valid) {
+        free(words);
+        return false;
+    }
+
+    DictionaryVersion* version = create_ordered_version(job->version->source,
+            words, job->version->generation);
+    if (dictionary_checksum(&version->dict) != checksum) {
+        free_dictionary_version(version);
+        return false;
+    }
+    version->refs = 1;
+    pthread_mutex_lock(&server->publishLock);
+    dictionary_retire(server, version);
+    pthread_mutex_unlock(&server->publishLock);
+    dictionary_release(job->version);
+    job->version = version;
+    job->words = version->dict.words;
+    return true;
+}
+
+/* remove_unused_orders()
+ * ----------------------
+ * Removes the saved orders in the state directory that no running job is
+ * cracking in.
+ *
+ * server: ServerContext struct that holds the job table
+ */
+void remove_unused_orders(ServerContext* server) {
+    JobTable* table = server->jobs;
+    DIR* dir = opendir(server->stateDir);
+    struct dirent* entry;
+    size_t suffixLength = strlen(ORDER_SUFFIX);
+
+    if (!dir) {
+        return;
+    }
+    pthread_mutex_lock(&table->lock);
+    while ((entry = readdir(dir))) {
+        size_t length = strlen(entry->d_name);
+        if (length <= suffixLength || strcmp(entry->d_name + length
+                - suffixLength, ORDER_SUFFIX) != 0) {
+            continue;
+        }
+        uint64_t checksum = strtoull(entry->d_name, NULL, 16);
+        bool used = false;
+        for (int i = 0; i < table->size && !used; i++) {
+            used = table->slots[i].job && table->slots[i].checksum == checksum;
+        }
+        if (!used) {
+            char* fileName = order_file_name(server->stateDir, checksum,
+                    ORDER_SUFFIX);
+            unlink(fileName);
+            free(fileName);
+        }
+    }
+    pthread_mutex_unlock(&table->lock);
+    closedir(dir);
+}
+
+/* resume_jobs()
+ * -------------
+ * Resumes every job that has a checkpoint file in the state directory,
+ * before any connections are accepted. Saved orders that none of them are
+ * cracking in are then removed.
+ *
+ * server: ServerContext struct that holds the job table
+ */
+void resume_jobs(ServerContext* server) {
+    DIR* dir = opendir(server->stateDir);
+    struct dirent* entry;
+    size_t suffixLength = strlen(CHECKPOINT_SUFFIX);
+
+    if (!dir) {
+        return;
+    }
+    while ((entry = readdir(dir))) {
+        size_t length = strlen(entry->d_name);
+        if (length > suffixLength && strcmp(entry->d_name + length
+                - suffixLength, CHECKPOINT_SUFFIX) == 0) {
+            resume_job(server, entry->d_name);
+        }
+    }
+    closedir(dir);
+    remove_unused_orders(server);
+}
+
+/* resume_job()
+ * ------------
+ * Reads a job's checkpoint file and submits the job again, counting it as a
+ * crack request (unless this is a restarted prefork worker, whose jobs were
+ * already counted). A file that isn't a valid checkpoint is removed, and one
+ * whose job can't be given its old slot back is left for the next restart.
+ * If the job was given a new ID, its old checkpoint is removed, since it is
+ * checkpointed under the new one.
+ *
+ * server: ServerContext struct that holds the job table
+ * fileName: name of the checkpoint file in the state directory
+ */
+void resume_job(ServerContext* server, const char* fileName) {
+    char* path = malloc(strlen(server->stateDir) + strlen(fileName) + 2);
+    sprintf(path, "%s/%s", server->stateDir, fileName);
+    FILE* file = fopen(path, "r");
+    char* line = NULL;
+    size_t size = 0;
+    JobCheckpoint checkpoint;
+    unsigned int id;
+    SubmitStatus status = SUBMIT_INVALID;
+
+    if (!file) {
+        free(path);
+        return;
+    }
+    char* kind = NULL;
+    if (fscanf(file, "%u %lu %lu\n", &checkpoint.id, &checkpoint.position,
+            &checkpoint.checksum) == 3 && checkpoint.id
+            && getline(&line, &size, file) > 0) {
+        line[strcspn(line, "\n")] = '\0';
+        kind = line;
+    }
+    fclose(file);
+    char* args = kind ? strchr(kind, ' ') : NULL;
+    if (args) {
+        *args++ = '\0';
+        if (strcmp(kind, "crack") == 0 || strcmp(kind, "crackmask") == 0) {
+            status = job_table_submit(server, kind, args, &checkpoint, &id);
+        }
+    }
+    if (status == SUBMIT_INVALID || (status == SUBMIT_STARTED
+            && id != checkpoint.id)) {
+        unlink(path);
+    }
+    if (status == SUBMIT_STARTED) {
+        fprintf(stderr, RESUME_MESSAGE, id, checkpoint.position);
+    }
+    if (status == SUBMIT_STARTED && !server->restarted) {
+        stats_add_crack_request(server->stats);
+        stats_add(server->stats, STAT_RESUMED_JOBS, 1);
+        stats_add(server->stats, STAT_RESUMED_CALLS, checkpoint.position);
+    }
+    free(line);
+    free(path);
+}
+
+/* job_claimed_chunks()
+ * --------------------
+ * Works out how many of a single crack job's chunks have been claimed by
+ * the workers so far.
+ *
+ * job: the crack job
+ *
+ * Returns: the number of chunks claimed
+ */
+uint64_t job_claimed_chunks(CrackJob* job) {
+    if (job->mask) {
+        return __atomic_load_n(&job->mask->cursor, __ATOMIC_RELAXED);
+    }
+    uint64_t cursor = __atomic_load_n(&job->cursor, __ATOMIC_RELAXED);
+    return job->rules ? cursor : cursor / job->chunkSize;
+}
+
+/* job_finished_chunks()
+ * ---------------------
+ * Works out how many of a submitted job's chunks, from the start, have all
+ * been finished. That is every chunk that has been claimed, apart from those
+ * that a task might still be running. A task records the claimed count
+ * before it claims a chunk, and the fences make sure that a claim seen here
+ * was recorded.
+ *
+ * job: the submitted crack job
+ *
+ * Returns: the number of chunks before the first one that might not be
+ * finished
+ */
+uint64_t job_finished_chunks(CrackJob* job) {
+    uint64_t finished = job_claimed_chunks(job);
+    int numTasks = __atomic_load_n(&job->numTasks, __ATOMIC_ACQUIRE);
+    uint64_t numChunks = job_num_chunks(job);
+
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    for (int i = 0; i < numTasks; i++) {
+        uint64_t chunk = __atomic_load_n(&job->tasks[i].chunk,
+                __ATOMIC_RELAXED);
+        if (chunk < finished) {
+            finished = chunk;
+        }
+    }
+    return finished < numChunks ? finished : numChunks;
+}
+
+/* job_chunk_position()
+ * --------------------
+ * Works out the position in a single crack job's candidates that a chunk
+ * starts at. Positions don't depend on the chunk size, so a checkpoint can
+ * be resumed by a server that hashes in different sized batches. With rules,
+ * each rule's candidates follow the previous rule's.
+ *
+ * job: the crack job
+ * chunks: the chunk number
+ *
+ * Returns: the position of the chunk's first candidate
+ */
+uint64_t job_chunk_position(CrackJob* job, uint64_t chunks) {
+    uint64_t numWords = job->mask ? job->mask->mask.keyspace
+            : (uint64_t)job->numWords;
+    uint64_t chunksPerRule = (numWords + job->chunkSize - 1) / job->chunkSize;
+    uint64_t rule = job->rules ? chunks / chunksPerRule : 0;
+    uint64_t position = (chunks - rule * chunksPerRule) * job->chunkSize;
+
+    return rule * numWords + (position < numWords ? position : numWords);
+}
+
+/* job_resume_at()
+ * ---------------
+ * Moves a new crack job's cursor on to the chunk that a position is in, so
+ * that the candidates before that chunk aren't hashed again.
+ *
+ * job: the crack job, which hasn't been started
+ * position: position in the job's candidates, from job_chunk_position()
+ */
+void job_resume_at(CrackJob* job, uint64_t position) {
+    uint64_t numCandidates = job_num_candidates(job);
+
+    if (position > numCandidates) {
+        position = numCandidates;
+    }
+    if (job->mask) {
+        job->mask->cursor = position / job->chunkSize;
+    } else if (job->rules) {
+        uint64_t chunksPerRule = (job->numWords + job->chunkSize - 1)
+                / job->chunkSize;
+        job->cursor = position / job->numWords * chunksPerRule
+                + position % job->numWords / job->chunkSize;
+    } else {
+        job->cursor = position / job->chunkSize * job->chunkSize;
+    }
+}
+
+/* create_response_cache()
+ * -----------------------
+ * Allocates an empty response cache. Its entries are spread evenly over the
+ * segments, and each segment's hash table has at least one bucket per entry.
+ *
+ * maxEntries: the most responses to cache (at least 1)
+ *
+ * Returns: the response cache
+ */
+ResponseCache* create_response_cache(int maxEntries) {
+    void* memory = NULL;
+    int segmentEntries = (maxEntries + CACHE_SEGMENTS - 1) / CACHE_SEGMENTS;
+    unsigned int numBuckets = 1;
+
+    // Aligned so that each segment is on its own cache lines
+    if (posix_memalign(&memory, CACHE_LINE_SIZE, sizeof(ResponseCache))) {
+        return NULL;
+    }
+    ResponseCache* cache = memory;
+    memset(cache, 0, sizeof(ResponseCache));
+    while (numBuckets < (unsigned int)segmentEntries) {
+        numBuckets *= 2;
+    }
+    for (int i = 0; i < CACHE_SEGMENTS; i++) {
+        CacheSegment* segment = &cache->segments[i];
+        segment->buckets = calloc(numBuckets, sizeof(CacheEntry*));
+        segment->mask = numBuckets - 1;
+        segment->maxEntries = segmentEntries;
+        pthread_mutex_init(&segment->lock, NULL);
+    }
+    return cache;
+}
+
+/* response_cache_lookup()
+ * -----------------------
+ * Looks up a response in the cache, only locking the key's segment. A cached
+ * crack failure from another dictionary generation is treated as a miss.
+ *
+ * cache: response cache
+ * key: key of the response
+ * generation: current dictionary generation
+ * value: room for a cipher text, which the cached response is copied into
+ * failed: set to whether the response is a crack that found no word
+ *
+ * Returns: whether the response was in the cache
+ */
+bool response_cache_lookup(ResponseCache* cache, const char* key,
+        unsigned int generation, char* value, bool* failed) {
+    unsigned int hash = cache_hash(key);
+    CacheSegment* segment = &cache->segments[hash % CACHE_SEGMENTS];
+
+    pthread_mutex_lock(&segment->lock);
+    CacheEntry* entry =
+            segment->buckets[(hash / CACHE_SEGMENTS) & segment->mask];
+    while (entry && strcmp(entry->key, key)) {
+        entry = entry->next;
+    }
+    if (!entry || (entry->failed && entry->generation != generation)) {
+        pthread_mutex_unlock(&segment->lock);
+        return false;
+    }
+    // Move the entry to the front of the recently used list
+    response_cache_unlink(segment, entry);
+    response_cache_push(segment, entry);
+    strcpy(value, entry->value);
+    *failed = entry->failed;
+    pthread_mutex_unlock(&segment->lock);
+    return true;
+}
+
+/* response_cache_insert()
+ * -----------------------
+ * Adds a response to the cache, or replaces the one already cached for the
+ * key. When the key's segment is full, its least recently used response is
+ * evicted and its entry reused.
+ *
+ * cache: response cache
+ * key: key of the response
+ * value: the response, at most CIPHER_LENGTH characters, or null for a crack
+ * that found no word
+ * generation: dictionary generation that a failed crack was cracked with
+ */
+void response_cache_insert(ResponseCache* cache, const char* key,
+        const char* value, unsigned int generation) {
+    unsigned int hash = cache_hash(key);
+    CacheSegment* segment = &cache->segments[hash % CACHE_SEGMENTS];
+
+    pthread_mutex_lock(&segment->lock);
+    CacheEntry** bucket =
+            &segment->buckets[(hash / CACHE_SEGMENTS) & segment->mask];
+    CacheEntry* entry = *bucket;
+    while (entry && strcmp(entry->key, key)) {
+        entry = entry->next;
+    }
+    if (entry) {
+        response_cache_unlink(segment, entry);
+    } else {
+        if (segment->numEntries == segment->maxEntries) {
+            // Take the oldest entry out of its hash chain and reuse it
+            entry = segment->oldest;
+            response_cache_unlink(segment, entry);
+            CacheEntry** link = &segment->buckets[(cache_hash(entry->key)
+                    / CACHE_SEGMENTS) & segment->mask];
+            while (*link != entry) {
+                link = &(*link)->next;
+            }
+            *link = entry->next;
+        } else {
+            entry = malloc(sizeof(CacheEntry));
+            segment->numEntries++;
+        }
+        strcpy(entry->key, key);
+        entry->next = *bucket;
+        *bucket = entry;
+    }
+    strcpy(entry->value, value ? value : "");
+    entry->failed = !value;
+    entry->generation = generation;
+    response_cache_push(segment, entry);
+    pthread_mutex_unlock(&segment->lock);
+}
+
+/* response_cache_unlink()
+ * -----------------------
+ * Removes an entry from its segment's recently used list. The segment must be
+ * locked.
+ *
+ * segment: segment of the response cache
+ * entry: entry to remove from the list
+ */
+void response_cache_unlink(CacheSegment* segment, CacheEntry* entry) {
+    if (entry->newer) {
+        entry->newer->older = entry->older;
+    } else {
+        segment->newest = entry->older;
+    }
+    if (entry->older) {
+        entry->older->newer = entry->newer;
+    } else {
+        segment->oldest = entry->newer;
+    }
+    entry->newer = NULL;
+    entry->older = NULL;
+}
+
+/* response_cache_push()
+ * ---------------------
+ * Adds an entry to the front of its segment's recently used list. The segment
+ * must be locked.
+ *
+ * segment: segment of the response cache
+ * entry: entry that isn't in the list
+ */
+void response_cache_push(CacheSegment* segment, CacheEntry* entry) {
+    entry->newer = NULL;
+    entry->older = segment->newest;
+    if (segment->newest) {
+        segment->newest->newer = entry;
+    }
+    segment->newest = entry;
+    if (!segment->oldest) {
+        segment->oldest = entry;
+    }
+}
+
+/* cache_hash()
+ * ------------
+ * Hashes a response cache key with FNV-1a.
+ *
+ * key: the key
+ *
+ * Returns: the hash
+ */
+unsigned int cache_hash(const char* key) {
+    uint32_t hash = FNV_OFFSET;
+
+    for (int i = 0; key[i]; i++) {
+        hash = (hash ^ (unsigned char)key[i]) * FNV_PRIME;
+    }
+    return hash;
+}
+
+/* crypt_cache_key()
+ * -----------------
+ * Makes the response cache key of a crypt request. crypt() only uses the
+ * first 8 characters of a word, so words that start the same share a key.
+ *
+ * key: room for a key, which is filled in
+ * word: crypt text of the request
+ * salt: salt of the request
+ */
+void crypt_cache_key(char* key, const char* word, const char* salt) {
+    key[0] = CACHE_CRYPT;
+    strncpy(key + 1, salt, SALT_LENGTH);
+    strncpy(key + 1 + SALT_LENGTH, word, CRYPT_WORD_LENGTH);
+    key[1 + SALT_LENGTH + CRYPT_WORD_LENGTH] = '\0';
+}
+
+/* crack_cache_key()
+ * -----------------
+ * Makes the response cache key of a crack request.
+ *
+ * key: room for a key, which is filled in
+ * cipherText: cipher text of the request
+ */
+void crack_cache_key(char* key, const char* cipherText) {
+    key[0] = CACHE_CRACK;
+    strcpy(key + 1, cipherText);
+}
+
+/* crypt_call()
+ * ------------
+ * Creates and returns cipher text based on some crypt text and a salt.
+ *
+ * crypText: crypt text used to make cipher text
+ * salt: salt used to make cipher text
+ * data: crypt_r() state of the calling thread, which holds the result
+ *
+ * Returns: cipher text (hash), valid until data is next used
+ */
+char* crypt_call(char* cryptText, char* salt, struct crypt_data* data) {
+    char* hash;
+    // data was zeroed when it was allocated, and can be reused from there
+    hash = crypt_r(cryptText, salt, data);
+    return hash;
+}
+
+/* crypt_command()
+ * ---------------
+ * Answers a crypt request, from the response cache if it is there. Otherwise
+ * the hash is made with the I/O thread's crypt_r() state and added to the
+ * cache.
+ *
+ * cryptText: crypt text used to make cipher text
+ * salt: salt used to make cipher text (which must be valid)
+ * conn: connection that the crypt request came from
+ * cached: room for a cipher text, which a cached hash is copied into
+ *
+ * Returns: cipher text (hash), valid until the I/O thread next hashes a word
+ */
+char* crypt_command(char* cryptText, char* salt, Connection* conn,
+        char* cached) {
+    ServerContext* server = conn->io->server;
+    char key[CACHE_KEY_LENGTH + 1];
+    bool failed;
+
+    if (server->cache) {
+        crypt_cache_key(key, cryptText, salt);
+        if (response_cache_lookup(server->cache, key, 0, cached, &failed)) {
+            stats_add(server->stats, STAT_CACHE_HITS, 1);
+            return cached;
+        }
+        stats_add(server->stats, STAT_CACHE_MISSES, 1);
+    }
+    char* hash = crypt_call(cryptText, salt, conn->io->cryptData);
+    stats_add_crypt_call(server->stats, 1);
+    if (server->cache && hash && strlen(hash) == CIPHER_LENGTH) {
+        response_cache_insert(server->cache, key, hash, 0);
+    }
+    return hash;
+}
+
+/* stats_add()
+ * -----------
+ * Adds the given number to one of the stats counters, in the calling thread's
+ * shard. No lock is taken - the shard is only shared if there are more
+ * threads than shards, and the add is atomic either way.
+ *
+ * stats: Statistics struct that contains all of the server statistics
+ * counter: the counter to add to
+ * num: the number to add
+ */
+void stats_add(Statistics* stats, StatCounter counter, uint64_t num) {
+    __atomic_fetch_add(&stats_shard(stats)->counts[counter], num,
+            __ATOMIC_RELAXED);
+}
+
+/* stats_shard()
+ * -------------
+ * Finds the calling thread's stats shard. Threads are given the next shard
+ * the first time they need one.
+ *
+ * stats: Statistics struct that contains all of the server statistics
+ *
+ * Returns: the thread's shard
+ */
+StatShard* stats_shard(Statistics* stats) {
+    static __thread int shard = -1;
+
+    if (shard < 0) {
+        shard = __atomic_fetch_add(&stats->nextShard, 1, __ATOMIC_RELAXED)
+                % NUM_STAT_SHARDS;
+    }
+    return &stats->shards[shard];
+}
+
+/* stats_record_latency()
+ * ----------------------
+ * Records how long something took, from the given start time until now, in
+ * the calling thread's shard of the latency histogram. No lock is taken.
+ *
+ * stats: Statistics struct that contains all of the server statistics
+ * kind: which latency it is
+ * startMicros: when it started, from now_micros()
+ */
+void stats_record_latency(Statistics* stats, LatencyKind kind,
+        uint64_t startMicros) {
+    StatShard* shard = stats_shard(stats);
+    uint64_t micros = now_micros() - startMicros;
+    uint64_t max = __atomic_load_n(&shard->maxLatency[kind], __ATOMIC_RELAXED);
+
+    __atomic_fetch_add(&shard->latencies[kind][latency_bucket(micros)], 1,
+            __ATOMIC_RELAXED);
+    __atomic_fetch_add(&shard->latencySum[kind], micros, __ATOMIC_RELAXED);
+    while (micros > max && !__atomic_compare_exchange_n(
+            &shard->maxLatency[kind], &max, micros, true, __ATOMIC_RELAXED,
+            __ATOMIC_RELAXED)) {
+    }
+}
+
+/* stats_total()
+ * -------------
+ * Adds up one of the stats counters across every shard.
+ *
+ * stats: Statistics struct that contains all of the server statistics
+ * counter: the counter to total
+ *
+ * Returns: the counter's total
+ */
+uint64_t stats_total(Statistics* stats, StatCounter counter) {
+    uint64_t total = 0;
+
+    for (int i = 0; i < NUM_STAT_SHARDS; i++) {
+        total += __atomic_load_n(&stats->shards[i].counts[counter],
+                __ATOMIC_RELAXED);
+    }
+    return total;
+}
+
+/* stats_snapshot()
+ * ----------------
+ * Totals the stats counters for printing. Counters that only go up after
+ * another one has (such as completed clients after connections, or passed
+ * cracks after crack requests) are totalled first, so the totals are always
+ * consistent with each other even while other threads are adding to them.
+ *
+ * stats: Statistics struct that contains all of the server statistics
+ * snapshot: filled in with the totals
+ */
+void stats_snapshot(Statistics* stats, StatsSnapshot* snapshot) {
+    snapshot->numCompleted = stats_total(stats, STAT_COMPLETED);
+    snapshot->numConnected = stats_total(stats, STAT_CONNECTIONS)
+            - snapshot->numCompleted;
+    snapshot->failedCracks = stats_total(stats, STAT_FAILED_CRACKS);
+    snapshot->successCracks = stats_total(stats, STAT_SUCCESS_CRACKS);
+    snapshot->indexHits = stats_total(stats, STAT_INDEX_HITS);
+    snapshot->indexMisses = stats_total(stats, STAT_INDEX_MISSES);
+    snapshot->cracks = stats_total(stats, STAT_CRACKS);
+    snapshot->cryptCalls = stats_total(stats, STAT_CRYPT_CALLS);
+    snapshot->crypts = stats_total(stats, STAT_CRYPTS);
+    snapshot->solvedCalls = stats_total(stats, STAT_SOLVED_CALLS);
+    snapshot->solvedCracks = stats_total(stats, STAT_SOLVED_CRACKS);
+    snapshot->potfileHits = stats_total(stats, STAT_POTFILE_HITS);
+    snapshot->cacheHits = stats_total(stats, STAT_CACHE_HITS);
+    snapshot->cacheMisses = stats_total(stats, STAT_CACHE_MISSES);
+    snapshot->resumedJobs = stats_total(stats, STAT_RESUMED_JOBS);
+    snapshot->resumedCalls = stats_total(stats, STAT_RESUMED_CALLS);
+
+    memset(snapshot->latencies, 0, sizeof(snapshot->latencies));
+    memset(snapshot->maxLatency, 0, sizeof(snapshot->maxLatency));
+    memset(snapshot->latencySum, 0, sizeof(snapshot->latencySum));
+    for (int i = 0; i < NUM_STAT_SHARDS; i++) {
+        StatShard* shard = &stats->shards[i];
+        for (int kind = 0; kind < NUM_LATENCIES; kind++) {
+            for (int j = 0; j < NUM_LATENCY_BUCKETS; j++) {
+                snapshot->latencies[kind][j] += __atomic_load_n(
+                        &shard->latencies[kind][j], __ATOMIC_RELAXED);
+            }
+            uint64_t max = __atomic_load_n(&shard->maxLatency[kind],
+                    __ATOMIC_RELAXED);
+            if (max > snapshot->maxLatency[kind]) {
+                snapshot->maxLatency[kind] = max;
+            }
+            snapshot->latencySum[kind] += __atomic_load_n(
+                    &shard->latencySum[kind], __ATOMIC_RELAXED);
+        }
+    }
+}
 
-    char* hash;
+/* stats_print_latencies()
+ * -----------------------
+ * Prints the number of requests and the 50th, 90th and 99th percentile and
+ * maximum latencies of each kind of latency that has been recorded.
+ * Percentiles are the top of the bucket they fall in.
+ *
+ * snapshot: totals of the stats, including the latency histograms
+ * out: where to print them
+ */
+void stats_print_latencies(StatsSnapshot* snapshot, FILE* out) {
+    const char* names[NUM_LATENCIES] = {"Crack", "Crack batch",
+            "Crack queue wait", "Crypt"};
+
+    for (int kind = 0; kind < NUM_LATENCIES; kind++) {
+        const uint64_t* counts = snapshot->latencies[kind];
+        uint64_t max = snapshot->maxLatency[kind];
+        uint64_t count = 0;
+        for (int i = 0; i < NUM_LATENCY_BUCKETS; i++) {
+            count += counts[i];
+        }
+        fprintf(out, LATENCY_MESSAGE, names[kind], (unsigned long)count,
+                (unsigned long)latency_percentile(counts, count, max, 0.5),
+                (unsigned long)latency_percentile(counts, count, max, 0.9),
+                (unsigned long)latency_percentile(counts, count, max, 0.99),
+                (unsigned long)max);
+    }
+}
+
+/* latency_bucket()
+ * ----------------
+ * Works out which histogram bucket a latency goes in. Latencies below
+ * LATENCY_SUB_BUCKETS microseconds each get their own bucket, and above that
+ * every power of 2 is split into LATENCY_SUB_BUCKETS buckets.
+ *
+ * micros: the latency in microseconds
+ *
+ * Returns: the bucket's index
+ */
+int latency_bucket(uint64_t micros) {
+    if (micros >= LATENCY_LIMIT) {
+        micros = LATENCY_LIMIT - 1;
+    }
+    if (micros < LATENCY_SUB_BUCKETS) {
+        return micros;
+    }
+    int shift = 63 - __builtin_clzll(micros) - LATENCY_SUB_BITS;
+    return (shift + 1) * LATENCY_SUB_BUCKETS + (micros >> shift)
+            - LATENCY_SUB_BUCKETS;
+}
+
+/* latency_bucket_value()
+ * ----------------------
+ * Works out the largest latency that goes in a histogram bucket.
+ *
+ * bucket: the bucket's index
+ *
+ * Returns: the latency in microseconds
+ */
+uint64_t latency_bucket_value(int bucket) {
+    if (bucket < LATENCY_SUB_BUCKETS) {
+        return bucket;
+    }
+    int shift = bucket / LATENCY_SUB_BUCKETS - 1;
+    return ((uint64_t)(bucket % LATENCY_SUB_BUCKETS + LATENCY_SUB_BUCKETS + 1)
+            << shift) - 1;
+}
+
+/* latency_percentile()
+ * --------------------
+ * Finds a percentile of a latency histogram.
+ *
+ * counts: the histogram's buckets
+ * count: the total of the buckets
+ * max: the largest latency recorded, which no percentile is above
+ * fraction: the percentile as a fraction (eg: 0.99)
+ *
+ * Returns: the percentile in microseconds, or 0 if nothing was recorded
+ */
+uint64_t latency_percentile(const uint64_t* counts, uint64_t count,
+        uint64_t max, double fraction) {
+    uint64_t rank = (uint64_t)(fraction * count + 0.5);
+    uint64_t seen = 0;
+
+    if (rank == 0) {
+        rank = 1;
+    }
+    for (int i = 0; i < NUM_LATENCY_BUCKETS && count; i++) {
+        seen += counts[i];
+        if (seen >= rank) {
+            uint64_t value = latency_bucket_value(i);
+            return value < max ? value : max;
+        }
+    }
+    return 0;
+}
+
+/* rate_history_add()
+ * ------------------
+ * Adds a sample of the total crypt() calls to the history, replacing the
+ * oldest sample once it is full.
+ *
+ * history: the samples
+ * micros: when the sample was taken, from now_micros()
+ * calls: total crypt() calls at that time
+ */
+void rate_history_add(RateHistory* history, uint64_t micros, uint64_t calls) {
+    history->micros[history->next] = micros;
+    history->calls[history->next] = calls;
+    history->next = (history->next + 1) % RATE_HISTORY;
+    if (history->numSamples < RATE_HISTORY) {
+        history->numSamples++;
+    }
+}
 
-    struct crypt_data data;
-    // Zero the entire data struct
-    memset(&data, 0, sizeof(struct crypt_data));
+/* rate_history_rate()
+ * -------------------
+ * Works out the crypt() calls per second over about the last given number of
+ * seconds, from the newest sample that is at least that old (or the oldest
+ * sample, if none are).
+ *
+ * history: the samples
+ * seconds: how far back to look
+ * micros: the time now, from now_micros()
+ * calls: total crypt() calls now
+ *
+ * Returns: the calls per second, or 0 if there are no samples to go by
+ */
+double rate_history_rate(RateHistory* history, int seconds, uint64_t micros,
+        uint64_t calls) {
+    int sample = -1;
 
-    // Go through each word in the dictionary and brute-force
-    for (int i = crackData->startPos; i < crackData->endPos &&
-            *crackData->found == 0; i++) {
-        hash = crypt_r(crackData->words[i], crackData->salt, &data);
-        crackReturned->numCalls++; // Increase the number of crypt calls
-        // If its a match, set the result, tell other threads to stop, return
-        if (strcmp(hash, crackData->cipherText) == 0) {
-            *crackData->found = 1;
-            crackReturned->word = crackData->words[i];
-            return (void*) crackReturned;
+    for (int i = 1; i <= history->numSamples; i++) {
+        sample = (history->next - i + RATE_HISTORY) % RATE_HISTORY;
+        if (micros - history->micros[sample]
+                >= (uint64_t)seconds * MICROS_PER_SECOND) {
+            break;
         }
     }
-    // Return if nothing found or other thread found result
-    return (void*) crackReturned;
+    if (sample < 0 || micros == history->micros[sample]) {
+        return 0.0;
+    }
+    return (double)(calls - history->calls[sample]) * MICROS_PER_SECOND
+            / (micros - history->micros[sample]);
 }
 
-/* crypt_call()
- * ------------
- * Creates and returns cipher text based on some crypt text and a salt.
+/* stats_sample_rates()
+ * --------------------
+ * Adds a sample of the total crypt() calls to the shared rate history.
  *
- * crypText: crypt text used to make cipher text
- * salt: salt used to make cipher text
+ * stats: Statistics struct that contains all of the server statistics
+ * micros: the time now, from now_micros()
+ */
+void stats_sample_rates(Statistics* stats, uint64_t micros) {
+    uint64_t calls = stats_total(stats, STAT_CRYPT_CALLS);
+
+    pthread_mutex_lock(&stats->rateLock);
+    rate_history_add(&stats->rates, micros, calls);
+    pthread_mutex_unlock(&stats->rateLock);
+}
+
+/* stats_publish_pool()
+ * --------------------
+ * Publishes a prefork worker process's crack worker pool gauges in the shared
+ * stats, for whichever worker serves the metrics page. The crack scheduler's
+ * fields are read without taking its lock.
  *
- * Returns: cipher text (hash)
+ * stats: Statistics struct shared by the workers
+ * worker: number of the worker
+ * pool: the worker's crack worker pool
  */
-char* crypt_call(char* cryptText, char* salt) {
-    char* hash;
-    // Create crypt struct in order to use crypt_r (reentrant version)
-    struct crypt_data data;
-    // Zero the entire data struct
-    memset(&data, 0, sizeof(struct crypt_data));
-    hash = crypt_r(cryptText, salt, &data);
-    return hash;
+void stats_publish_pool(Statistics* stats, int worker, CrackPool* pool) {
+    int64_t* published = stats->workerGauges[worker];
+
+    __atomic_store_n(&published[GAUGE_CRACK_WORKERS_BUSY],
+            __atomic_load_n(&pool->numBusy, __ATOMIC_RELAXED),
+            __ATOMIC_RELAXED);
+    __atomic_store_n(&published[GAUGE_CRACK_QUEUE_DEPTH],
+            __atomic_load_n(&pool->queueDepth, __ATOMIC_RELAXED),
+            __ATOMIC_RELAXED);
+    __atomic_store_n(&published[GAUGE_CRACK_WORKERS], pool->numWorkers,
+            __ATOMIC_RELAXED);
+}
+
+/* stats_crypt_rate()
+ * ------------------
+ * Works out the crypt() calls per second over about the last given number of
+ * seconds from the shared rate history.
+ *
+ * stats: Statistics struct that contains all of the server statistics
+ * seconds: how far back to look
+ * micros: the time now, from now_micros()
+ * calls: total crypt() calls now
+ *
+ * Returns: the calls per second
+ */
+double stats_crypt_rate(Statistics* stats, int seconds, uint64_t micros,
+        uint64_t calls) {
+    pthread_mutex_lock(&stats->rateLock);
+    double rate = rate_history_rate(&stats->rates, seconds, micros, calls);
+    pthread_mutex_unlock(&stats->rateLock);
+    return rate;
+}
+
+/* metrics_thread()
+ * ----------------
+ * Function that is ran by the metrics thread. It accepts connections on the
+ * metrics port one at a time and answers each one's HTTP request. It has its
+ * own listening socket and only reads the stats, so it never holds up the
+ * accept loop, the I/O threads or the crack workers.
+ *
+ * v: void pointer to a MetricsThreadData struct that contains the listening
+ * socket and the server context
+ */
+void* metrics_thread(void* v) {
+    MetricsThreadData* data = (MetricsThreadData*)v;
+    struct timeval timeout = {.tv_sec = HTTP_TIMEOUT_SECONDS, .tv_usec = 0};
+
+    while (1) {
+        int fd = accept(data->fd, NULL, NULL);
+        if (fd < 0) {
+            continue;
+        }
+        // A client that doesn't send its request can't hold the thread up
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+        metrics_serve(fd, data->server);
+        close(fd);
+    }
+    return NULL;
+}
+
+/* metrics_serve()
+ * ---------------
+ * Reads an HTTP request from a metrics client and responds with the metrics
+ * page if it asked for /metrics (or /), or a 404 if it asked for anything
+ * else.
+ *
+ * fd: the metrics client's socket
+ * server: ServerContext struct with the stats to serve
+ */
+void metrics_serve(int fd, ServerContext* server) {
+    char request[MAX_HTTP_REQUEST + 1];
+    size_t length = 0;
+    ssize_t numRead;
+
+    // Read the request up to the blank line that ends its headers
+    request[0] = '\0';
+    while (length < MAX_HTTP_REQUEST && !strstr(request, "\r\n\r\n")
+            && (numRead = read(fd, request + length,
+            MAX_HTTP_REQUEST - length)) > 0) {
+        length += numRead;
+        request[length] = '\0';
+    }
+
+    char header[MAX_HTTP_REQUEST];
+    if (strncmp(request, "GET /metrics ", 13) == 0
+            || strncmp(request, "GET / ", 6) == 0) {
+        size_t pageLength;
+        char* page = metrics_page(server, &pageLength);
+        int headerLength = sprintf(header, HTTP_HEADER, "200 OK", pageLength);
+        if (send_all(fd, header, headerLength)) {
+            send_all(fd, page, pageLength);
+        }
+        free(page);
+    } else {
+        const char* page = "Not Found\n";
+        int headerLength = sprintf(header, HTTP_HEADER, "404 Not Found",
+                strlen(page));
+        if (send_all(fd, header, headerLength)) {
+            send_all(fd, page, strlen(page));
+        }
+    }
+}
+
+/* metrics_page()
+ * --------------
+ * Builds the metrics page in the Prometheus text format. It has every stat
+ * from the SIGHUP report, the crack workers that are busy and the crack queue
+ * depth, the running submitted jobs (of every prefork worker process), the
+ * crypt() call rates and the size of the dictionary.
+ *
+ * server: ServerContext struct with the stats to serve
+ * length: set to the length of the page
+ *
+ * Returns: the page, which the caller must free
+ */
+char* metrics_page(ServerContext* server, size_t* length) {
+    StatsSnapshot* snapshot = malloc(sizeof(StatsSnapshot));
+    char* page;
+    FILE* out = open_memstream(&page, length);
+
+    stats_snapshot(server->stats, snapshot);
+    uint64_t now = now_micros();
+    metrics_write(out, "connected_clients", "gauge",
+            "Clients that are connected", snapshot->numConnected);
+    metrics_write(out, "completed_clients_total", "counter",
+            "Clients that have disconnected", snapshot->numCompleted);
+    metrics_write(out, "crack_requests_total", "counter",
+            "Crack requests received", snapshot->cracks);
+    metrics_write(out, "failed_crack_requests_total", "counter",
+            "Crack requests that found no word", snapshot->failedCracks);
+    metrics_write(out, "successful_crack_requests_total", "counter",
+            "Crack requests that found a word", snapshot->successCracks);
+    metrics_write(out, "crypt_requests_total", "counter",
+            "Crypt requests received", snapshot->crypts);
+    metrics_write(out, "crypt_calls_total", "counter",
+            "Words hashed", snapshot->cryptCalls);
+    metrics_write(out, "salt_index_hits_total", "counter",
+            "Crack requests answered from an index", snapshot->indexHits);
+    metrics_write(out, "salt_index_misses_total", "counter",
+            "Crack requests whose salt wasn't indexed", snapshot->indexMisses);
+    metrics_write(out, "potfile_hits_total", "counter",
+            "Cipher texts answered from the potfile", snapshot->potfileHits);
+    metrics_write(out, "response_cache_hits_total", "counter",
+            "Requests answered from the response cache", snapshot->cacheHits);
+    metrics_write(out, "response_cache_misses_total", "counter",
+            "Requests looked up in the response cache but not found",
+            snapshot->cacheMisses);
+    metrics_write(out, "resumed_jobs_total", "counter",
+            "Submitted jobs resumed from a checkpoint", snapshot->resumedJobs);
+    metrics_write(out, "resumed_candidates_total", "counter",
+            "Candidates that resumed jobs had hashed before the restart",
+            snapshot->resumedCalls);
+    metrics_write(out, "words_per_successful_crack", "gauge",
+            "Average words hashed per successful crack",
+            snapshot->solvedCracks ? (double)snapshot->solvedCalls
+            / snapshot->solvedCracks : 0.0);
+    metrics_write_latencies(out, snapshot);
+
+    fprintf(out, "# HELP crackserver_crypt_calls_per_second Words hashed "
+            "per second\n# TYPE crackserver_crypt_calls_per_second gauge\n");
+    int windows[] = {1, 10, 60};
+    for (int i = 0; i < 3; i++) {
+        fprintf(out, "crackserver_crypt_calls_per_second{window=\"%ds\"} "
+                "%.0f\n", windows[i], stats_crypt_rate(server->stats,
+                windows[i], now, snapshot->cryptCalls));
+    }
+
+    metrics_write_pool(out, server);
+    metrics_write(out, "submitted_jobs_running", "gauge",
+            "Submitted jobs that haven't finished", __atomic_load_n(
+            &server->jobs->statuses->numRunning, __ATOMIC_RELAXED));
+    DictionaryVersion* version = dictionary_acquire(server);
+    metrics_write(out, "dictionary_words", "gauge", "Words in the dictionary",
+            version->dict.numWords);
+    metrics_write(out, "dictionary_bytes", "gauge",
+            "Memory used by the dictionary", version->dict.numBytes);
+    metrics_write(out, "dictionary_duplicates", "gauge",
+            "Words left out because crypt() hashes them like another word",
+            version->dict.numDuplicates);
+    metrics_write(out, "dictionary_generation", "gauge",
+            "Times the dictionary has been reloaded or re-sorted",
+            version->generation);
+    dictionary_release(version);
+    fclose(out);
+    free(snapshot);
+    return page;
+}
+
+/* metrics_write()
+ * ---------------
+ * Writes one unlabelled metric to the metrics page, with its help and type.
+ *
+ * out: the metrics page
+ * name: name of the metric, without the crackserver_ prefix
+ * type: the Prometheus type (counter or gauge)
+ * help: description of the metric
+ * value: value of the metric
+ */
+void metrics_write(FILE* out, const char* name, const char* type,
+        const char* help, double value) {
+    fprintf(out, "# HELP crackserver_%s %s\n# TYPE crackserver_%s %s\n"
+            "crackserver_%s %.17g\n", name, help, name, type, name, value);
+}
+
+/* metrics_write_latencies()
+ * -------------------------
+ * Writes the latency histograms to the metrics page as a Prometheus summary,
+ * with the 50th, 90th and 99th percentiles labelled by kind of latency.
+ *
+ * out: the metrics page
+ * snapshot: totals of the stats, including the latency histograms
+ */
+void metrics_write_latencies(FILE* out, StatsSnapshot* snapshot) {
+    const char* kinds[NUM_LATENCIES] = {"crack", "crackbatch", "crack_queue",
+            "crypt"};
+    double quantiles[] = {0.5, 0.9, 0.99};
+
+    fprintf(out, "# HELP crackserver_latency_microseconds Time taken to "
+            "answer requests\n# TYPE crackserver_latency_microseconds "
+            "summary\n");
+    for (int kind = 0; kind < NUM_LATENCIES; kind++) {
+        const uint64_t* counts = snapshot->latencies[kind];
+        uint64_t count = 0;
+        for (int i = 0; i < NUM_LATENCY_BUCKETS; i++) {
+            count += counts[i];
+        }
+        for (int i = 0; i < 3; i++) {
+            fprintf(out, "crackserver_latency_microseconds{kind=\"%s\","
+                    "quantile=\"%g\"} %lu\n", kinds[kind], quantiles[i],
+                    (unsigned long)latency_percentile(counts, count,
+                    snapshot->maxLatency[kind], quantiles[i]));
+        }
+        fprintf(out, "crackserver_latency_microseconds_sum{kind=\"%s\"} "
+                "%lu\ncrackserver_latency_microseconds_count{kind=\"%s\"} "
+                "%lu\n", kinds[kind],
+                (unsigned long)snapshot->latencySum[kind], kinds[kind],
+                (unsigned long)count);
+    }
+}
+
+/* metrics_write_pool()
+ * --------------------
+ * Writes the crack worker pool's gauges to the metrics page - the crack
+ * workers, how many are busy and the crack queue depth. The crack scheduler's
+ * fields are read without taking its lock. Prefork worker processes each have
+ * their own pool, so every worker's gauges (as last published, after this
+ * worker publishes its own) are written with a worker label.
+ *
+ * out: the metrics page
+ * server: ServerContext struct with the pool and stats
+ */
+void metrics_write_pool(FILE* out, ServerContext* server) {
+    const char* names[NUM_POOL_GAUGES] = {"crack_workers",
+            "crack_workers_busy", "crack_queue_depth"};
+    const char* helps[NUM_POOL_GAUGES] = {"Crack worker threads",
+            "Crack workers running a chunk",
+            "Crack tasks waiting for a worker"};
+    CrackPool* pool = server->pool;
+    int64_t gauges[NUM_POOL_GAUGES] = {pool->numWorkers,
+            __atomic_load_n(&pool->numBusy, __ATOMIC_RELAXED),
+            __atomic_load_n(&pool->queueDepth, __ATOMIC_RELAXED)};
+
+    if (server->worker < 0) {
+        for (int gauge = 0; gauge < NUM_POOL_GAUGES; gauge++) {
+            metrics_write(out, names[gauge], "gauge", helps[gauge],
+                    gauges[gauge]);
+        }
+        return;
+    }
+    stats_publish_pool(server->stats, server->worker, pool);
+    for (int gauge = 0; gauge < NUM_POOL_GAUGES; gauge++) {
+        fprintf(out, "# HELP crackserver_%s %s\n# TYPE crackserver_%s gauge\n",
+                names[gauge], helps[gauge], names[gauge]);
+        for (int worker = 0; worker < MAX_WORKERS; worker++) {
+            int64_t* published = server->stats->workerGauges[worker];
+            // Every running worker has at least one crack worker
+            if (__atomic_load_n(&published[GAUGE_CRACK_WORKERS],
+                    __ATOMIC_RELAXED)) {
+                fprintf(out, "crackserver_%s{worker=\"%d\"} %ld\n",
+                        names[gauge], worker, __atomic_load_n(
+                        &published[gauge], __ATOMIC_RELAXED));
+            }
+        }
+    }
+}
+
+/* send_all()
+ * ----------
+ * Sends all of a buffer to a socket, retrying after short sends.
+ *
+ * fd: socket to send to
+ * data: data to send
+ * length: number of bytes to send
+ *
+ * Returns: whether everything was sent
+ */
+bool send_all(int fd, const char* data, size_t length) {
+    while (length) {
+        ssize_t sent = send(fd, data, length, MSG_NOSIGNAL);
+        if (sent <= 0) {
+            return false;
+        }
+        data += sent;
+        length -= sent;
+    }
+    return true;
+}
+
+/* now_micros()
+ * ------------
+ * Reads the monotonic clock, which is used to time requests.
+ *
+ * Returns: the time in microseconds
+ */
+uint64_t now_micros(void) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * MICROS_PER_SECOND + now.tv_nsec / 1000;
 }
 
 /* stats_add_connection()
  * ----------------------
- * Increments the total number of active connections by 1. Uses wait and post
- * to ensure only 1 thread is modifying the struct at a time.
+ * Increments the total number of active connections by 1.
  *
  * stats: Statistics struct that contains all of the server statistics
  */
 void stats_add_connection(Statistics* stats) {
-    sem_wait(stats->lock);
-    stats->numConnected++;
-    sem_post(stats->lock);
+    stats_add(stats, STAT_CONNECTIONS, 1);
 }
 
 /* stats_complete_connection()
  * ---------------------------
  * Decrements the total number of active connctions by 1, and increases the 
- * total number of completed connections by 1. Uses wait and post to ensure
- * that only 1 thread is  modifying the struct at a time.
+ * total number of completed connections by 1.
  *
  * stats: Statistics struct that contains all of the server statistics
  */
 void stats_complete_connection(Statistics* stats) {
-    sem_wait(stats->lock);
-    stats->numConnected--;
-    stats->numCompleted++;
-    sem_post(stats->lock);
+    stats_add(stats, STAT_COMPLETED, 1);
+}
+
+/* stats_worker_connection()
+ * -------------------------
+ * Adds to the number of connections open in a prefork worker process, so
+ * that its parent can count them as completed if the worker exits.
+ *
+ * stats: Statistics struct that contains all of the server statistics
+ * worker: number of the worker process, or -1 if this isn't one
+ * change: 1 for a connection that was accepted, -1 for one that was closed
+ */
+void stats_worker_connection(Statistics* stats, int worker, int change) {
+    if (worker >= 0) {
+        __atomic_add_fetch(&stats->workerConnections[worker], change,
+                __ATOMIC_RELAXED);
+    }
 }
 
 /* stats_add_crack_request()
  * -------------------------
- * Increments the total number of crack requests by 1. Uses wait and post to 
- * ensure that only 1 thread is modifying the struct at a time.
+ * Increments the total number of crack requests by 1.
  *
  * stats: Statistics struct that contains all of the server statistics
  */
 void stats_add_crack_request(Statistics* stats) {
-    sem_wait(stats->lock);
-    stats->cracks++;
-    sem_post(stats->lock);
+    stats_add(stats, STAT_CRACKS, 1);
 }
 
 /* stats_add_crypt_request()
  * -------------------------
- * Increments the total number of crypt requests by 1. Uses wait and post to
- * ensure that only 1 thread is modifying the struct at a time.
+ * Increments the total number of crypt requests by 1.
  *
  * stats: Statistics struct that contains all of the server statistics
  */
 void stats_add_crypt_request(Statistics* stats) {
-    sem_wait(stats->lock);
-    stats->crypts++;
-    sem_post(stats->lock);
+    stats_add(stats, STAT_CRYPTS, 1);
 }
 
-/* stats_add_crypt_request()
- * -------------------------
+/* stats_add_crypt_call()
+ * ----------------------
  * Adds the given number to the total number of crypt and crypt_r calls made
- * by the server. Uses wait and post to ensure that only 1 thread is modifying
- * the struct at a time.
+ * by the server.
  *
  * stats: Statistics struct that contains all of the server statistics
  * num: the number of crypt and crypt_r calls to be added to the stats
  */
-void stats_add_crypt_call(Statistics* stats, int num) {
-    sem_wait(stats->lock);
-    stats->cryptCalls += num;
-    sem_post(stats->lock);
+void stats_add_crypt_call(Statistics* stats, uint64_t num) {
+    stats_add(stats, STAT_CRYPT_CALLS, num);
+}
+
+/* stats_add_index_hit()
+ * ---------------------
+ * Increments the number of crack requests that were answered from the salt
+ * index by 1.
+ *
+ * stats: Statistics struct that contains all of the server statistics
+ */
+void stats_add_index_hit(Statistics* stats) {
+    stats_add(stats, STAT_INDEX_HITS, 1);
+}
+
+/* stats_add_index_miss()
+ * ----------------------
+ * Increments the number of crack requests whose salt was not in the salt
+ * index by 1.
+ *
+ * stats: Statistics struct that contains all of the server statistics
+ */
+void stats_add_index_miss(Statistics* stats) {
+    stats_add(stats, STAT_INDEX_MISSES, 1);
 }
 
 /* stats_add_crack_request_pass()
  * ------------------------------
- * Increments the total number of passed crack requests by 1. Uses wait and 
- * post to ensure that only 1 thread is modifying the struct at a time.
+ * Increments the total number of passed crack requests by 1.
  *
  * stats: Statistics struct that contains all of the server statistics
  */
 void stats_add_crack_request_pass(Statistics* stats) {
-    sem_wait(stats->lock);
-    stats->successCracks++;
-    sem_post(stats->lock);
+    stats_add(stats, STAT_SUCCESS_CRACKS, 1);
 }
 
 /* stats_add_crack_request_fail()
  * ------------------------------
- * Increments the total number of failed crack requests by 1. Uses wait and
- * post to ensure that only 1 thread is modifying the struct at a time.
+ * Increments the total number of failed crack requests by 1.
  *
  * stats: Statistics struct that contains all of the server statistics
  */
 void stats_add_crack_request_fail(Statistics* stats) {
-    sem_wait(stats->lock);
-    stats->failedCracks++;
-    sem_post(stats->lock);
+    stats_add(stats, STAT_FAILED_CRACKS, 1);
 }
 
 /* valid_salt()
@@ -785,6 +5873,21 @@ bool valid_salt(char* salt) {
     return true;
 }
 
+/* valid_cipher_text()
+ * -------------------
+ * Checks whether some cipher text could be cracked - it must be the length
+ * of a crypt() hash and start with a valid salt.
+ *
+ * cipherText: cipher text to check
+ *
+ * Returns: true if the cipher text is valid, false if not
+ */
+bool valid_cipher_text(char* cipherText) {
+    return strlen(cipherText) == CIPHER_LENGTH
+            && valid_salt_character(cipherText[0])
+            && valid_salt_character(cipherText[1]);
+}
+
 // Checking if the salt is a valid character
 // ASCII values are used to check if number or . or /
 /* valid_salt_character()
@@ -824,57 +5927,104 @@ bool valid_thread_num(char* numThreads) {
     return true;
 }
 
+/* parse_crack_options()
+ * ---------------------
+ * Parses the arguments that follow a crack command's cipher text - the number
+ * of threads, which can be followed by rules=<name> to name a rule set.
+ *
+ * args: the arguments
+ * numThreads: set to the number of threads
+ * rules: set to the rule set, or null if none was named
+ *
+ * Returns: whether the arguments were valid
+ */
+bool parse_crack_options(char* args, int* numThreads, const RuleSet** rules) {
+    char** parts = split_by_char(args, ' ', 2);
+    bool valid = valid_thread_num(parts[0]);
+
+    *rules = NULL;
+    if (valid && parts[1] != NULL) {
+        valid = strncmp(parts[1], "rules=", strlen("rules=")) == 0
+                && (*rules = find_rule_set(parts[1] + strlen("rules=")));
+    }
+    *numThreads = atoi(parts[0]);
+    free(parts);
+    return valid;
+}
+
+/* parse_mask_options()
+ * --------------------
+ * Parses the arguments that follow a crackmask command's cipher text - the
+ * mask and the number of threads. A mask can't have a space in it (?s covers
+ * spaces).
+ *
+ * args: the arguments
+ * numThreads: set to the number of threads
+ *
+ * Returns: the mask (to be freed by the caller), or null if the arguments
+ * weren't valid
+ */
+CrackMask* parse_mask_options(char* args, int* numThreads) {
+    char** parts = split_by_char(args, ' ', 2);
+    CrackMask* mask = malloc(sizeof(CrackMask));
+
+    mask->cursor = 0;
+    if (parts[1] == NULL || !valid_thread_num(parts[1])
+            || !parse_mask(parts[0], &mask->mask)) {
+        free(mask);
+        free(parts);
+        return NULL;
+    }
+    *numThreads = atoi(parts[1]);
+    free(parts);
+    return mask;
+}
+
 /* fill_dictionary()
  * -----------------
  * Creates a Dictionary struct containing all of the words contained in a given
  * dictionary file name. If this given file name is invalid, an error will be
  * thrown. Additionally, if this file doesn't contain any valid dictionary
- * words an error will be thrown.
+ * words an error will be thrown. Words that crypt() can't tell apart from an
+ * earlier word are left out, since cracks would only hash them again.
  *
  * dictName: name of the dictionary chosen
+ * truncate: whether words that are too long are truncated (or skipped)
  *
  * Returns: Dictionary struct containing the words and the number of words
  */
-Dictionary fill_dictionary(char* dictName) {
-    Dictionary param = {.words = NULL, .numWords = 0};
-    param.words = malloc(0);
-    char* line;
-    
-    FILE* dictFileStream = fopen(dictName, "r");
+Dictionary fill_dictionary(char* dictName, bool truncate) {
+    Dictionary param;
+    DictionaryStatus status = read_dictionary(dictName,
+            DICTIONARY_DEDUP | (truncate ? DICTIONARY_TRUNCATE : 0), &param);
 
-    if (!dictFileStream) {
-        free(param.words);
+    if (status == DICTIONARY_UNREADABLE) {
         dictionary_error(dictName);
-    }
-    while ((line = read_line(dictFileStream))) {
-        if (strlen(line) > MAX_WORD_LENGTH) {
-            free(line);
-            continue;
-        }
-        param.numWords++;
-        param.words = realloc(param.words, param.numWords * sizeof(char*));
-        param.words[param.numWords - 1] = line;
-    }
-    if (!param.numWords) {
-        free(param.words);
+    } else if (status == DICTIONARY_EMPTY) {
         empty_dictionary_error();
     }
-
-
     return param;
 } 
 
-/* free_dictionary()
- * -----------------
- * Frees all of the memory allocated for a dictionary struct.
- * 
- * dict: Dictionary struct to be freed
+/* map_index_file()
+ * ----------------
+ * Memory-maps a precomputed index file made by crackindex. If the file can't
+ * be used, or wasn't built from the same dictionary, an error will be thrown.
+ *
+ * indexName: name of the index file
+ * dict: Dictionary struct that the server is using
+ *
+ * Returns: the mapped index file
  */
-void free_dictionary(Dictionary dict) {
-    for (int i = 0; i < dict.numWords; i++) {
-        free(dict.words[i]);
+IndexFile* map_index_file(char* indexName, Dictionary* dict) {
+    IndexFile* indexFile = malloc(sizeof(IndexFile));
+
+    if (open_index_file(indexName, dict, indexFile) != INDEX_FILE_OK) {
+        free(indexFile);
+        free_dictionary(*dict);
+        index_file_error(indexName);
     }
-    free(dict.words);
+    return indexFile;
 }
 
 /* string_to_number()
@@ -931,13 +6081,100 @@ int validate_max_connections(int maxConns) {
     return maxConns;
 }
 
+/* validate_index_memory()
+ * ------------------------
+ * Validates the number of megabytes that the salt index cache may use. The
+ * number must not be negative (0 turns the salt index off). If the number is
+ * invalid, a usage error will be thrown.
+ *
+ * indexMemory: number to validate
+ *
+ * Returns: the number of megabytes
+ */
+int validate_index_memory(int indexMemory) {
+    if (indexMemory < 0) {
+        usage_error();
+    }
+    return indexMemory;
+}
+
+/* validate_cache_entries()
+ * ------------------------
+ * Checks that the number of responses to cache is valid (0 turns the
+ * response cache off). If it isn't, it prints a usage error and exits.
+ *
+ * cacheEntries: number of responses to cache
+ *
+ * Returns: the number of responses to cache
+ */
+int validate_cache_entries(int cacheEntries) {
+    if (cacheEntries < 0) {
+        usage_error();
+    }
+    return cacheEntries;
+}
+
+/* validate_retained_jobs()
+ * ------------------------
+ * Validates the number of submitted jobs to keep. The number must be at least
+ * 1. If the number is invalid, a usage error will be thrown.
+ *
+ * retainedJobs: number to validate
+ *
+ * Returns: the number of submitted jobs to keep
+ */
+int validate_retained_jobs(int retainedJobs) {
+    if (retainedJobs < 1) {
+        usage_error();
+    }
+    return retainedJobs;
+}
+
+/* validate_workers()
+ * ------------------
+ * Validates the number of prefork worker processes, which must be between 1
+ * and MAX_WORKERS. If the number is invalid, a usage error will be thrown.
+ *
+ * numWorkers: the number of worker processes
+ *
+ * Returns: the number of worker processes
+ */
+int validate_workers(int numWorkers) {
+    if (numWorkers < 1 || numWorkers > MAX_WORKERS) {
+        usage_error();
+    }
+    return numWorkers;
+}
+
+/* validate_cores()
+ * ----------------
+ * Validates the number of cores that crack work may run on at once. The
+ * number must be at least 1. If the number is invalid, a usage error will be
+ * thrown.
+ *
+ * numCores: number to validate
+ *
+ * Returns: the number of cores
+ */
+int validate_cores(int numCores) {
+    if (numCores < 1) {
+        usage_error();
+    }
+    return numCores;
+}
+
 /* usage_error()
  * -------------
  * Prints the usage error to stderr and exits with the appropriate status.
  */
 void usage_error() {
     fprintf(stderr, "Usage: crackserver [--maxconn connections] [--port "\
-            "portnum] [--dictionary filename]\n");
+            "portnum] [--dictionary filename] [--index-memory megabytes] "\
+            "[--index filename] [--cores count] [--metrics-port port] "\
+            "[--potfile filename] [--cache entries] "\
+            "[--long-words skip|truncate] [--jobs count] "\
+            "[--order file|frequency] [--weights filename] "\
+            "[--state dirname] [--workers count]\n");
     exit(USAGE_ERROR);
 }
 
@@ -962,6 +6199,59 @@ void empty_dictionary_error() {
     exit(NO_WORDS_ERROR);
 }
 
+/* index_file_error()
+ * ------------------
+ * Prints an error to stderr if the index file couldn't be used (unreadable,
+ * not an index file or built from a different dictionary), and exits with the
+ * appropriate status.
+ *
+ * indexName: name of the index file
+ */
+void index_file_error(char* indexName) {
+    fprintf(stderr, "crackserver: unable to use index file \"%s\"\n",
+            indexName);
+    exit(INDEX_FILE_ERROR);
+}
+
+/* potfile_error()
+ * ---------------
+ * Prints an error to stderr if the potfile couldn't be opened for reading and
+ * appending, and exits with the appropriate status.
+ *
+ * potfileName: name of the potfile
+ */
+void potfile_error(char* potfileName) {
+    fprintf(stderr, "crackserver: unable to use potfile \"%s\"\n",
+            potfileName);
+    exit(POTFILE_ERROR);
+}
+
+/* weights_file_error()
+ * --------------------
+ * Prints an error to stderr if the word weights file couldn't be opened, and
+ * exits with the appropriate status.
+ *
+ * weightsName: name of the weights file
+ */
+void weights_file_error(char* weightsName) {
+    fprintf(stderr, "crackserver: unable to open weights file \"%s\"\n",
+            weightsName);
+    exit(WEIGHTS_FILE_ERROR);
+}
+
+/* state_dir_error()
+ * -----------------
+ * Prints an error to stderr if the state directory couldn't be created or
+ * written to, and exits with the appropriate status.
+ *
+ * stateName: name of the state directory
+ */
+void state_dir_error(char* stateName) {
+    fprintf(stderr, "crackserver: unable to use state directory \"%s\"\n",
+            stateName);
+    exit(STATE_DIR_ERROR);
+}
+
 /* unable_listen_erro()
  * -------------
  * Prints a message to stderr if a socket is unabled to be opened for
@@ -0,0 +1,386 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "descrypt.h"
+
+// Number of key bits used (7 bits from each of the first 8 characters), DES
+// rounds and the number of times crypt() runs DES
+#define DES_KEY_BITS 56
+#define DES_KEY_CHARS 8
+#define DES_CHAR_BITS 7
+#define DES_ROUNDS 16
+#define DES_ITERATIONS 25
+#define DES_HALF_KEY_BITS 28
+#define DES_SALT_BITS 12
+
+// Bits per encoded hash character and number of encoded characters
+#define DES_ENCODED_BITS 6
+#define DES_ENCODED_LENGTH 11
+
+// Number of 64-bit words in the widest vector
+#define DES_MAX_WORDS (DES_MAX_BATCH / 64)
+
+// Engine that hashes one batch - see descrypt_engine.h
+typedef void (*DesEngineFunction)(const uint64_t* keyBits,
+        const int* expansion, uint64_t* outBits);
+
+// Engine that is in use and the number of 64-bit words in its vectors
+typedef struct {
+    const char* name;
+    int words;
+    DesEngineFunction run;
+} DesEngine;
+
+// Final permutation
+static const uint8_t desFP[DES_BLOCK_BITS] = {
+    40, 8, 48, 16, 56, 24, 64, 32, 39, 7, 47, 15, 55, 23, 63, 31,
+    38, 6, 46, 14, 54, 22, 62, 30, 37, 5, 45, 13, 53, 21, 61, 29,
+    36, 4, 44, 12, 52, 20, 60, 28, 35, 3, 43, 11, 51, 19, 59, 27,
+    34, 2, 42, 10, 50, 18, 58, 26, 33, 1, 41, 9, 49, 17, 57, 25
+};
+
+// E-expansion of the right half
+static const uint8_t desE[DES_EXPANSION_BITS] = {
+    32, 1, 2, 3, 4, 5, 4, 5, 6, 7, 8, 9,
+    8, 9, 10, 11, 12, 13, 12, 13, 14, 15, 16, 17,
+    16, 17, 18, 19, 20, 21, 20, 21, 22, 23, 24, 25,
+    24, 25, 26, 27, 28, 29, 28, 29, 30, 31, 32, 1
+};
+
+// Inverse of the P permutation - where each S-box output bit ends up
+static const uint8_t desPInverse[DES_BLOCK_BITS / 2] = {
+    8, 16, 22, 30, 12, 27, 1, 17, 23, 15, 29, 5, 25, 19, 9, 0,
+    7, 13, 24, 2, 3, 28, 10, 18, 31, 11, 21, 6, 4, 26, 14, 20
+};
+
+// Permuted choice 1 and 2 and the rotations of the key schedule
+static const uint8_t desPC1[DES_KEY_BITS] = {
+    57, 49, 41, 33, 25, 17, 9, 1, 58, 50, 42, 34, 26, 18,
+    10, 2, 59, 51, 43, 35, 27, 19, 11, 3, 60, 52, 44, 36,
+    63, 55, 47, 39, 31, 23, 15, 7, 62, 54, 46, 38, 30, 22,
+    14, 6, 61, 53, 45, 37, 29, 21, 13, 5, 28, 20, 12, 4
+};
+
+static const uint8_t desPC2[DES_EXPANSION_BITS] = {
+    14, 17, 11, 24, 1, 5, 3, 28, 15, 6, 21, 10,
+    23, 19, 12, 4, 26, 8, 16, 7, 27, 20, 13, 2,
+    41, 52, 31, 37, 47, 55, 30, 40, 51, 45, 33, 48,
+    44, 49, 39, 56, 34, 53, 46, 42, 50, 36, 29, 32
+};
+
+static const uint8_t desRotations[DES_ROUNDS] = {
+    1, 1, 2, 2, 2, 2, 2, 2, 1, 2, 2, 2, 2, 2, 2, 1
+};
+
+// S-boxes, indexed by row * 16 + column
+static const uint8_t desSBoxes[8][64] = {
+    {14, 4, 13, 1, 2, 15, 11, 8, 3, 10, 6, 12, 5, 9, 0, 7,
+    0, 15, 7, 4, 14, 2, 13, 1, 10, 6, 12, 11, 9, 5, 3, 8,
+    4, 1, 14, 8, 13, 6, 2, 11, 15, 12, 9, 7, 3, 10, 5, 0,
+    15, 12, 8, 2, 4, 9, 1, 7, 5, 11, 3, 14, 10, 0, 6, 13},
+    {15, 1, 8, 14, 6, 11, 3, 4, 9, 7, 2, 13, 12, 0, 5, 10,
+    3, 13, 4, 7, 15, 2, 8, 14, 12, 0, 1, 10, 6, 9, 11, 5,
+    0, 14, 7, 11, 10, 4, 13, 1, 5, 8, 12, 6, 9, 3, 2, 15,
+    13, 8, 10, 1, 3, 15, 4, 2, 11, 6, 7, 12, 0, 5, 14, 9},
+    {10, 0, 9, 14, 6, 3, 15, 5, 1, 13, 12, 7, 11, 4, 2, 8,
+    13, 7, 0, 9, 3, 4, 6, 10, 2, 8, 5, 14, 12, 11, 15, 1,
+    13, 6, 4, 9, 8, 15, 3, 0, 11, 1, 2, 12, 5, 10, 14, 7,
+    1, 10, 13, 0, 6, 9, 8, 7, 4, 15, 14, 3, 11, 5, 2, 12},
+    {7, 13, 14, 3, 0, 6, 9, 10, 1, 2, 8, 5, 11, 12, 4, 15,
+    13, 8, 11, 5, 6, 15, 0, 3, 4, 7, 2, 12, 1, 10, 14, 9,
+    10, 6, 9, 0, 12, 11, 7, 13, 15, 1, 3, 14, 5, 2, 8, 4,
+    3, 15, 0, 6, 10, 1, 13, 8, 9, 4, 5, 11, 12, 7, 2, 14},
+    {2, 12, 4, 1, 7, 10, 11, 6, 8, 5, 3, 15, 13, 0, 14, 9,
+    14, 11, 2, 12, 4, 7, 13, 1, 5, 0, 15, 10, 3, 9, 8, 6,
+    4, 2, 1, 11, 10, 13, 7, 8, 15, 9, 12, 5, 6, 3, 0, 14,
+    11, 8, 12, 7, 1, 14, 2, 13, 6, 15, 0, 9, 10, 4, 5, 3},
+    {12, 1, 10, 15, 9, 2, 6, 8, 0, 13, 3, 4, 14, 7, 5, 11,
+    10, 15, 4, 2, 7, 12, 9, 5, 6, 1, 13, 14, 0, 11, 3, 8,
+    9, 14, 15, 5, 2, 8, 12, 3, 7, 0, 4, 10, 1, 13, 11, 6,
+    4, 3, 2, 12, 9, 5, 15, 10, 11, 14, 1, 7, 6, 0, 8, 13},
+    {4, 11, 2, 14, 15, 0, 8, 13, 3, 12, 9, 7, 5, 10, 6, 1,
+    13, 0, 11, 7, 4, 9, 1, 10, 14, 3, 5, 12, 2, 15, 8, 6,
+    1, 4, 11, 13, 12, 3, 7, 14, 10, 15, 6, 8, 0, 5, 9, 2,
+    6, 11, 13, 8, 1, 4, 10, 7, 9, 5, 0, 15, 14, 2, 3, 12},
+    {13, 2, 8, 4, 6, 15, 11, 1, 10, 9, 3, 14, 5, 0, 12, 7,
+    1, 15, 13, 8, 10, 3, 7, 4, 12, 5, 6, 11, 0, 14, 9, 2,
+    7, 11, 4, 1, 9, 12, 14, 2, 0, 6, 10, 13, 15, 3, 5, 8,
+    2, 1, 14, 7, 4, 10, 8, 13, 15, 12, 9, 0, 3, 5, 6, 11}
+};
+
+// Which of the DES_KEY_BITS key bit vectors feeds each bit of each round key.
+// Filled in by des_init().
+static uint8_t desKeySchedule[DES_ROUNDS][DES_EXPANSION_BITS];
+
+// One engine per vector width. The 64-bit engine uses plain integers and
+// works on any machine.
+typedef uint64_t DesVec64 __attribute__((vector_size(8)));
+#define DES_ENGINE des_engine_64
+#define DES_VEC DesVec64
+#include "descrypt_engine.h"
+#undef DES_ENGINE
+#undef DES_VEC
+
+#if defined(__x86_64__) || defined(__i386__)
+typedef uint64_t DesVec128 __attribute__((vector_size(16)));
+typedef uint64_t DesVec256 __attribute__((vector_size(32)));
+typedef uint64_t DesVec512 __attribute__((vector_size(64)));
+
+#pragma GCC push_options
+#pragma GCC target("sse2")
+#define DES_ENGINE des_engine_sse2
+#define DES_VEC DesVec128
+#include "descrypt_engine.h"
+#undef DES_ENGINE
+#undef DES_VEC
+#pragma GCC pop_options
+
+#pragma GCC push_options
+#pragma GCC target("avx2")
+#define DES_ENGINE des_engine_avx2
+#define DES_VEC DesVec256
+#include "descrypt_engine.h"
+#undef DES_ENGINE
+#undef DES_VEC
+#pragma GCC pop_options
+
+#pragma GCC push_options
+#pragma GCC target("avx512f")
+#define DES_ENGINE des_engine_avx512
+#define DES_VEC DesVec512
+#include "descrypt_engine.h"
+#undef DES_ENGINE
+#undef DES_VEC
+#pragma GCC pop_options
+#endif
+
+static DesEngine desEngine = {.name = "generic", .words = 1,
+        .run = des_engine_64};
+static pthread_once_t desInitOnce = PTHREAD_ONCE_INIT;
+
+/* des_setup()
+ * -----------
+ * Builds the key schedule and picks the widest engine that the processor
+ * supports. Only ever ran once, through des_init().
+ */
+static void des_setup(void) {
+    uint8_t halves[2][DES_HALF_KEY_BITS];
+    int shift = 0;
+
+    // Key bit vector used for each bit of PC1 - bit (8 * c + b) of the 64-bit
+    // key is bit (6 - b) of character c, as crypt() shifts each character
+    // left by one
+    for (int i = 0; i < DES_KEY_BITS; i++) {
+        int keyBit = desPC1[i] - 1;
+        halves[i / DES_HALF_KEY_BITS][i % DES_HALF_KEY_BITS] =
+                (keyBit / 8) * DES_CHAR_BITS + keyBit % 8;
+    }
+    for (int round = 0; round < DES_ROUNDS; round++) {
+        shift += desRotations[round];
+        for (int i = 0; i < DES_EXPANSION_BITS; i++) {
+            int bit = desPC2[i] - 1;
+            int half = bit / DES_HALF_KEY_BITS;
+            desKeySchedule[round][i] =
+                    halves[half][(bit % DES_HALF_KEY_BITS + shift)
+                    % DES_HALF_KEY_BITS];
+        }
+    }
+
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f")) {
+        desEngine = (DesEngine){.name = "avx512", .words = 8,
+                .run = des_engine_avx512};
+    } else if (__builtin_cpu_supports("avx2")) {
+        desEngine = (DesEngine){.name = "avx2", .words = 4,
+                .run = des_engine_avx2};
+    } else if (__builtin_cpu_supports("sse2")) {
+        desEngine = (DesEngine){.name = "sse2", .words = 2,
+                .run = des_engine_sse2};
+    }
+#endif
+}
+
+void des_init(void) {
+    pthread_once(&desInitOnce, des_setup);
+}
+
+const char* des_engine_name(void) {
+    des_init();
+    return desEngine.name;
+}
+
+int des_batch_size(void) {
+    des_init();
+    return desEngine.words * 64;
+}
+
+/* des_decode_char()
+ * -----------------
+ * Converts a character of the crypt alphabet to its 6-bit value.
+ *
+ * c: character to convert
+ *
+ * Returns: value of the character, or -1 if it is not in the alphabet
+ */
+static int des_decode_char(char c) {
+    const char* found = c ? strchr(DES_ALPHABET, c) : NULL;
+    return found ? (int)(found - DES_ALPHABET) : -1;
+}
+
+int des_salt_value(const char* salt) {
+    return des_decode_char(salt[0]) | des_decode_char(salt[1]) << 6;
+}
+
+/* des_salt_init()
+ * ---------------
+ * Works out the salted E-expansion for a salt. For every bit i that is set in
+ * the 12-bit salt, bits i and i + 24 of the E-expansion are swapped.
+ *
+ * salt: set to the decoded salt
+ * saltText: 2 character salt (assumed to be valid)
+ */
+void des_salt_init(DesSalt* salt, const char* saltText) {
+    int saltValue = des_salt_value(saltText);
+
+    for (int i = 0; i < DES_EXPANSION_BITS; i++) {
+        salt->expansion[i] = desE[i] - 1;
+    }
+    for (int i = 0; i < DES_SALT_BITS; i++) {
+        if (saltValue & (1 << i)) {
+            int swap = salt->expansion[i];
+            salt->expansion[i] = salt->expansion[i + DES_EXPANSION_BITS / 2];
+            salt->expansion[i + DES_EXPANSION_BITS / 2] = swap;
+        }
+    }
+}
+
+/* des_load_keys()
+ * ---------------
+ * Transposes candidate words into bitsliced form: bit b of character c of
+ * word w is stored as bit w of key vector (7 * c + (6 - b)).
+ *
+ * words: candidate words
+ * numWords: number of candidate words (at most the engine's batch size)
+ * keyBits: set to DES_KEY_BITS vectors of desEngine.words 64-bit words
+ */
+static void des_load_keys(char* const* words, int numWords,
+        uint64_t* keyBits) {
+    int stride = desEngine.words;
+
+    memset(keyBits, 0, sizeof(uint64_t) * DES_KEY_BITS * stride);
+    for (int w = 0; w < numWords; w++) {
+        const unsigned char* word = (const unsigned char*)words[w];
+        uint64_t laneBit = (uint64_t)1 << (w % 64);
+        uint64_t* lane = keyBits + w / 64;
+        for (int c = 0; c < DES_KEY_CHARS && word[c]; c++) {
+            for (int b = 0; b < DES_CHAR_BITS; b++) {
+                if (word[c] & (1 << (DES_CHAR_BITS - 1 - b))) {
+                    lane[(c * DES_CHAR_BITS + b) * stride] |= laneBit;
+                }
+            }
+        }
+    }
+}
+
+void des_target_init(DesTarget* target, const char* cipherText) {
+    int bits = 0;
+    uint64_t block = 0;
+
+    des_init();
+    target->impossible = false;
+    des_salt_init(&target->salt, cipherText);
+
+    // 11 characters of 6 bits hold the 64-bit block followed by 2 zero bits
+    for (int i = 0; i < DES_ENCODED_LENGTH; i++) {
+        int value = des_decode_char(cipherText[DES_SALT_LENGTH + i]);
+        if (value < 0) {
+            target->impossible = true;
+            return;
+        }
+        for (int b = DES_ENCODED_BITS - 1; b >= 0; b--, bits++) {
+            int bit = (value >> b) & 1;
+            if (bits < DES_BLOCK_BITS) {
+                block = block << 1 | bit;
+            } else if (bit) {
+                target->impossible = true;
+            }
+        }
+    }
+    target->block = block;
+}
+
+int des_crack_batch(const DesTarget* target, char* const* words,
+        int numWords) {
+    uint64_t keyBits[DES_KEY_BITS * DES_MAX_WORDS];
+    uint64_t outBits[DES_BLOCK_BITS * DES_MAX_WORDS];
+    int stride = desEngine.words;
+
+    if (target->impossible || numWords <= 0) {
+        return -1;
+    }
+    des_load_keys(words, numWords, keyBits);
+    desEngine.run(keyBits, target->salt.expansion, outBits);
+
+    // A lane matches if none of its bits differ from the target
+    for (int w = 0; w * 64 < numWords; w++) {
+        uint64_t differ = 0;
+        for (int i = 0; i < DES_BLOCK_BITS; i++) {
+            uint64_t want = (target->block >> (DES_BLOCK_BITS - 1 - i)) & 1
+                    ? ~(uint64_t)0 : 0;
+            differ |= outBits[i * stride + w] ^ want;
+        }
+        uint64_t match = ~differ;
+        if (numWords - w * 64 < 64) {
+            match &= ((uint64_t)1 << (numWords - w * 64)) - 1;
+        }
+        if (match) {
+            return w * 64 + __builtin_ctzll(match);
+        }
+    }
+    return -1;
+}
+
+void des_hash_batch(const DesSalt* salt, char* const* words, int numWords,
+        uint64_t* blocks) {
+    uint64_t keyBits[DES_KEY_BITS * DES_MAX_WORDS];
+    uint64_t outBits[DES_BLOCK_BITS * DES_MAX_WORDS];
+    int stride = desEngine.words;
+
+    des_init();
+    des_load_keys(words, numWords, keyBits);
+    desEngine.run(keyBits, salt->expansion, outBits);
+
+    // Transpose the bitsliced output back into one block per word
+    memset(blocks, 0, sizeof(uint64_t) * numWords);
+    for (int i = 0; i < DES_BLOCK_BITS; i++) {
+        for (int w = 0; w < numWords; w++) {
+            uint64_t bit = (outBits[i * stride + w / 64] >> (w % 64)) & 1;
+            blocks[w] |= bit << (DES_BLOCK_BITS - 1 - i);
+        }
+    }
+}
+
+void des_crypt_batch(char* const* words, int numWords, const char* salt,
+        char (*hashes)[DES_HASH_LENGTH + 1]) {
+    uint64_t blocks[DES_MAX_BATCH];
+    DesSalt decoded;
+
+    des_salt_init(&decoded, salt);
+    des_hash_batch(&decoded, words, numWords, blocks);
+
+    for (int w = 0; w < numWords; w++) {
+        char* hash = hashes[w];
+        hash[0] = salt[0];
+        hash[1] = salt[1];
+        // Pad the block with 2 zero bits to make 11 characters of 6 bits
+        for (int i = 0; i < DES_ENCODED_LENGTH; i++) {
+            int shift = DES_BLOCK_BITS - DES_ENCODED_BITS * (i + 1);
+            int value = shift >= 0 ? (blocks[w] >> shift) & 0x3f
+                    : (blocks[w] << -shift) & 0x3f;
+            hash[DES_SALT_LENGTH + i] = DES_ALPHABET[value];
+        }
+        hash[DES_HASH_LENGTH] = '\0';
+    }
+}
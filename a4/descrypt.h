@@ -0,0 +1,77 @@
+#ifndef DESCRYPT_H
+#define DESCRYPT_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Length of a traditional DES crypt() hash (2 salt characters followed by 11
+// characters of encoded output) and its salt
+#define DES_HASH_LENGTH 13
+#define DES_SALT_LENGTH 2
+
+// Characters used by salts and hashes, in order of their 6-bit values
+#define DES_ALPHABET "./0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZ"\
+    "abcdefghijklmnopqrstuvwxyz"
+
+// Most candidates that are hashed by a single call (AVX-512 engine)
+#define DES_MAX_BATCH 512
+
+// Number of bits in a DES block and in the E-expansion of half a block
+#define DES_BLOCK_BITS 64
+#define DES_EXPANSION_BITS 48
+
+// Number of different salts
+#define DES_NUM_SALTS 4096
+
+// A salt, decoded into which right half bit feeds each S-box input
+typedef struct {
+    int expansion[DES_EXPANSION_BITS];
+} DesSalt;
+
+// A cipher text that is being cracked, decoded once so that every batch can
+// be compared against it without going through strings. block holds the 64
+// bits that the last 11 characters encode. If impossible is set the cipher
+// text could never have been produced by crypt() (eg: it contains characters
+// outside of the crypt alphabet) so no word can match it.
+typedef struct {
+    DesSalt salt;
+    uint64_t block;
+    bool impossible;
+} DesTarget;
+
+// Chooses the widest engine that this processor supports. Safe to call more
+// than once and from multiple threads.
+void des_init(void);
+
+// Name of the engine in use (eg: "avx2") and the number of candidates that it
+// hashes per call
+const char* des_engine_name(void);
+int des_batch_size(void);
+
+// Number (0 to DES_NUM_SALTS - 1) of a valid 2 character salt
+int des_salt_value(const char* salt);
+
+// Decodes a valid 2 character salt
+void des_salt_init(DesSalt* salt, const char* saltText);
+
+// Prepares a cipher text for des_crack_batch(). The cipher text must be 13
+// characters long and start with a valid salt.
+void des_target_init(DesTarget* target, const char* cipherText);
+
+// Hashes up to des_batch_size() words with the target's salt. Returns the
+// index of the first word whose hash matches the target, or -1 if none do.
+int des_crack_batch(const DesTarget* target, char* const* words,
+        int numWords);
+
+// Hashes up to des_batch_size() words with the given salt, writing the 64-bit
+// block that each hash encodes to blocks
+void des_hash_batch(const DesSalt* salt, char* const* words, int numWords,
+        uint64_t* blocks);
+
+// Hashes up to des_batch_size() words with the given salt, writing each
+// 13 character hash (null terminated) to hashes. The output is identical to
+// crypt_r().
+void des_crypt_batch(char* const* words, int numWords, const char* salt,
+        char (*hashes)[DES_HASH_LENGTH + 1]);
+
+#endif
@@ -0,0 +1,126 @@
+/* Bitsliced DES crypt engine. This file is included once per vector width by
+ * descrypt.c, which defines the following before including it:
+ *
+ * DES_ENGINE: name of the engine function to create
+ * DES_VEC: vector type holding one bit of every candidate (one lane each)
+ *
+ * In bitsliced form every variable holds the same bit for all candidates, so
+ * DES is computed with nothing but AND, OR, XOR and NOT on whole vectors.
+ * Permutations (E, P, the key schedule and the salt) are just choices of which
+ * variable to read, and cost nothing.
+ */
+
+#ifndef DESCRYPT_ENGINE_MACROS
+#define DESCRYPT_ENGINE_MACROS
+
+// Bit o (0 is the most significant) of entry (row, col) of S-box s
+#define DES_SBOX_BIT(s, row, col, o) \
+    ((desSBoxes[s][(row) * 16 + (col)] >> (3 - (o))) & 1)
+
+// Minterm of column col if the S-box output bit is set for it. The S-boxes are
+// constant so the compiler drops every term that is not set.
+#define DES_TERM(s, o, row, col) (DES_SBOX_BIT(s, row, col, o) ? m[col] : zero)
+
+// Output bit o of S-box s for the candidates whose input is in the given row
+#define DES_ROW(s, o, row) \
+    (DES_TERM(s, o, row, 0) | DES_TERM(s, o, row, 1) | \
+    DES_TERM(s, o, row, 2) | DES_TERM(s, o, row, 3) | \
+    DES_TERM(s, o, row, 4) | DES_TERM(s, o, row, 5) | \
+    DES_TERM(s, o, row, 6) | DES_TERM(s, o, row, 7) | \
+    DES_TERM(s, o, row, 8) | DES_TERM(s, o, row, 9) | \
+    DES_TERM(s, o, row, 10) | DES_TERM(s, o, row, 11) | \
+    DES_TERM(s, o, row, 12) | DES_TERM(s, o, row, 13) | \
+    DES_TERM(s, o, row, 14) | DES_TERM(s, o, row, 15))
+
+// Output bit o of S-box s
+#define DES_OUT(s, o) \
+    ((DES_ROW(s, o, 0) & rows[0]) | (DES_ROW(s, o, 1) & rows[1]) | \
+    (DES_ROW(s, o, 2) & rows[2]) | (DES_ROW(s, o, 3) & rows[3]))
+
+// Runs S-box s of a round: mixes in the round key, looks up the S-box as a sum
+// of minterms and XORs the permuted (P) result into the left half
+#define DES_SBOX(s) do { \
+    for (int j = 0; j < 6; j++) { \
+        x[j] = r[expansion[6 * (s) + j]] ^ k[roundKey[6 * (s) + j]]; \
+        nx[j] = ~x[j]; \
+    } \
+    rows[0] = nx[0] & nx[5]; \
+    rows[1] = nx[0] & x[5]; \
+    rows[2] = x[0] & nx[5]; \
+    rows[3] = x[0] & x[5]; \
+    hi[0] = nx[1] & nx[2]; \
+    hi[1] = nx[1] & x[2]; \
+    hi[2] = x[1] & nx[2]; \
+    hi[3] = x[1] & x[2]; \
+    lo[0] = nx[3] & nx[4]; \
+    lo[1] = nx[3] & x[4]; \
+    lo[2] = x[3] & nx[4]; \
+    lo[3] = x[3] & x[4]; \
+    for (int c = 0; c < 16; c++) { \
+        m[c] = hi[c >> 2] & lo[c & 3]; \
+    } \
+    l[desPInverse[4 * (s)]] ^= DES_OUT(s, 0); \
+    l[desPInverse[4 * (s) + 1]] ^= DES_OUT(s, 1); \
+    l[desPInverse[4 * (s) + 2]] ^= DES_OUT(s, 2); \
+    l[desPInverse[4 * (s) + 3]] ^= DES_OUT(s, 3); \
+} while (0)
+
+#endif
+
+/* DES_ENGINE()
+ * ------------
+ * Encrypts a zero block DES_ITERATIONS times with every candidate's key, which
+ * is what traditional crypt() does.
+ *
+ * keyBits: DES_KEY_BITS vectors of key bits (see des_load_keys())
+ * expansion: salted E-expansion - which bit of the right half feeds each of
+ * the 48 S-box inputs
+ * outBits: set to the DES_BLOCK_BITS vectors of the final block, most
+ * significant bit first
+ */
+static void DES_ENGINE(const uint64_t* keyBits, const int* expansion,
+        uint64_t* outBits) {
+    DES_VEC k[DES_KEY_BITS];
+    DES_VEC block[DES_BLOCK_BITS];
+    DES_VEC x[6], nx[6], rows[4], hi[4], lo[4], m[16];
+    DES_VEC zero;
+
+    memset(&zero, 0, sizeof(zero));
+    memcpy(k, keyBits, sizeof(k));
+    memset(block, 0, sizeof(block));
+
+    // Initial permutation of a zero block is still zero, and the final and
+    // initial permutations between iterations cancel out, so only the halves
+    // need swapping
+    DES_VEC* l = block;
+    DES_VEC* r = block + DES_BLOCK_BITS / 2;
+    for (int iteration = 0; iteration < DES_ITERATIONS; iteration++) {
+        for (int round = 0; round < DES_ROUNDS; round++) {
+            const uint8_t* roundKey = desKeySchedule[round];
+            DES_SBOX(0);
+            DES_SBOX(1);
+            DES_SBOX(2);
+            DES_SBOX(3);
+            DES_SBOX(4);
+            DES_SBOX(5);
+            DES_SBOX(6);
+            DES_SBOX(7);
+            DES_VEC* t = l;
+            l = r;
+            r = t;
+        }
+        // DES does not swap the halves after the last round
+        DES_VEC* t = l;
+        l = r;
+        r = t;
+    }
+
+    // Final permutation of R16 L16
+    for (int i = 0; i < DES_BLOCK_BITS; i++) {
+        int from = desFP[i] - 1;
+        DES_VEC bit = from < DES_BLOCK_BITS / 2 ? l[from]
+                : r[from - DES_BLOCK_BITS / 2];
+        memcpy(outBits + i * (sizeof(DES_VEC) / sizeof(uint64_t)), &bit,
+                sizeof(DES_VEC));
+    }
+}
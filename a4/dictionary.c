@@ -0,0 +1,275 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include "dictionary.h"
+
+// FNV-1a 64-bit offset basis and prime
+#define FNV_OFFSET 14695981039346656037ULL
+#define FNV_PRIME 1099511628211ULL
+
+// Bytes to start with when reading a file whose size isn't known
+#define READ_SIZE 65536
+
+// Slots to start with in the set of words seen when removing duplicates. It
+// doubles whenever it is half full.
+#define MIN_SEEN_SLOTS 1024
+
+// Marks a slot in the set of words seen as used, since a word's key can be 0
+#define SEEN_USED (1ULL << 63)
+
+// Set of the keys of the words kept so far, with linear probing
+typedef struct {
+    uint64_t* slots;
+    size_t numSlots;
+    size_t numUsed;
+} SeenWords;
+
+static char* read_file(int fd, size_t* length);
+static uint64_t crypt_key(const char* word, size_t length);
+static bool seen_add(SeenWords* seen, uint64_t key);
+
+/* read_dictionary()
+ * -----------------
+ * Fills in a Dictionary struct with all of the words contained in a given
+ * dictionary file name. Words longer than MAX_WORD_LENGTH are skipped, or
+ * truncated with DICTIONARY_TRUNCATE. With DICTIONARY_DEDUP, a word is left
+ * out if crypt() would hash it the same as an earlier word - crypt() only
+ * uses the low 7 bits of the first 8 characters, so exact duplicates and
+ * words that only differ after that are never worth hashing twice. The
+ * whole file is read into one arena and each line is terminated in place, so
+ * the words end up packed one after another in a single allocation.
+ *
+ * dictName: name of the dictionary chosen
+ * flags: DICTIONARY_DEDUP and/or DICTIONARY_TRUNCATE, or 0
+ * dict: Dictionary struct to fill in
+ *
+ * Returns: DICTIONARY_OK, DICTIONARY_UNREADABLE if the file couldn't be opened
+ * or DICTIONARY_EMPTY if it doesn't contain any valid dictionary words
+ */
+DictionaryStatus read_dictionary(const char* dictName, int flags,
+        Dictionary* dict) {
+    Dictionary param = {.words = NULL, .numWords = 0, .numDuplicates = 0,
+            .numTruncated = 0};
+    SeenWords seen = {.slots = NULL, .numSlots = 0, .numUsed = 0};
+    size_t length;
+
+    int fd = open(dictName, O_RDONLY);
+    if (fd < 0) {
+        return DICTIONARY_UNREADABLE;
+    }
+    param.arena = read_file(fd, &length);
+    close(fd);
+
+    // Move the words that are kept down over the ones that aren't
+    char* next = param.arena;
+    char* end = param.arena + length;
+    char* out = param.arena;
+    while (next < end) {
+        char* newline = memchr(next, '\n', end - next);
+        size_t lineLength = (newline ? newline : end) - next;
+        size_t wordLength = lineLength;
+        if (wordLength > MAX_WORD_LENGTH && (flags & DICTIONARY_TRUNCATE)) {
+            wordLength = MAX_WORD_LENGTH;
+            param.numTruncated++;
+        }
+        bool keep = wordLength <= MAX_WORD_LENGTH;
+        if (keep && (flags & DICTIONARY_DEDUP)
+                && !seen_add(&seen, crypt_key(next, wordLength))) {
+            keep = false;
+            param.numDuplicates++;
+        }
+        if (keep) {
+            memmove(out, next, wordLength);
+            out[wordLength] = '\0';
+            out += wordLength + 1;
+            param.numWords++;
+        }
+        next += lineLength + 1;
+    }
+    free(seen.slots);
+
+    if (!param.numWords) {
+        free(param.arena);
+        return DICTIONARY_EMPTY;
+    }
+    size_t arenaSize = out - param.arena;
+    param.arena = realloc(param.arena, arenaSize);
+    param.words = malloc(sizeof(char*) * param.numWords);
+    next = param.arena;
+    for (int i = 0; i < param.numWords; i++) {
+        param.words[i] = next;
+        next += strlen(next) + 1;
+    }
+    param.numBytes = arenaSize + sizeof(char*) * param.numWords;
+    *dict = param;
+    return DICTIONARY_OK;
+}
+
+/* read_file()
+ * -----------
+ * Reads the rest of a file into a newly allocated buffer, which always has a
+ * spare byte after the contents. Regular files are read with a single
+ * allocation of the right size.
+ *
+ * fd: file to read
+ * length: set to the number of bytes read
+ *
+ * Returns: the buffer, which the caller must free
+ */
+static char* read_file(int fd, size_t* length) {
+    struct stat info;
+    size_t size = READ_SIZE;
+    ssize_t numRead;
+
+    if (fstat(fd, &info) == 0 && S_ISREG(info.st_mode) && info.st_size > 0) {
+        size = info.st_size + 1;
+    }
+    char* buffer = malloc(size);
+    *length = 0;
+    while (1) {
+        if (*length + 1 >= size) {
+            size *= 2;
+            buffer = realloc(buffer, size);
+        }
+        numRead = read(fd, buffer + *length, size - *length - 1);
+        if (numRead <= 0) {
+            break;
+        }
+        *length += numRead;
+    }
+    return buffer;
+}
+
+/* crypt_key()
+ * -----------
+ * Works out the part of a word that crypt() uses - the low 7 bits of each of
+ * the first 8 characters, with a character of 0 from the end of the word on.
+ * Two words hash the same with every salt if and only if their keys match.
+ *
+ * word: the word, which need not be null terminated
+ * length: length of the word
+ *
+ * Returns: the key, which is under 56 bits
+ */
+static uint64_t crypt_key(const char* word, size_t length) {
+    uint64_t key = 0;
+
+    for (size_t i = 0; i < MAX_WORD_LENGTH; i++) {
+        unsigned char c = i < length ? word[i] : 0;
+        key = (key << 7) | (c & 0x7f);
+    }
+    return key;
+}
+
+/* seen_add()
+ * ----------
+ * Adds a word's key to a set of the keys seen, growing the set if it is half
+ * full.
+ *
+ * seen: the set of keys
+ * key: the word's key
+ *
+ * Returns: true if the key was added, or false if it was already there
+ */
+static bool seen_add(SeenWords* seen, uint64_t key) {
+    if (seen->numUsed * 2 >= seen->numSlots) {
+        SeenWords grown = {.numSlots = seen->numSlots
+                ? seen->numSlots * 2 : MIN_SEEN_SLOTS, .numUsed = 0};
+        grown.slots = calloc(grown.numSlots, sizeof(uint64_t));
+        for (size_t i = 0; i < seen->numSlots; i++) {
+            if (seen->slots[i]) {
+                seen_add(&grown, seen->slots[i] & ~SEEN_USED);
+            }
+        }
+        free(seen->slots);
+        *seen = grown;
+    }
+
+    // Multiplicative hash, since keys are packed text
+    size_t mask = seen->numSlots - 1;
+    size_t slot = (key * 0x9E3779B97F4A7C15ULL) >> 32 & mask;
+    while (seen->slots[slot]) {
+        if (seen->slots[slot] == (key | SEEN_USED)) {
+            return false;
+        }
+        slot = (slot + 1) & mask;
+    }
+    seen->slots[slot] = key | SEEN_USED;
+    seen->numUsed++;
+    return true;
+}
+
+/* free_dictionary()
+ * -----------------
+ * Frees all of the memory allocated for a dictionary struct.
+ * 
+ * dict: Dictionary struct to be freed
+ */
+void free_dictionary(Dictionary dict) {
+    if (dict.mapLength) {
+        munmap(dict.words, dict.mapLength);
+        return;
+    }
+    free(dict.arena);
+    free(dict.words);
+}
+
+/* share_dictionary()
+ * ------------------
+ * Copies a dictionary's words array and arena into a shared anonymous
+ * mapping (the array first, then the arena), moving each word pointer to the
+ * word's copy, and makes the mapping read-only. The words stay in the same
+ * order in the arena.
+ *
+ * dict: Dictionary struct to move, whose old memory is freed
+ *
+ * Returns: whether the dictionary was moved
+ */
+bool share_dictionary(Dictionary* dict) {
+    size_t wordsSize = sizeof(char*) * dict->numWords;
+    size_t arenaSize = dict->numBytes - wordsSize;
+    char** words = mmap(NULL, dict->numBytes, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+
+    if (words == MAP_FAILED) {
+        return false;
+    }
+    char* arena = (char*)words + wordsSize;
+    memcpy(arena, dict->arena, arenaSize);
+    for (int i = 0; i < dict->numWords; i++) {
+        words[i] = arena + (dict->words[i] - dict->arena);
+    }
+    mprotect(words, dict->numBytes, PROT_READ);
+    free_dictionary(*dict);
+    dict->words = words;
+    dict->arena = arena;
+    dict->mapLength = dict->numBytes;
+    return true;
+}
+
+/* dictionary_checksum()
+ * ---------------------
+ * Works out a 64-bit FNV-1a hash of every word in the dictionary, including
+ * the terminating null so that word boundaries count.
+ *
+ * dict: Dictionary struct to checksum
+ *
+ * Returns: the checksum
+ */
+uint64_t dictionary_checksum(const Dictionary* dict) {
+    uint64_t hash = FNV_OFFSET;
+
+    for (int i = 0; i < dict->numWords; i++) {
+        const unsigned char* word = (const unsigned char*)dict->words[i];
+        do {
+            hash ^= *word;
+            hash *= FNV_PRIME;
+        } while (*word++);
+    }
+    return hash;
+}
@@ -0,0 +1,59 @@
+#ifndef DICTIONARY_H
+#define DICTIONARY_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+// Longest word that can be used (traditional crypt only uses 8 characters)
+#define MAX_WORD_LENGTH 8
+
+// Flags for reading a dictionary. DICTIONARY_DEDUP leaves out words that
+// crypt() can't tell apart from an earlier word, and DICTIONARY_TRUNCATE cuts
+// words longer than MAX_WORD_LENGTH down to that length instead of skipping
+// them.
+#define DICTIONARY_DEDUP 1
+#define DICTIONARY_TRUNCATE 2
+
+// Dictionary of words with the words and the number of words. The words are
+// stored one after another in a single arena, and numBytes is the memory
+// used by the arena and the words array together. numDuplicates is the number
+// of words left out as duplicates, and numTruncated the number of words that
+// were truncated. mapLength is the length of the shared mapping that holds the
+// words array and arena, or 0 if they were allocated with malloc().
+typedef struct {
+    char** words;
+    int numWords;
+    char* arena;
+    size_t numBytes;
+    int numDuplicates;
+    int numTruncated;
+    size_t mapLength;
+} Dictionary;
+
+// Results of reading a dictionary file
+typedef enum {
+    DICTIONARY_OK,
+    DICTIONARY_UNREADABLE,
+    DICTIONARY_EMPTY,
+} DictionaryStatus;
+
+// Reads every word of at most MAX_WORD_LENGTH characters from a dictionary
+// file, as changed by flags (DICTIONARY_DEDUP and DICTIONARY_TRUNCATE). dict
+// is only filled in if DICTIONARY_OK is returned.
+DictionaryStatus read_dictionary(const char* dictName, int flags,
+        Dictionary* dict);
+
+// Frees all of the memory allocated for a dictionary
+void free_dictionary(Dictionary dict);
+
+// Moves a dictionary's words array and arena into one read-only shared
+// mapping, so that processes forked afterwards all use the same copy. Returns
+// false (leaving the dictionary as it was) if the mapping couldn't be made.
+bool share_dictionary(Dictionary* dict);
+
+// Checksum of the words (and their order) in a dictionary, used to check that
+// an index file was built from the same dictionary
+uint64_t dictionary_checksum(const Dictionary* dict);
+
+#endif
@@ -0,0 +1,135 @@
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "indexfile.h"
+#include "descrypt.h"
+
+/* index_file_table_offset()
+ * --------------------------
+ * Works out where the table for a salt starts in an index file.
+ *
+ * numWords: number of words (entries per table) in the index file
+ * salt: number of the salt
+ *
+ * Returns: offset of the salt's table from the start of the file
+ */
+size_t index_file_table_offset(uint32_t numWords, int salt) {
+    return sizeof(IndexFileHeader)
+            + (size_t)salt * numWords * sizeof(IndexFileEntry);
+}
+
+/* open_index_file()
+ * -----------------
+ * Memory-maps an index file. Nothing is read apart from the header, so this
+ * is fast no matter how big the file is, and the pages are shared with any
+ * other process that maps the same file.
+ *
+ * name: name of the index file
+ * dict: Dictionary struct that the index must have been built from
+ * index: set to the mapped index file
+ *
+ * Returns: INDEX_FILE_OK, INDEX_FILE_UNREADABLE if the file couldn't be
+ * opened or mapped, INDEX_FILE_INVALID if it isn't an index file (or is
+ * truncated) or INDEX_FILE_MISMATCH if it was built from another dictionary
+ */
+IndexFileStatus open_index_file(const char* name, const Dictionary* dict,
+        IndexFile* index) {
+    struct stat info;
+    int fd = open(name, O_RDONLY);
+
+    if (fd < 0) {
+        return INDEX_FILE_UNREADABLE;
+    }
+    if (fstat(fd, &info) < 0) {
+        close(fd);
+        return INDEX_FILE_UNREADABLE;
+    }
+    if ((size_t)info.st_size < sizeof(IndexFileHeader)) {
+        close(fd);
+        return INDEX_FILE_INVALID;
+    }
+    void* map = mmap(NULL, info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd); // The mapping stays valid once the file is closed
+    if (map == MAP_FAILED) {
+        return INDEX_FILE_UNREADABLE;
+    }
+
+    const IndexFileHeader* header = map;
+    IndexFileStatus status = INDEX_FILE_OK;
+    if (memcmp(header->magic, INDEX_FILE_MAGIC, INDEX_FILE_MAGIC_LENGTH)
+            || header->version != INDEX_FILE_VERSION
+            || (size_t)info.st_size != index_file_table_offset(
+            header->numWords, DES_NUM_SALTS)) {
+        status = INDEX_FILE_INVALID;
+    } else if (header->numWords != (uint32_t)dict->numWords
+            || header->checksum != dictionary_checksum(dict)) {
+        status = INDEX_FILE_MISMATCH;
+    }
+    if (status != INDEX_FILE_OK) {
+        munmap(map, info.st_size);
+        return status;
+    }
+
+    // Lookups jump around the file, so don't read ahead
+    madvise(map, info.st_size, MADV_RANDOM);
+    index->map = map;
+    index->length = info.st_size;
+    index->numWords = header->numWords;
+    index->entries = (const IndexFileEntry*)(header + 1);
+    return INDEX_FILE_OK;
+}
+
+/* index_file_matches()
+ * --------------------
+ * Checks whether an index file that has already been opened was built from a
+ * dictionary, such as one that has been reloaded.
+ *
+ * index: mapped index file
+ * dict: Dictionary struct to check
+ *
+ * Returns: true if the index file was built from the dictionary
+ */
+bool index_file_matches(const IndexFile* index, const Dictionary* dict) {
+    const IndexFileHeader* header = index->map;
+    return header->numWords == (uint32_t)dict->numWords
+            && header->checksum == dictionary_checksum(dict);
+}
+
+/* index_file_lookup()
+ * -------------------
+ * Binary searches the table for a salt for a hash. Only the pages touched by
+ * the search are read from the file.
+ *
+ * index: mapped index file
+ * salt: number of the salt of the cipher text
+ * hash: 64-bit hash from the cipher text
+ *
+ * Returns: position of the word in the dictionary, or -1 if no word has the
+ * hash
+ */
+int index_file_lookup(const IndexFile* index, int salt, uint64_t hash) {
+    const IndexFileEntry* table = index->entries
+            + (size_t)salt * index->numWords;
+    uint32_t high = hash >> 32;
+    uint32_t low = (uint32_t)hash;
+    size_t first = 0;
+    size_t last = index->numWords;
+
+    while (first < last) {
+        size_t mid = first + (last - first) / 2;
+        const IndexFileEntry* entry = &table[mid];
+        if (entry->hashHigh == high && entry->hashLow == low) {
+            return entry->word;
+        }
+        if (entry->hashHigh < high
+                || (entry->hashHigh == high && entry->hashLow < low)) {
+            first = mid + 1;
+        } else {
+            last = mid;
+        }
+    }
+    return -1;
+}
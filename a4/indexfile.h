@@ -0,0 +1,64 @@
+#ifndef INDEXFILE_H
+#define INDEXFILE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "dictionary.h"
+
+// Index files start with this magic string and version
+#define INDEX_FILE_MAGIC "CRKINDEX"
+#define INDEX_FILE_MAGIC_LENGTH 8
+#define INDEX_FILE_VERSION 1
+
+// Header of an index file. It is followed by DES_NUM_SALTS tables of numWords
+// entries, one table per salt in salt order, each sorted by hash. All fields
+// are in the byte order of the machine that wrote the file.
+typedef struct {
+    char magic[INDEX_FILE_MAGIC_LENGTH];
+    uint32_t version;
+    uint32_t numWords;
+    uint64_t checksum;
+} IndexFileHeader;
+
+// Entry in an index file - the 64-bit hash (the part of the cipher text after
+// the salt) of a dictionary word, split into two halves so that entries are
+// 12 bytes with no padding, and the position of the word in the dictionary
+typedef struct {
+    uint32_t hashHigh;
+    uint32_t hashLow;
+    uint32_t word;
+} IndexFileEntry;
+
+// An index file that has been memory-mapped
+typedef struct {
+    void* map;
+    size_t length;
+    uint32_t numWords;
+    const IndexFileEntry* entries;
+} IndexFile;
+
+// Results of opening an index file
+typedef enum {
+    INDEX_FILE_OK,
+    INDEX_FILE_UNREADABLE,
+    INDEX_FILE_INVALID,
+    INDEX_FILE_MISMATCH,
+} IndexFileStatus;
+
+// Memory-maps an index file read-only and checks that it was built from the
+// given dictionary. index is only filled in if INDEX_FILE_OK is returned.
+IndexFileStatus open_index_file(const char* name, const Dictionary* dict,
+        IndexFile* index);
+
+// Checks whether an index file was built from the given dictionary
+bool index_file_matches(const IndexFile* index, const Dictionary* dict);
+
+// Binary searches the table for a salt for a hash. Returns the position of
+// the word in the dictionary, or -1 if no word has that hash.
+int index_file_lookup(const IndexFile* index, int salt, uint64_t hash);
+
+// Offset of the table for a salt from the start of an index file
+size_t index_file_table_offset(uint32_t numWords, int salt);
+
+#endif
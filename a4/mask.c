@@ -0,0 +1,121 @@
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "mask.h"
+
+// Characters of each built in character set
+#define LOWER "abcdefghijklmnopqrstuvwxyz"
+#define UPPER "ABCDEFGHIJKLMNOPQRSTUVWXYZ"
+#define DIGITS "0123456789"
+#define SYMBOLS " !\"#$%&'()*+,-./:;<=>?@[\\]^_`{|}~"
+
+static const char* charset(char name);
+
+/* parse_mask()
+ * ------------
+ * Works out the character set of each position of a mask, and the number of
+ * candidates that it covers.
+ *
+ * text: the mask
+ * mask: filled in with the mask if it is valid
+ *
+ * Returns: whether the mask is valid
+ */
+bool parse_mask(const char* text, Mask* mask) {
+    mask->length = 0;
+    mask->keyspace = 1;
+
+    for (const char* c = text; *c; c++) {
+        const char* set;
+        char literal[2] = {*c, '\0'};
+        if (*c == '?') {
+            if (!(set = charset(*++c))) {
+                return false;
+            }
+        } else {
+            set = literal;
+        }
+        if (mask->length == MAX_WORD_LENGTH) {
+            return false;
+        }
+        strcpy(mask->sets[mask->length], set);
+        mask->setLengths[mask->length] = strlen(set);
+        mask->keyspace *= mask->setLengths[mask->length];
+        mask->length++;
+    }
+    return mask->length > 0;
+}
+
+/* mask_digits()
+ * -------------
+ * Splits a candidate number into one digit per position, each counting
+ * through its position's character set.
+ *
+ * mask: the mask
+ * index: number of the candidate
+ * digits: set to the digits
+ */
+void mask_digits(const Mask* mask, uint64_t index, int* digits) {
+    for (int i = mask->length - 1; i >= 0; i--) {
+        digits[i] = index % mask->setLengths[i];
+        index /= mask->setLengths[i];
+    }
+}
+
+/* mask_candidate()
+ * ----------------
+ * Builds the candidate that a set of digits stands for.
+ *
+ * mask: the mask
+ * digits: the digits
+ * candidate: buffer of at least MAX_WORD_LENGTH + 1 characters that the
+ * candidate is written to
+ */
+void mask_candidate(const Mask* mask, const int* digits, char* candidate) {
+    for (int i = 0; i < mask->length; i++) {
+        candidate[i] = mask->sets[i][digits[i]];
+    }
+    candidate[mask->length] = '\0';
+}
+
+/* mask_increment()
+ * ----------------
+ * Adds one to a set of digits, carrying into earlier positions. The digits
+ * wrap around to the first candidate after the last one.
+ *
+ * mask: the mask
+ * digits: the digits
+ */
+void mask_increment(const Mask* mask, int* digits) {
+    for (int i = mask->length - 1; i >= 0; i--) {
+        if (++digits[i] < mask->setLengths[i]) {
+            return;
+        }
+        digits[i] = 0;
+    }
+}
+
+/* charset()
+ * ---------
+ * Finds the characters of a mask's ?<name> character set.
+ *
+ * name: the character after the ?
+ *
+ * Returns: the characters, or null if there is no such set
+ */
+static const char* charset(char name) {
+    if (name == 'l') {
+        return LOWER;
+    } else if (name == 'u') {
+        return UPPER;
+    } else if (name == 'd') {
+        return DIGITS;
+    } else if (name == 's') {
+        return SYMBOLS;
+    } else if (name == 'a') {
+        return LOWER UPPER DIGITS SYMBOLS;
+    } else if (name == '?') {
+        return "?";
+    }
+    return NULL;
+}
@@ -0,0 +1,39 @@
+#ifndef MASK_H
+#define MASK_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "dictionary.h"
+
+// Most characters in a mask position's character set (?a, every printable
+// ASCII character)
+#define MASK_MAX_SET 95
+
+// A hashcat-style mask, with the set of characters that each position of a
+// candidate can be. keyspace is the number of candidates it covers.
+typedef struct {
+    char sets[MAX_WORD_LENGTH][MASK_MAX_SET + 1];
+    int setLengths[MAX_WORD_LENGTH];
+    int length;
+    uint64_t keyspace;
+} Mask;
+
+// Parses a mask of 1 to MAX_WORD_LENGTH positions. Each position is ?l
+// (lower case), ?u (upper case), ?d (digit), ?s (symbol or space), ?a (any
+// of those), ?? (a question mark) or any other character as it is. Returns
+// false if the mask isn't valid.
+bool parse_mask(const char* text, Mask* mask);
+
+// Sets digits (one per position) to the digits of candidate number index,
+// where the last position changes fastest. index must be less than the
+// keyspace.
+void mask_digits(const Mask* mask, uint64_t index, int* digits);
+
+// Writes the candidate for the given digits (of at most MAX_WORD_LENGTH
+// characters) to candidate
+void mask_candidate(const Mask* mask, const int* digits, char* candidate);
+
+// Moves digits on to the next candidate
+void mask_increment(const Mask* mask, int* digits);
+
+#endif
@@ -0,0 +1,383 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+#include "potfile.h"
+
+// FNV-1a 32-bit offset basis and prime
+#define FNV_OFFSET 2166136261U
+#define FNV_PRIME 16777619U
+
+// Buckets in a new table. A table doubles in size once it holds twice as many
+// entries as it has buckets.
+#define MIN_BUCKETS 1024
+
+// New lines are appended at most this long after they were added, or as soon
+// as this many bytes are waiting
+#define FLUSH_SECONDS 1
+#define FLUSH_SIZE 65536
+
+static PotfileTable* create_table(unsigned int numBuckets);
+static void table_insert(PotfileTable* table, PotfileEntry* entry);
+static void grow_table(Potfile* potfile);
+static unsigned int potfile_hash(const char* cipherText);
+static PotfileEntry* find_entry(PotfileTable* table, const char* cipherText);
+static void load_potfile(Potfile* potfile, FILE* file);
+static void queue_line(Potfile* potfile, const char* cipherText,
+        const char* word);
+static void start_flush_thread(Potfile* potfile);
+static void* flush_thread(void* v);
+static void write_all(int fd, const char* data, size_t length);
+
+/* open_potfile()
+ * --------------
+ * Opens a potfile for appending (creating it if needed), loads every entry
+ * already in it into a hash table, and starts the thread that appends new
+ * entries in batches.
+ *
+ * name: name of the potfile
+ *
+ * Returns: the potfile, or null if it couldn't be opened or read
+ */
+Potfile* open_potfile(const char* name) {
+    int fd = open(name, O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (fd < 0) {
+        return NULL;
+    }
+    FILE* file = fopen(name, "r");
+    if (!file) {
+        close(fd);
+        return NULL;
+    }
+
+    Potfile* potfile = calloc(1, sizeof(Potfile));
+    potfile->table = create_table(MIN_BUCKETS);
+    potfile->fd = fd;
+    pthread_mutex_init(&potfile->lock, NULL);
+    pthread_cond_init(&potfile->flush, NULL);
+    load_potfile(potfile, file);
+    fclose(file);
+    start_flush_thread(potfile);
+    return potfile;
+}
+
+/* potfile_restart()
+ * -----------------
+ * Makes a potfile usable in a process forked after it was opened. fork()
+ * only copies the thread that called it, so the lock (which another thread
+ * may have held) is made again and a new flush thread is started. Lines that
+ * were waiting are dropped, since the parent appends them.
+ *
+ * potfile: the potfile, as copied into the new process
+ */
+void potfile_restart(Potfile* potfile) {
+    pthread_mutex_init(&potfile->lock, NULL);
+    pthread_cond_init(&potfile->flush, NULL);
+    potfile->pendingLength = 0;
+    start_flush_thread(potfile);
+}
+
+/* potfile_lookup()
+ * ----------------
+ * Finds the word for a cipher text. No lock is taken - the table and the
+ * entries in it are published with release stores, so whatever is loaded here
+ * is complete.
+ *
+ * potfile: the potfile
+ * cipherText: cipher text to look up
+ *
+ * Returns: the word, or null if the cipher text hasn't been cracked
+ */
+char* potfile_lookup(Potfile* potfile, const char* cipherText) {
+    PotfileTable* table = __atomic_load_n(&potfile->table, __ATOMIC_ACQUIRE);
+    PotfileEntry* entry = find_entry(table, cipherText);
+    return entry ? entry->word : NULL;
+}
+
+/* potfile_add()
+ * -------------
+ * Adds a cracked cipher text to the table and queues its line to be appended
+ * to the file. Nothing is done if the cipher text is already in the potfile.
+ *
+ * potfile: the potfile
+ * cipherText: cipher text that was cracked
+ * word: the word that it is the cipher text of
+ */
+void potfile_add(Potfile* potfile, const char* cipherText, const char* word) {
+    if (strlen(cipherText) != POTFILE_CIPHER_LENGTH
+            || potfile_lookup(potfile, cipherText)) {
+        return;
+    }
+    pthread_mutex_lock(&potfile->lock);
+    // Check again, now that no other writer can add it
+    if (!find_entry(potfile->table, cipherText)) {
+        PotfileEntry* entry = malloc(sizeof(PotfileEntry));
+        strcpy(entry->cipherText, cipherText);
+        entry->word = strdup(word);
+        table_insert(potfile->table, entry);
+        if (++potfile->numEntries > 2 * (potfile->table->mask + 1)) {
+            grow_table(potfile);
+        }
+        queue_line(potfile, cipherText, word);
+    }
+    pthread_mutex_unlock(&potfile->lock);
+}
+
+/* create_table()
+ * --------------
+ * Allocates an empty hash table.
+ *
+ * numBuckets: number of buckets, which must be a power of 2
+ *
+ * Returns: the table
+ */
+static PotfileTable* create_table(unsigned int numBuckets) {
+    PotfileTable* table = malloc(sizeof(PotfileTable));
+    table->buckets = calloc(numBuckets, sizeof(PotfileEntry*));
+    table->mask = numBuckets - 1;
+    table->previous = NULL;
+    return table;
+}
+
+/* table_insert()
+ * --------------
+ * Links an entry onto the front of its bucket. The entry is complete before
+ * the bucket is stored (with release), so a reader never sees part of it.
+ * Only one thread at a time may insert.
+ *
+ * table: the hash table
+ * entry: the entry to insert
+ */
+static void table_insert(PotfileTable* table, PotfileEntry* entry) {
+    PotfileEntry** bucket =
+            &table->buckets[potfile_hash(entry->cipherText) & table->mask];
+    entry->next = *bucket;
+    __atomic_store_n(bucket, entry, __ATOMIC_RELEASE);
+}
+
+/* grow_table()
+ * ------------
+ * Replaces the potfile's table with one twice the size. Entries are linked
+ * through their next pointers, which readers of the old table may still be
+ * following, so the new table gets copies of them (sharing their words). The
+ * old table is kept rather than freed.
+ *
+ * potfile: the potfile, whose lock must be held
+ */
+static void grow_table(Potfile* potfile) {
+    PotfileTable* old = potfile->table;
+    PotfileTable* table = create_table((old->mask + 1) * 2);
+
+    for (unsigned int i = 0; i <= old->mask; i++) {
+        for (PotfileEntry* entry = old->buckets[i]; entry;
+                entry = entry->next) {
+            PotfileEntry* copy = malloc(sizeof(PotfileEntry));
+            memcpy(copy, entry, sizeof(PotfileEntry));
+            table_insert(table, copy);
+        }
+    }
+    table->previous = old;
+    __atomic_store_n(&potfile->table, table, __ATOMIC_RELEASE);
+}
+
+/* potfile_hash()
+ * --------------
+ * Hashes a cipher text with FNV-1a.
+ *
+ * cipherText: the cipher text
+ *
+ * Returns: the hash
+ */
+static unsigned int potfile_hash(const char* cipherText) {
+    uint32_t hash = FNV_OFFSET;
+
+    for (int i = 0; cipherText[i]; i++) {
+        hash = (hash ^ (unsigned char)cipherText[i]) * FNV_PRIME;
+    }
+    return hash;
+}
+
+/* find_entry()
+ * ------------
+ * Searches a table's bucket for a cipher text.
+ *
+ * table: the hash table
+ * cipherText: the cipher text
+ *
+ * Returns: the entry for the cipher text, or null if it isn't in the table
+ */
+static PotfileEntry* find_entry(PotfileTable* table, const char* cipherText) {
+    PotfileEntry* entry = __atomic_load_n(
+            &table->buckets[potfile_hash(cipherText) & table->mask],
+            __ATOMIC_ACQUIRE);
+
+    for (; entry; entry = entry->next) {
+        if (strcmp(entry->cipherText, cipherText) == 0) {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+/* load_potfile()
+ * --------------
+ * Adds every "cipher:word" line of a potfile to its table. Other lines are
+ * skipped, and if a cipher text appears more than once the first word is
+ * kept. If the file doesn't end with a newline (the server was stopped while
+ * appending), one is queued so that the next line starts on its own.
+ *
+ * potfile: the potfile, which no other thread is using yet
+ * file: the potfile, open for reading
+ */
+static void load_potfile(Potfile* potfile, FILE* file) {
+    char* line = NULL;
+    size_t size = 0;
+    ssize_t length;
+    bool newline = true;
+
+    while ((length = getline(&line, &size, file)) > 0) {
+        newline = line[length - 1] == '\n';
+        if (newline) {
+            line[--length] = '\0';
+        }
+        if (length <= POTFILE_CIPHER_LENGTH + 1
+                || line[POTFILE_CIPHER_LENGTH] != ':') {
+            continue;
+        }
+        line[POTFILE_CIPHER_LENGTH] = '\0';
+        if (find_entry(potfile->table, line)) {
+            continue;
+        }
+        PotfileEntry* entry = malloc(sizeof(PotfileEntry));
+        strcpy(entry->cipherText, line);
+        entry->word = strdup(line + POTFILE_CIPHER_LENGTH + 1);
+        table_insert(potfile->table, entry);
+        if (++potfile->numEntries > 2 * (potfile->table->mask + 1)) {
+            grow_table(potfile);
+        }
+    }
+    free(line);
+    if (!newline) {
+        queue_line(potfile, NULL, NULL);
+    }
+}
+
+/* queue_line()
+ * ------------
+ * Adds a line to the ones waiting to be appended, and wakes up the flush
+ * thread.
+ *
+ * potfile: the potfile, whose lock must be held
+ * cipherText: cipher text of the line, or null for an empty line
+ * word: word of the line
+ */
+static void queue_line(Potfile* potfile, const char* cipherText,
+        const char* word) {
+    size_t length = cipherText ? strlen(cipherText) + strlen(word) + 2 : 1;
+
+    if (potfile->pendingLength + length + 1 > potfile->pendingSize) {
+        potfile->pendingSize = (potfile->pendingLength + length + 1) * 2;
+        potfile->pending = realloc(potfile->pending, potfile->pendingSize);
+    }
+    if (cipherText) {
+        sprintf(potfile->pending + potfile->pendingLength, "%s:%s\n",
+                cipherText, word);
+    } else {
+        strcpy(potfile->pending + potfile->pendingLength, "\n");
+    }
+    potfile->pendingLength += length;
+    pthread_cond_signal(&potfile->flush);
+}
+
+/* start_flush_thread()
+ * --------------------
+ * Starts the thread that appends a potfile's new entries. The thread blocks
+ * every signal, so that signals are still handled by the threads that wait
+ * for them.
+ *
+ * potfile: the potfile
+ */
+static void start_flush_thread(Potfile* potfile) {
+    sigset_t all, old;
+    pthread_t threadID;
+
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    pthread_create(&threadID, NULL, flush_thread, potfile);
+    pthread_detach(threadID);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+
+/* flush_thread()
+ * --------------
+ * Function that is run by the potfile's flush thread. Once a line is waiting,
+ * it waits up to FLUSH_SECONDS (or until FLUSH_SIZE bytes are waiting) for
+ * more to join it, then appends them all with one write. The file is written
+ * without holding the lock, so adding lines never waits for the disk.
+ *
+ * v: void pointer to the potfile
+ */
+static void* flush_thread(void* v) {
+    Potfile* potfile = (Potfile*)v;
+
+    pthread_mutex_lock(&potfile->lock);
+    while (1) {
+        while (!potfile->pendingLength) {
+            pthread_cond_wait(&potfile->flush, &potfile->lock);
+        }
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += FLUSH_SECONDS;
+        while (potfile->pendingLength < FLUSH_SIZE
+                && pthread_cond_timedwait(&potfile->flush, &potfile->lock,
+                &deadline) != ETIMEDOUT) {
+            // More lines can join the batch until the deadline
+        }
+
+        // Swap buffers so that lines can be added while this batch is written
+        char* batch = potfile->pending;
+        size_t length = potfile->pendingLength;
+        size_t size = potfile->pendingSize;
+        potfile->pending = potfile->spare;
+        potfile->pendingSize = potfile->spareSize;
+        potfile->pendingLength = 0;
+        pthread_mutex_unlock(&potfile->lock);
+
+        write_all(potfile->fd, batch, length);
+
+        pthread_mutex_lock(&potfile->lock);
+        potfile->spare = batch;
+        potfile->spareSize = size;
+    }
+    return NULL;
+}
+
+/* write_all()
+ * -----------
+ * Writes all of the given data to a file, retrying short writes. If the file
+ * can't be written the data is dropped - the entries are still in memory, so
+ * only later runs of the server lose them.
+ *
+ * fd: the file
+ * data: data to write
+ * length: number of bytes to write
+ */
+static void write_all(int fd, const char* data, size_t length) {
+    while (length) {
+        ssize_t written = write(fd, data, length);
+        if (written < 0 && errno == EINTR) {
+            continue;
+        }
+        if (written <= 0) {
+            return;
+        }
+        data += written;
+        length -= written;
+    }
+}
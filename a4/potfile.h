@@ -0,0 +1,61 @@
+#ifndef POTFILE_H
+#define POTFILE_H
+
+#include <stddef.h>
+#include <pthread.h>
+
+// Length of the cipher texts that a potfile holds
+#define POTFILE_CIPHER_LENGTH 13
+
+// A cracked cipher text and its word. Entries are never changed or freed once
+// they are in a table, so readers can follow them without a lock.
+typedef struct PotfileEntry {
+    char cipherText[POTFILE_CIPHER_LENGTH + 1];
+    char* word;
+    struct PotfileEntry* next;
+} PotfileEntry;
+
+// Hash table of potfile entries, chained through next. When it grows, the
+// old table is kept (linked through previous) since readers may still be
+// looking through it.
+typedef struct PotfileTable {
+    PotfileEntry** buckets;
+    unsigned int mask;
+    struct PotfileTable* previous;
+} PotfileTable;
+
+// A potfile that has been loaded into memory and is open for appending.
+// Readers only load table; everything else is protected by lock. New lines
+// wait in pending until the flush thread appends them in one write, and spare
+// is the buffer that the last batch was written from.
+typedef struct {
+    PotfileTable* table;
+    unsigned int numEntries;
+    int fd;
+    char* pending;
+    size_t pendingLength;
+    size_t pendingSize;
+    char* spare;
+    size_t spareSize;
+    pthread_mutex_t lock;
+    pthread_cond_t flush;
+} Potfile;
+
+// Loads a potfile (creating it if it doesn't exist) and starts the thread
+// that appends new entries to it. Lines that aren't "cipher:word" are
+// skipped. Returns null if the file couldn't be opened.
+Potfile* open_potfile(const char* name);
+
+// Starts the potfile's flush thread again in a process forked after it was
+// opened. New entries are only seen by the process that added them.
+void potfile_restart(Potfile* potfile);
+
+// Looks up the word for a cipher text without taking a lock. Returns null if
+// the cipher text isn't in the potfile. The word must not be changed.
+char* potfile_lookup(Potfile* potfile, const char* cipherText);
+
+// Adds a cracked cipher text to the potfile, unless it is already there. The
+// line is appended to the file with the next batch.
+void potfile_add(Potfile* potfile, const char* cipherText, const char* word);
+
+#endif
@@ -0,0 +1,26 @@
+#include <string.h>
+#include "protocol.h"
+
+/* expected_responses()
+ * --------------------
+ * Works out how many response lines the server will send for a command. A
+ * crackbatch command gets one response per cipher text (the fields after the
+ * number of threads), every other command gets one.
+ *
+ * line: command that is being sent to the server
+ *
+ * Returns: number of responses to read
+ */
+int expected_responses(const char* line) {
+    int numFields = 1;
+
+    if (strncmp(line, "crackbatch ", strlen("crackbatch ")) != 0) {
+        return 1;
+    }
+    for (const char* c = line; *c; c++) {
+        if (*c == ' ') {
+            numFields++;
+        }
+    }
+    return numFields > 2 ? numFields - 2 : 1;
+}
@@ -0,0 +1,9 @@
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+
+// Works out how many response lines the server will send for a command. A
+// crackbatch command gets one response per cipher text (the fields after the
+// number of threads), every other command gets one.
+int expected_responses(const char* line);
+
+#endif
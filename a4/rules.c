@@ -0,0 +1,207 @@
+#include <string.h>
+#include <ctype.h>
+#include <stdbool.h>
+#include "dictionary.h"
+#include "rules.h"
+
+// Longest word a rule can build before it is cut down to size. Only words of
+// up to MAX_WORD_LENGTH characters are kept once every operation is done.
+#define RULE_BUFFER_LENGTH (2 * MAX_WORD_LENGTH + 1)
+
+// Rules that change the case of a word
+static const char* const caseRules[] = {
+    ":", "l", "u", "c", "C", "t",
+};
+
+// Rules that add digits (and common symbols) to a word, with and without
+// capitalising it first
+static const char* const digitRules[] = {
+    ":", "$0", "$1", "$2", "$3", "$4", "$5", "$6", "$7", "$8", "$9",
+    "c $0", "c $1", "c $2", "c $3", "c $4", "c $5", "c $6", "c $7", "c $8",
+    "c $9", "$1 $2", "$1 $2 $3", "$!", "c $!", "c $1 $!", "^1",
+};
+
+// Rules that swap letters for the digits and symbols that look like them
+static const char* const leetRules[] = {
+    ":", "sa4", "sa@", "se3", "si1", "si!", "so0", "ss5", "ss$", "sl1",
+    "st7", "sa4 se3", "sa4 so0", "se3 so0", "sa4 se3 si1 so0",
+    "sa4 se3 si1 so0 ss5", "sa@ se3 si1 so0 ss$",
+};
+
+// Rules that reverse or repeat a word
+static const char* const reverseRules[] = {
+    ":", "r", "d", "f", "c r",
+};
+
+// A mix of the most useful rules from the other sets
+static const char* const bestRules[] = {
+    ":", "c", "u", "t", "$1", "$2", "$!", "c $1", "c $!", "c $1 $2 $3",
+    "$1 $2 $3", "$1 $2", "c $1 $2", "$0 $1", "c $0 $1", "$6 $9", "$9 $9",
+    "sa4", "se3", "so0", "si1", "sa4 se3 si1 so0", "c sa4 se3 si1 so0",
+    "sa@", "ss$", "r", "d", "c $2 $0 $2 $3", "^1", "c $7",
+};
+
+// Number of rules in a rule array
+#define NUM_RULES(rules) ((int)(sizeof(rules) / sizeof(rules[0])))
+
+// Every built in rule set
+static const RuleSet ruleSets[] = {
+    {"case", caseRules, NUM_RULES(caseRules)},
+    {"digits", digitRules, NUM_RULES(digitRules)},
+    {"leet", leetRules, NUM_RULES(leetRules)},
+    {"reverse", reverseRules, NUM_RULES(reverseRules)},
+    {"best", bestRules, NUM_RULES(bestRules)},
+};
+
+static bool apply_rule(const char* rule, char* word, int* length);
+static void change_case(char* word, int length, char first, char rest);
+
+/* find_rule_set()
+ * ---------------
+ * Finds a built in rule set by name.
+ *
+ * name: name of the rule set
+ *
+ * Returns: the rule set, or null if there is none with that name
+ */
+const RuleSet* find_rule_set(const char* name) {
+    for (int i = 0; i < NUM_RULES(ruleSets); i++) {
+        if (strcmp(ruleSets[i].name, name) == 0) {
+            return &ruleSets[i];
+        }
+    }
+    return NULL;
+}
+
+/* rule_set_apply()
+ * ----------------
+ * Builds the candidate for a word and one rule of a set. Candidates longer
+ * than MAX_WORD_LENGTH are rejected, since crypt() would hash them the same
+ * as their first MAX_WORD_LENGTH characters. So are candidates that a rule
+ * (other than the first, which is ":") leaves unchanged, as the first rule
+ * has already hashed them.
+ *
+ * set: the rule set
+ * rule: index of the rule in the set
+ * word: the dictionary word
+ * candidate: buffer of at least MAX_WORD_LENGTH + 1 characters that the
+ * candidate is written to
+ *
+ * Returns: whether the candidate should be hashed
+ */
+bool rule_set_apply(const RuleSet* set, int rule, const char* word,
+        char* candidate) {
+    char buffer[RULE_BUFFER_LENGTH + 1];
+    int length = strlen(word);
+
+    if (length > MAX_WORD_LENGTH) {
+        return false;
+    }
+    memcpy(buffer, word, length + 1);
+    if (!apply_rule(set->rules[rule], buffer, &length)
+            || length > MAX_WORD_LENGTH
+            || (rule > 0 && strcmp(buffer, word) == 0)) {
+        return false;
+    }
+    memcpy(candidate, buffer, length + 1);
+    return true;
+}
+
+/* apply_rule()
+ * ------------
+ * Applies each operation of a rule to a word in turn. The operations are a
+ * subset of hashcat's: ":" (nothing), "l" (lower case), "u" (upper case), "c"
+ * (capitalise), "C" (lower case the first letter and upper case the rest),
+ * "t" (toggle case), "r" (reverse), "d" (duplicate), "f" (append the word
+ * reversed), "$X" (append X), "^X" (prepend X) and "sXY" (replace every X
+ * with Y). Spaces between operations are ignored.
+ *
+ * rule: the rule
+ * word: buffer of RULE_BUFFER_LENGTH + 1 characters holding the word, which
+ * is changed in place
+ * length: length of the word, which is updated
+ *
+ * Returns: false if the word grew too long for the buffer or the rule has an
+ * operation that isn't known, otherwise true
+ */
+static bool apply_rule(const char* rule, char* word, int* length) {
+    int n = *length;
+
+    for (const char* op = rule; *op; op++) {
+        if (*op == ' ' || *op == ':') {
+            continue;
+        } else if (*op == 'l') {
+            change_case(word, n, 'l', 'l');
+        } else if (*op == 'u') {
+            change_case(word, n, 'u', 'u');
+        } else if (*op == 'c') {
+            change_case(word, n, 'u', 'l');
+        } else if (*op == 'C') {
+            change_case(word, n, 'l', 'u');
+        } else if (*op == 't') {
+            change_case(word, n, 't', 't');
+        } else if (*op == 'r' || *op == 'd' || *op == 'f') {
+            if (*op != 'r' && 2 * n > RULE_BUFFER_LENGTH) {
+                return false;
+            }
+            if (*op == 'd') {
+                memcpy(word + n, word, n);
+            } else {
+                // Reverse in place, or into the second half for f
+                int to = *op == 'f' ? n : 0;
+                for (int i = 0; i < n / 2 + n % 2; i++) {
+                    char c = word[i];
+                    word[to + i] = word[n - 1 - i];
+                    word[to + n - 1 - i] = c;
+                }
+            }
+            n = *op == 'r' ? n : 2 * n;
+        } else if ((*op == '$' || *op == '^') && op[1]) {
+            if (n + 1 > RULE_BUFFER_LENGTH) {
+                return false;
+            }
+            if (*op == '^') {
+                memmove(word + 1, word, n);
+                word[0] = op[1];
+            } else {
+                word[n] = op[1];
+            }
+            n++;
+            op++;
+        } else if (*op == 's' && op[1] && op[2]) {
+            for (int i = 0; i < n; i++) {
+                if (word[i] == op[1]) {
+                    word[i] = op[2];
+                }
+            }
+            op += 2;
+        } else {
+            return false;
+        }
+        word[n] = '\0';
+    }
+    *length = n;
+    return true;
+}
+
+/* change_case()
+ * -------------
+ * Changes the case of the letters of a word. Each change is 'l' (lower case),
+ * 'u' (upper case) or 't' (toggle).
+ *
+ * word: the word
+ * length: length of the word
+ * first: change to make to the first letter
+ * rest: change to make to the letters after it
+ */
+static void change_case(char* word, int length, char first, char rest) {
+    for (int i = 0; i < length; i++) {
+        char change = i == 0 ? first : rest;
+        unsigned char c = word[i];
+        if (change == 'l' || (change == 't' && isupper(c))) {
+            word[i] = tolower(c);
+        } else if (change == 'u' || change == 't') {
+            word[i] = toupper(c);
+        }
+    }
+}
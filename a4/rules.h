@@ -0,0 +1,26 @@
+#ifndef RULES_H
+#define RULES_H
+
+#include <stdbool.h>
+
+// A named set of hashcat-style word mangling rules. The first rule of every
+// set is ":" (the word as it is), so a later rule that leaves a word as it was
+// gives nothing new to hash.
+typedef struct {
+    const char* name;
+    const char* const* rules;
+    int numRules;
+} RuleSet;
+
+// Finds one of the built in rule sets ("case", "digits", "leet", "reverse"
+// or "best") by name. Returns null if there isn't one with that name.
+const RuleSet* find_rule_set(const char* name);
+
+// Applies rule number rule of a set to a word, writing the candidate (of at
+// most MAX_WORD_LENGTH characters) to candidate. Returns false if the
+// candidate would be too long, or is the word unchanged by a rule other than
+// the first.
+bool rule_set_apply(const RuleSet* set, int rule, const char* word,
+        char* candidate);
+
+#endif
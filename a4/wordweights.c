@@ -0,0 +1,224 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "wordweights.h"
+
+// A word's weight and position, sorted to put the words in weight order
+typedef struct {
+    uint32_t weight;
+    int position;
+} WeightedWord;
+
+static char** sort_words(const Dictionary* dict);
+static int find_word(const Dictionary* dict, char** sorted, const char* word);
+static void add_weight(uint32_t* weight, uint64_t amount);
+static int compare_strings(const void* a, const void* b);
+static int compare_weighted_words(const void* a, const void* b);
+
+/* load_word_weights()
+ * -------------------
+ * Reads a weights file, adding the count on each line to the weight of the
+ * word that follows it (if the word is in the dictionary). The count and the
+ * word are separated by spaces, and a word can itself have spaces in it.
+ *
+ * fileName: name of the weights file
+ * dict: the dictionary
+ * weights: weights of the dictionary's words, added to
+ *
+ * Returns: false if the file couldn't be opened, otherwise true
+ */
+bool load_word_weights(const char* fileName, const Dictionary* dict,
+        uint32_t* weights) {
+    FILE* file = fopen(fileName, "r");
+    char* line = NULL;
+    size_t size = 0;
+    ssize_t length;
+
+    if (!file) {
+        return false;
+    }
+    char** sorted = sort_words(dict);
+    while ((length = getline(&line, &size, file)) > 0) {
+        if (line[length - 1] == '\n') {
+            line[--length] = '\0';
+        }
+        char* word;
+        unsigned long long count = strtoull(line, &word, 10);
+        if (word == line || *word != ' ') {
+            continue;
+        }
+        while (*word == ' ') {
+            word++;
+        }
+        int position = find_word(dict, sorted, word);
+        if (position >= 0) {
+            add_weight(&weights[position], count);
+        }
+    }
+    free(line);
+    free(sorted);
+    fclose(file);
+    return true;
+}
+
+/* carry_word_weights()
+ * --------------------
+ * Adds each word's weight in one dictionary to the same word's weight in
+ * another. Words that are only in one of them are left as they are.
+ *
+ * from: dictionary to take the weights from
+ * fromWeights: weights of its words
+ * to: dictionary to add the weights to
+ * toWeights: weights of its words, added to
+ */
+void carry_word_weights(const Dictionary* from, const uint32_t* fromWeights,
+        const Dictionary* to, uint32_t* toWeights) {
+    char** sorted = sort_words(to);
+
+    for (int i = 0; i < from->numWords; i++) {
+        int position = fromWeights[i] ? find_word(to, sorted, from->words[i])
+                : -1;
+        if (position >= 0) {
+            add_weight(&toWeights[position], fromWeights[i]);
+        }
+    }
+    free(sorted);
+}
+
+/* word_position()
+ * ---------------
+ * Finds one of a dictionary's words by its address with a binary search,
+ * since the words are stored one after another in the arena.
+ *
+ * dict: the dictionary, with its words in the order they were read
+ * word: the word
+ *
+ * Returns: the word's position, or -1 if the word isn't in the dictionary's
+ * arena
+ */
+int word_position(const Dictionary* dict, const char* word) {
+    int low = 0;
+    int high = dict->numWords - 1;
+
+    while (low <= high) {
+        int middle = low + (high - low) / 2;
+        if (dict->words[middle] == word) {
+            return middle;
+        } else if (dict->words[middle] < word) {
+            low = middle + 1;
+        } else {
+            high = middle - 1;
+        }
+    }
+    return -1;
+}
+
+/* order_by_weight()
+ * -----------------
+ * Sorts a dictionary's words by weight, from the highest to the lowest. Ties
+ * are broken by position, so the order is the same every time.
+ *
+ * dict: the dictionary
+ * weights: weights of its words
+ *
+ * Returns: the sorted words array, which points at the dictionary's words
+ */
+char** order_by_weight(const Dictionary* dict, const uint32_t* weights) {
+    WeightedWord* weighted = malloc(sizeof(WeightedWord) * dict->numWords);
+    char** words = malloc(sizeof(char*) * dict->numWords);
+
+    for (int i = 0; i < dict->numWords; i++) {
+        weighted[i].weight = __atomic_load_n(&weights[i], __ATOMIC_RELAXED);
+        weighted[i].position = i;
+    }
+    qsort(weighted, dict->numWords, sizeof(WeightedWord),
+            compare_weighted_words);
+    for (int i = 0; i < dict->numWords; i++) {
+        words[i] = dict->words[weighted[i].position];
+    }
+    free(weighted);
+    return words;
+}
+
+/* sort_words()
+ * ------------
+ * Makes a copy of a dictionary's words array sorted alphabetically, so that
+ * words can be found with a binary search.
+ *
+ * dict: the dictionary
+ *
+ * Returns: the sorted words array
+ */
+static char** sort_words(const Dictionary* dict) {
+    char** sorted = malloc(sizeof(char*) * dict->numWords);
+
+    memcpy(sorted, dict->words, sizeof(char*) * dict->numWords);
+    qsort(sorted, dict->numWords, sizeof(char*), compare_strings);
+    return sorted;
+}
+
+/* find_word()
+ * -----------
+ * Finds a word in a dictionary by its text.
+ *
+ * dict: the dictionary
+ * sorted: the dictionary's words from sort_words()
+ * word: the word to find
+ *
+ * Returns: the word's position in the dictionary, or -1 if it isn't in it
+ */
+static int find_word(const Dictionary* dict, char** sorted, const char* word) {
+    char** found = bsearch(&word, sorted, dict->numWords, sizeof(char*),
+            compare_strings);
+
+    return found ? word_position(dict, *found) : -1;
+}
+
+/* add_weight()
+ * ------------
+ * Adds to a weight, stopping at the largest weight rather than wrapping
+ * around.
+ *
+ * weight: the weight
+ * amount: amount to add
+ */
+static void add_weight(uint32_t* weight, uint64_t amount) {
+    uint64_t total = *weight + amount;
+
+    *weight = total > UINT32_MAX ? UINT32_MAX : total;
+}
+
+/* compare_strings()
+ * -----------------
+ * qsort() and bsearch() comparison function for an array of strings.
+ *
+ * a: pointer to the first string
+ * b: pointer to the second string
+ *
+ * Returns: how the strings compare, as for strcmp()
+ */
+static int compare_strings(const void* a, const void* b) {
+    return strcmp(*(char* const*)a, *(char* const*)b);
+}
+
+/* compare_weighted_words()
+ * ------------------------
+ * qsort() comparison function that puts weighted words in order of weight
+ * (highest first), then position.
+ *
+ * a: pointer to the first WeightedWord
+ * b: pointer to the second WeightedWord
+ *
+ * Returns: negative if a comes first, positive if b comes first
+ */
+static int compare_weighted_words(const void* a, const void* b) {
+    const WeightedWord* first = a;
+    const WeightedWord* second = b;
+
+    if (first->weight != second->weight) {
+        return first->weight > second->weight ? -1 : 1;
+    }
+    return first->position - second->position;
+}
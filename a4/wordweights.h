@@ -0,0 +1,29 @@
+#ifndef WORDWEIGHTS_H
+#define WORDWEIGHTS_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "dictionary.h"
+
+// Adds the weights in a weights file to the weights of a dictionary's words
+// (which are in the same order as its words). Each line is a count followed
+// by a word, as printed by "sort | uniq -c". Lines for words that aren't in
+// the dictionary, and lines that don't start with a count, are skipped.
+// Returns false if the file couldn't be opened.
+bool load_word_weights(const char* fileName, const Dictionary* dict,
+        uint32_t* weights);
+
+// Adds the weights of one dictionary's words to the same words of another
+// (eg when a dictionary is read again)
+void carry_word_weights(const Dictionary* from, const uint32_t* fromWeights,
+        const Dictionary* to, uint32_t* toWeights);
+
+// Finds the position of one of a dictionary's words from its address (the
+// words are in address order). Returns -1 if it isn't one of its words.
+int word_position(const Dictionary* dict, const char* word);
+
+// Allocates a words array of a dictionary's words ordered from the highest
+// to the lowest weight. Words with the same weight stay in dictionary order.
+char** order_by_weight(const Dictionary* dict, const uint32_t* weights);
+
+#endif